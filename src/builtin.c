@@ -2,10 +2,13 @@
 #include "lavender.h"
 #include "expression.h"
 #include "operator.h"
+#include "vect.h"
+#include "hashmap.h"
+#include "input.h"
+#include "number.h"
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
-#include <inttypes.h>
 #include <math.h>
 
 /**
@@ -29,7 +32,7 @@ static TextBufferObj undefined(TextBufferObj* args) {
     return res;
 }
 
-#define NUM_TYPES 6
+#define NUM_TYPES 7
 static LvString* types[NUM_TYPES];
 
 static void mkTypes(void) {
@@ -38,6 +41,7 @@ static void mkTypes(void) {
         types[i] = lv_alloc(sizeof(LvString) + sizeof(n)); \
         types[i]->len = sizeof(n) - 1; \
         types[i]->refCount = 1; \
+        types[i]->hash = 0; \
         memcpy(types[i]->value, n, sizeof(n))
     INIT(0, "undefined");
     INIT(1, "number");
@@ -45,12 +49,13 @@ static void mkTypes(void) {
     INIT(3, "vect");
     INIT(4, "function");
     INIT(5, "int");
+    INIT(6, "map");
     #undef INIT
 }
 
 /**
  * Returns the type of this object, as a string.
- * Possible types are: "undefined", "number", "int", "string", "vect", "function"
+ * Possible types are: "undefined", "number", "int", "string", "vect", "map", "function"
  */
 static TextBufferObj typeof_(TextBufferObj* args) {
 
@@ -72,6 +77,9 @@ static TextBufferObj typeof_(TextBufferObj* args) {
         case OPT_VECT:
             res.str = types[3];
             break;
+        case OPT_MAP:
+            res.str = types[6];
+            break;
         case OPT_CAPTURE:
         case OPT_FUNCTION_VAL:
             res.str = types[4];
@@ -88,6 +96,46 @@ static void incRefCount(TextBufferObj* obj) {
         ++*obj->refCount;
 }
 
+/**
+ * Returns whether the given argument holds the only reference to its
+ * object. Arguments are owned by the stack, so a refCount of one means
+ * nothing else can observe the object being modified, unless the
+ * argument borrows the reference of a param or literal.
+ */
+static bool isUnique(TextBufferObj* obj) {
+
+    return (obj->type & LV_DYNAMIC) && *obj->refCount == 1 && !lv_isBorrowed(obj);
+}
+
+/**
+ * Takes the reference held by the given argument. The argument is
+ * cleared so popping the arguments does not free the object, and
+ * the returned object has a refCount of zero like any new result.
+ * The caller is about to modify the object, so its cached hash
+ * is dropped.
+ */
+static TextBufferObj take(TextBufferObj* obj) {
+
+    TextBufferObj res = *obj;
+    --*res.refCount;
+    if(res.type == OPT_STRING)
+        res.str->hash = 0;
+    else if(res.type == OPT_VECT)
+        res.vect->hash = 0;
+    obj->type = OPT_UNDEFINED;
+    return res;
+}
+
+//rounds up the capacity of objects grown in place so that
+//appending one element at a time reallocates log(n) times
+static size_t growCap(size_t len) {
+
+    size_t cap = 16;
+    while(cap < len)
+        cap <<= 1;
+    return cap;
+}
+
 static inline bool isNegative(uint64_t repr) {
 
     return repr >> 63;
@@ -98,12 +146,7 @@ static int intCmp(uint64_t a, uint64_t b) {
 
     if(a == b)
         return 0;
-    bool negA = isNegative(a);
-    bool negB = isNegative(b);
-    if(negA || negB)
-        return a < b ? 1 : -1;
-    else
-        return a < b ? -1 : 1;
+    return (int64_t)a < (int64_t)b ? -1 : 1;
 }
 
 /** Converts a Lavender int to a num. */
@@ -125,7 +168,7 @@ static TextBufferObj cval(TextBufferObj* args) {
     TextBufferObj res;
     if((args[0].type == OPT_CAPTURE)
     && (args[1].type == OPT_INTEGER)
-    && (!isNegative(args[1].integer) && args[1].integer < args[0].capfunc->captureCount)) {
+    && (!isNegative(args[1].integer) && args[1].integer < args[0].capture->func->captureCount)) {
         res = args[0].capture->value[(size_t)args[1].integer];
     } else {
         res.type = OPT_UNDEFINED;
@@ -135,28 +178,54 @@ static TextBufferObj cval(TextBufferObj* args) {
 
 /**
  * Flattens the given vectors and elements into a single
- * vector of elements.
+ * vector of elements. If the first element is a vect that
+ * nothing else refers to, the rest are appended to it in place.
+ * Large results share structure with the given vectors.
  */
 static TextBufferObj cat(TextBufferObj* args) {
 
     TextBufferObj res;
     res.type = OPT_VECT;
-    assert(args[0].type == OPT_VECT);
+    assert(args[0].type == OPT_VECT && !args[0].vect->root);
+    LvVect* parts = args[0].vect;
     size_t len = 0;
-    for(size_t i = 0; i < args[0].vect->len; i++) {
-        TextBufferObj* obj = &args[0].vect->data[i];
+    for(size_t i = 0; i < parts->len; i++) {
+        TextBufferObj* obj = &parts->data[i];
         len += obj->type == OPT_VECT ? obj->vect->len : 1;
     }
-    res.vect = lv_alloc(sizeof(LvVect) + len * sizeof(TextBufferObj));
-    res.vect->refCount = 0;
-    res.vect->len = len;
     size_t idx = 0;
-    for(size_t i = 0; i < args[0].vect->len; i++) {
-        TextBufferObj* obj = &args[0].vect->data[i];
+    size_t first = 0;
+    if(isUnique(&args[0]) && parts->len > 0 && parts->data[0].type == OPT_VECT
+        && isUnique(&parts->data[0]) && !parts->data[0].vect->root) {
+        //grow the first vect instead of copying it
+        res = take(&parts->data[0]);
+        idx = res.vect->len;
+        res.vect = lv_realloc(res.vect, sizeof(LvVect) + growCap(len) * sizeof(TextBufferObj));
+        first = 1;
+    } else if(len > LV_VECT_FLAT_MAX) {
+        //build up a tree vect one part at a time
+        LvVect* vect = lv_vect_alloc(0);
+        for(size_t i = 0; i < parts->len; i++) {
+            TextBufferObj* obj = &parts->data[i];
+            LvVect* next = obj->type == OPT_VECT ?
+                lv_vect_cat(vect, obj->vect) : lv_vect_append(vect, obj);
+            if(next != vect && vect->refCount == 0)
+                lv_vect_free(vect);
+            vect = next;
+        }
+        res.vect = vect;
+        return res;
+    } else {
+        res.vect = lv_vect_alloc(len);
+    }
+    res.vect->len = len;
+    for(size_t i = first; i < parts->len; i++) {
+        TextBufferObj* obj = &parts->data[i];
         if(obj->type == OPT_VECT) {
-            for(int j = 0; j < obj->vect->len; j++) {
-                incRefCount(&obj->vect->data[j]);
-                res.vect->data[idx++] = obj->vect->data[j];
+            for(size_t j = 0; j < obj->vect->len; j++) {
+                TextBufferObj* elem = lv_vect_at(obj->vect, j);
+                incRefCount(elem);
+                res.vect->data[idx++] = *elem;
             }
         } else {
             incRefCount(obj);
@@ -178,6 +247,14 @@ static TextBufferObj call(TextBufferObj* args) {
     TextBufferObj func = args[0];
     if(args[1].type != OPT_VECT) {
         res.type = OPT_UNDEFINED;
+    } else if(args[1].vect->root) {
+        //tree vects are not contiguous
+        LvVect* vect = args[1].vect;
+        TextBufferObj* tmp = lv_alloc(vect->len * sizeof(TextBufferObj));
+        for(size_t i = 0; i < vect->len; i++)
+            tmp[i] = *lv_vect_at(vect, i);
+        lv_callFunction(&func, vect->len, tmp, &res);
+        lv_free(tmp);
     } else {
         lv_callFunction(&func, args[1].vect->len, args[1].vect->data, &res);
     }
@@ -185,23 +262,31 @@ static TextBufferObj call(TextBufferObj* args) {
 }
 
 /**
- * Returns the i'th element of the given string or vect.
+ * Returns the i'th element of the given string or vect,
+ * or the value of the given key in the given map.
  */
 static TextBufferObj at(TextBufferObj* args) {
 
     TextBufferObj res;
-    if(args[0].type == OPT_INTEGER) {
+    if(args[1].type == OPT_MAP) {
+        TextBufferObj* value = lv_map_get(args[1].map, &args[0]);
+        if(value)
+            res = *value;
+        else
+            res.type = OPT_UNDEFINED;
+    } else if(args[0].type == OPT_INTEGER) {
         if(args[1].type == OPT_STRING
         && !isNegative(args[0].integer) && args[0].integer < args[1].str->len) {
             res.type = OPT_STRING;
             res.str = lv_alloc(sizeof(LvString) + 2);
             res.str->refCount = 0;
+            res.str->hash = 0;
             res.str->len = 1;
             res.str->value[0] = args[1].str->value[(size_t)args[0].integer];
             res.str->value[1] = '\0';
         } else if(args[1].type == OPT_VECT
             && !isNegative(args[0].integer) && args[0].integer < args[1].vect->len) {
-            res = args[1].vect->data[(size_t)args[0].integer];
+            res = *lv_vect_at(args[1].vect, (size_t)args[0].integer);
         } else {
             res.type = OPT_UNDEFINED;
         }
@@ -219,6 +304,7 @@ bool lv_blt_toBool(TextBufferObj* obj) {
         case OPT_INTEGER: return obj->integer != 0;
         case OPT_STRING: return obj->str->len != 0;
         case OPT_VECT: return obj->vect->len != 0;
+        case OPT_MAP: return obj->map->len != 0;
         default: return true;
     }
 }
@@ -263,11 +349,9 @@ static TextBufferObj int_(TextBufferObj* args) {
             res.integer = (uint64_t) mag;
         }
     } else if(args[0].type == OPT_STRING) {
-        char* rest;
         LvString* str = args[0].str;
-        //unsigned negation is the same as two's complement negation
-        uint64_t i64 = (uint64_t) strtoumax(str->value, &rest, 10);
-        if(rest != str->value + str->len) {
+        uint64_t i64;
+        if(!lv_num_parseInteger(str->value, str->len, &i64)) {
             //not all chars interpreted
             res.type = OPT_UNDEFINED;
         } else {
@@ -290,10 +374,9 @@ static TextBufferObj num(TextBufferObj* args) {
         res.type = OPT_NUMBER;
         res.number = intToNum(args[0].integer);
     } else if(args[0].type == OPT_STRING) {
-        char* rest;
         LvString* str = args[0].str;
-        double d = strtod(str->value, &rest);
-        if(rest != str->value + str->len) {
+        double d;
+        if(!lv_num_parseNumber(str->value, str->len, &d)) {
             //not all chars interpreted, error
             res.type = OPT_UNDEFINED;
         } else {
@@ -325,18 +408,31 @@ static TextBufferObj len(TextBufferObj* args) {
             break;
         case OPT_CAPTURE:
             res.type = OPT_INTEGER;
-            res.integer = args[0].capfunc->arity - args[0].capfunc->captureCount;
+            res.integer = args[0].capture->func->arity - args[0].capture->func->captureCount;
             break;
         case OPT_VECT:
             res.type = OPT_INTEGER;
             res.integer = args[0].vect->len;
             break;
+        case OPT_MAP:
+            res.type = OPT_INTEGER;
+            res.integer = args[0].map->len;
+            break;
         default:
             res.type = OPT_UNDEFINED;
     }
     return res;
 }
 
+static bool containsEntry(LvMapEntry* entry, void* map);
+
+//cached hashes are only compared when both have been computed,
+//computing one just to compare would cost as much as comparing
+static bool hashesDiffer(uint64_t a, uint64_t b) {
+
+    return a && b && a != b;
+}
+
 static bool equal(TextBufferObj* a, TextBufferObj* b) {
 
     if(a->type != b->type) {
@@ -352,15 +448,17 @@ static bool equal(TextBufferObj* a, TextBufferObj* b) {
         case OPT_INTEGER:
             return a->integer == b->integer;
         case OPT_STRING:
-            //strings use value equality
-            return (a->str->len == a->str->len)
-                && (strcmp(a->str->value, b->str->value) == 0);
+            //strings use value equality, most unequal strings
+            //differ in length or in an already computed hash
+            return (a->str->len == b->str->len)
+                && !hashesDiffer(a->str->hash, b->str->hash)
+                && (memcmp(a->str->value, b->str->value, a->str->len) == 0);
         case OPT_FUNCTION_VAL:
             return a->func == b->func;
         case OPT_CAPTURE:
-            if(a->capfunc != b->capfunc)
+            if(a->capture->func != b->capture->func)
                 return false;
-            for(int i = 0; i < a->capfunc->captureCount; i++) {
+            for(int i = 0; i < a->capture->func->captureCount; i++) {
                 if(!equal(&a->capture->value[i], &b->capture->value[i]))
                     return false;
             }
@@ -368,16 +466,112 @@ static bool equal(TextBufferObj* a, TextBufferObj* b) {
         case OPT_VECT:
             if(a->vect->len != b->vect->len)
                 return false;
+            if(hashesDiffer(a->vect->hash, b->vect->hash))
+                return false;
             for(size_t i = 0; i < a->vect->len; i++) {
-                if(!equal(&a->vect->data[i], &b->vect->data[i]))
+                if(!equal(lv_vect_at(a->vect, i), lv_vect_at(b->vect, i)))
                     return false;
             }
             return true;
+        case OPT_MAP:
+            //maps are equal if they have the same entries
+            return (a->map->len == b->map->len)
+                && lv_map_forEach(a->map, containsEntry, b->map);
         default:
             assert(false);
     }
 }
 
+//returns whether the map has an entry equal to the given entry
+static bool containsEntry(LvMapEntry* entry, void* map) {
+
+    TextBufferObj* value = lv_map_get(map, &entry->key);
+    return value && equal(value, &entry->value);
+}
+
+bool lv_blt_equal(TextBufferObj* a, TextBufferObj* b) {
+
+    return equal(a, b);
+}
+
+//finalizer from splitmix64
+static uint64_t mix(uint64_t h) {
+
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111eb;
+    h ^= h >> 31;
+    return h;
+}
+
+//0 marks a hash that has not been computed yet
+static uint64_t nonZero(uint64_t h) {
+
+    return h ? h : 1;
+}
+
+static bool hashEntry(LvMapEntry* entry, void* sum) {
+
+    //entries are summed so the order does not matter
+    *(uint64_t*)sum += mix(entry->hash + 31 * lv_blt_hash(&entry->value));
+    return true;
+}
+
+uint64_t lv_blt_hash(TextBufferObj* obj) {
+
+    uint64_t h = obj->type;
+    switch(obj->type) {
+        case OPT_UNDEFINED:
+            break;
+        case OPT_NUMBER: {
+            //0.0 and -0.0 are equal
+            double d = obj->number == 0.0 ? 0.0 : obj->number;
+            uint64_t bits;
+            memcpy(&bits, &d, sizeof(bits));
+            h ^= bits;
+            break;
+        }
+        case OPT_INTEGER:
+            h ^= obj->integer;
+            break;
+        case OPT_STRING:
+            if(obj->str->hash)
+                return obj->str->hash;
+            //FNV-1a
+            h ^= 0xcbf29ce484222325;
+            for(size_t i = 0; i < obj->str->len; i++) {
+                h ^= (unsigned char)obj->str->value[i];
+                h *= 0x100000001b3;
+            }
+            return obj->str->hash = nonZero(mix(h));
+        case OPT_FUNCTION_VAL:
+            h ^= (uintptr_t)obj->func;
+            break;
+        case OPT_CAPTURE:
+            h ^= (uintptr_t)obj->capture->func;
+            for(int i = 0; i < obj->capture->func->captureCount; i++)
+                h = mix(h) + lv_blt_hash(&obj->capture->value[i]);
+            break;
+        case OPT_VECT:
+            if(obj->vect->hash)
+                return obj->vect->hash;
+            h ^= obj->vect->len;
+            for(size_t i = 0; i < obj->vect->len; i++)
+                h = mix(h) + lv_blt_hash(lv_vect_at(obj->vect, i));
+            return obj->vect->hash = nonZero(mix(h));
+        case OPT_MAP: {
+            uint64_t sum = 0;
+            lv_map_forEach(obj->map, hashEntry, &sum);
+            h ^= sum;
+            break;
+        }
+        default:
+            assert(false);
+    }
+    return mix(h);
+}
+
 /**
  * Compares two objects for equality.
  */
@@ -407,31 +601,41 @@ static bool ltImpl(TextBufferObj* a, TextBufferObj* b) {
         case OPT_INTEGER:
             return intCmp(a->integer, b->integer) < 0;
             break;
-        case OPT_STRING:
-            return (strcmp(a->str->value, b->str->value) < 0);
-            break;
+        case OPT_STRING: {
+            size_t alen = a->str->len;
+            size_t blen = b->str->len;
+            int cmp = memcmp(a->str->value, b->str->value, alen < blen ? alen : blen);
+            return cmp < 0 || (cmp == 0 && alen < blen);
+        }
         case OPT_FUNCTION_VAL:
             return (uintptr_t)a->func < (uintptr_t)b->func;
             break;
         //captures and vects compare the first nonequal values
         case OPT_CAPTURE:
-            if(a->capfunc == b->capfunc) {
-                for(int i = 0; i < a->capfunc->captureCount; i++) {
+            if(a->capture->func == b->capture->func) {
+                for(int i = 0; i < a->capture->func->captureCount; i++) {
                     if(!equal(&a->capture->value[i], &b->capture->value[i]))
                         return ltImpl(&a->capture->value[i], &b->capture->value[i]);
                 }
                 return false;
             }
-            return (uintptr_t)a->capfunc < (uintptr_t)b->capfunc;
+            return (uintptr_t)a->capture->func < (uintptr_t)b->capture->func;
         case OPT_VECT:
             if(a->vect->len == b->vect->len) {
                 for(size_t i = 0; i < a->vect->len; i++) {
-                    if(!equal(&a->vect->data[i], &b->vect->data[i]))
-                        return ltImpl(&a->vect->data[i], &b->vect->data[i]);
+                    TextBufferObj* ea = lv_vect_at(a->vect, i);
+                    TextBufferObj* eb = lv_vect_at(b->vect, i);
+                    if(!equal(ea, eb))
+                        return ltImpl(ea, eb);
                 }
                 return false;
             }
             return a->vect->len < b->vect->len;
+        //maps have no natural order, so compare sizes then hashes
+        case OPT_MAP:
+            if(a->map->len == b->map->len)
+                return lv_blt_hash(a) < lv_blt_hash(b);
+            return a->map->len < b->map->len;
         default:
             assert(false);
     }
@@ -522,10 +726,18 @@ static TextBufferObj add(TextBufferObj* args) {
         //string concatenation
         size_t alen = args[0].str->len;
         size_t blen = args[1].str->len;
-        LvString* str = lv_alloc(sizeof(LvString) + alen + blen + 1);
-        str->refCount = 0;
+        LvString* str;
+        if(isUnique(&args[0])) {
+            //append to the left string in place
+            str = take(&args[0]).str;
+            str = lv_realloc(str, sizeof(LvString) + growCap(alen + blen + 1));
+        } else {
+            str = lv_alloc(sizeof(LvString) + alen + blen + 1);
+            str->refCount = 0;
+            str->hash = 0;
+            memcpy(str->value, args[0].str->value, alen);
+        }
         str->len = alen + blen;
-        memcpy(str->value, args[0].str->value, alen);
         memcpy(str->value + alen, args[1].str->value, blen);
         str->value[alen + blen] = '\0';
         res.type = OPT_STRING;
@@ -873,16 +1085,26 @@ static TextBufferObj sgn(TextBufferObj* args) {
 static TextBufferObj map(TextBufferObj* args) {
 
     TextBufferObj res;
-    if(args[0].type == OPT_VECT) {
+    if(args[0].type == OPT_VECT && isUnique(&args[0]) && !args[0].vect->root) {
+        //replace each element in place
+        TextBufferObj func = args[1]; //in case the stack is reallocated
+        res = take(&args[0]);
+        LvVect* vect = res.vect;
+        for(size_t i = 0; i < vect->len; i++) {
+            TextBufferObj obj;
+            lv_callFunction(&func, 1, &vect->data[i], &obj);
+            incRefCount(&obj);
+            lv_expr_cleanup(&vect->data[i], 1);
+            vect->data[i] = obj;
+        }
+    } else if(args[0].type == OPT_VECT) {
         TextBufferObj func = args[1]; //in case the stack is reallocated
-        TextBufferObj* oldData = args[0].vect->data;
-        size_t len = args[0].vect->len;
-        LvVect* vect = lv_alloc(sizeof(LvVect) + len * sizeof(TextBufferObj));
-        vect->refCount = 0;
-        vect->len = len;
+        LvVect* old = args[0].vect;
+        size_t len = old->len;
+        LvVect* vect = lv_vect_alloc(len);
         for(size_t i = 0; i < len; i++) {
             TextBufferObj obj;
-            lv_callFunction(&func, 1, &oldData[i], &obj);
+            lv_callFunction(&func, 1, lv_vect_at(old, i), &obj);
             incRefCount(&obj);
             vect->data[i] = obj;
         }
@@ -898,20 +1120,40 @@ static TextBufferObj map(TextBufferObj* args) {
 static TextBufferObj filter(TextBufferObj* args) {
 
     TextBufferObj res;
-    if(args[0].type == OPT_VECT) {
+    if(args[0].type == OPT_VECT && isUnique(&args[0]) && !args[0].vect->root) {
+        //compact the kept elements in place
+        TextBufferObj func = args[1];
+        res = take(&args[0]);
+        LvVect* vect = res.vect;
+        size_t newLen = 0;
+        for(size_t i = 0; i < vect->len; i++) {
+            TextBufferObj passed;
+            lv_callFunction(&func, 1, &vect->data[i], &passed);
+            incRefCount(&passed);
+            if(lv_blt_toBool(&passed)) {
+                vect->data[newLen] = vect->data[i];
+                newLen++;
+            } else {
+                lv_expr_cleanup(&vect->data[i], 1);
+            }
+            lv_expr_cleanup(&passed, 1);
+        }
+        vect->len = newLen;
+        res.vect = lv_realloc(vect, sizeof(LvVect) + newLen * sizeof(TextBufferObj));
+    } else if(args[0].type == OPT_VECT) {
         TextBufferObj func = args[1];
-        TextBufferObj* oldData = args[0].vect->data;
-        size_t len = args[0].vect->len;
-        LvVect* vect = lv_alloc(sizeof(LvVect) + len * sizeof(TextBufferObj));
-        vect->refCount = 0;
+        LvVect* old = args[0].vect;
+        size_t len = old->len;
+        LvVect* vect = lv_vect_alloc(len);
         size_t newLen = 0;
         for(size_t i = 0; i < len; i++) {
             TextBufferObj passed;
-            lv_callFunction(&func, 1, &oldData[i], &passed);
+            TextBufferObj* elem = lv_vect_at(old, i);
+            lv_callFunction(&func, 1, elem, &passed);
             incRefCount(&passed); //so lv_expr_cleanup doesn't blow up
             if(lv_blt_toBool(&passed)) {
-                incRefCount(&oldData[i]);
-                vect->data[newLen] = oldData[i];
+                incRefCount(elem);
+                vect->data[newLen] = *elem;
                 newLen++;
             }
             lv_expr_cleanup(&passed, 1);
@@ -931,12 +1173,11 @@ static TextBufferObj fold(TextBufferObj* args) {
 
     TextBufferObj res;
     if(args[0].type == OPT_VECT) {
-        size_t len = args[0].vect->len;
-        TextBufferObj* oldData = args[0].vect->data;
+        LvVect* vect = args[0].vect;
         TextBufferObj accum[2] = { args[1] };
         TextBufferObj func = args[2];
-        for(size_t i = 0; i < len; i++) {
-            accum[1] = oldData[i];
+        for(size_t i = 0; i < vect->len; i++) {
+            accum[1] = *lv_vect_at(vect, i);
             lv_callFunction(&func, 2, accum, &accum[0]);
         }
         res = accum[0];
@@ -967,28 +1208,37 @@ static TextBufferObj slice(TextBufferObj* args) {
             //bounds check
             if((size_t)start > len || (size_t)end > len) {
                 res.type = OPT_UNDEFINED;
+            } else if(isUnique(&args[0]) && !args[0].vect->root) {
+                //drop the elements outside the slice in place
+                res = take(&args[0]);
+                LvVect* vect = res.vect;
+                lv_expr_cleanup(vect->data, start);
+                lv_expr_cleanup(vect->data + end, len - end);
+                memmove(vect->data, vect->data + start, (end - start) * sizeof(TextBufferObj));
+                vect->len = end - start;
+                res.vect = lv_realloc(vect, sizeof(LvVect) + vect->len * sizeof(TextBufferObj));
             } else {
-                //create new vect
                 res.type = OPT_VECT;
-                res.vect = lv_alloc(sizeof(LvVect) + (end - start) * sizeof(TextBufferObj));
-                res.vect->refCount = 0;
-                res.vect->len = end - start;
-                //copy over elements
-                for(size_t i = 0; i < res.vect->len; i++) {
-                    res.vect->data[i] = args[0].vect->data[start + i];
-                    incRefCount(&res.vect->data[i]);
-                }
+                res.vect = lv_vect_slice(args[0].vect, start, end);
             }
         } else if(args[0].type == OPT_STRING) {
             size_t len = args[0].str->len;
             //bounds check
             if((size_t)start > len || (size_t)end > len) {
                 res.type = OPT_UNDEFINED;
+            } else if(isUnique(&args[0])) {
+                //shift the slice to the front in place
+                res = take(&args[0]);
+                LvString* str = res.str;
+                memmove(str->value, str->value + start, end - start);
+                str->len = end - start;
+                str->value[str->len] = '\0';
             } else {
                 //create new string (include NUL terminator)
                 res.type = OPT_STRING;
                 res.str = lv_alloc(sizeof(LvString) + (end - start + 1));
                 res.str->refCount = 0;
+                res.str->hash = 0;
                 res.str->len = end - start;
                 //copy over elements
                 memcpy(res.str->value, &args[0].str->value[start], res.str->len);
@@ -1001,6 +1251,324 @@ static TextBufferObj slice(TextBufferObj* args) {
     return res;
 }
 
+/** Replaces the i'th element of the given vect */
+static TextBufferObj update(TextBufferObj* args) {
+
+    TextBufferObj res;
+    if(args[0].type == OPT_VECT && args[1].type == OPT_INTEGER
+        && !isNegative(args[1].integer) && args[1].integer < args[0].vect->len) {
+        size_t idx = (size_t)args[1].integer;
+        if(isUnique(&args[0]) && !args[0].vect->root) {
+            //replace the element in place
+            res = take(&args[0]);
+            incRefCount(&args[2]);
+            lv_expr_cleanup(&res.vect->data[idx], 1);
+            res.vect->data[idx] = args[2];
+        } else {
+            res.type = OPT_VECT;
+            res.vect = lv_vect_update(args[0].vect, idx, &args[2]);
+        }
+    } else {
+        res.type = OPT_UNDEFINED;
+    }
+    return res;
+}
+
+/**
+ * Comparator for sorting. If func is NULL the default ordering
+ * is used directly.
+ */
+typedef struct SortCmp {
+    TextBufferObj* func;
+} SortCmp;
+
+static bool sortLess(SortCmp* cmp, TextBufferObj* a, TextBufferObj* b) {
+
+    if(!cmp->func)
+        return ltImpl(a, b);
+    TextBufferObj args[2] = { *a, *b };
+    TextBufferObj res;
+    lv_callFunction(cmp->func, 2, args, &res);
+    incRefCount(&res); //so lv_expr_cleanup doesn't blow up
+    bool less = lv_blt_toBool(&res);
+    lv_expr_cleanup(&res, 1);
+    return less;
+}
+
+/**
+ * Stable merge sort of data, using tmp as scratch space.
+ * Short runs are insertion sorted.
+ */
+static void mergeSort(SortCmp* cmp, TextBufferObj* data, TextBufferObj* tmp, size_t len) {
+
+    if(len <= 8) {
+        for(size_t i = 1; i < len; i++) {
+            TextBufferObj obj = data[i];
+            size_t j = i;
+            while(j > 0 && sortLess(cmp, &obj, &data[j - 1])) {
+                data[j] = data[j - 1];
+                j--;
+            }
+            data[j] = obj;
+        }
+        return;
+    }
+    size_t mid = len / 2;
+    mergeSort(cmp, data, tmp, mid);
+    mergeSort(cmp, data + mid, tmp, len - mid);
+    //already in order
+    if(!sortLess(cmp, &data[mid], &data[mid - 1]))
+        return;
+    memcpy(tmp, data, mid * sizeof(TextBufferObj));
+    size_t i = 0, j = mid, k = 0;
+    while(i < mid && j < len) {
+        //take from the right only if strictly less, for stability
+        if(sortLess(cmp, &data[j], &tmp[i]))
+            data[k++] = data[j++];
+        else
+            data[k++] = tmp[i++];
+    }
+    memcpy(data + k, tmp + i, (mid - i) * sizeof(TextBufferObj));
+}
+
+/**
+ * Returns whether sorting by the given comparator may use the
+ * default ordering directly. This holds for sys:__lt__, and for
+ * global:< if no element is object-like (and so might forward <).
+ */
+static bool isDefaultOrder(TextBufferObj* func, LvVect* vect) {
+
+    if(func->type != OPT_FUNCTION_VAL)
+        return false;
+    if(func->func == lv_op_getOperator("sys:__lt__", FNS_PREFIX))
+        return true;
+    if(func->func != lv_op_getOperator("global:<", FNS_INFIX))
+        return false;
+    for(size_t i = 0; i < vect->len; i++) {
+        OpType type = lv_vect_at(vect, i)->type;
+        if(type == OPT_CAPTURE || type == OPT_FUNCTION_VAL)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Stably sorts the given vect using the given "less than"
+ * comparison function.
+ */
+static TextBufferObj sort(TextBufferObj* args) {
+
+    TextBufferObj res;
+    if(args[0].type == OPT_VECT) {
+        TextBufferObj func = args[1]; //in case the stack is reallocated
+        SortCmp cmp = { isDefaultOrder(&func, args[0].vect) ? NULL : &func };
+        if(isUnique(&args[0]) && !args[0].vect->root) {
+            //sort in place
+            res = take(&args[0]);
+        } else {
+            LvVect* old = args[0].vect;
+            res.type = OPT_VECT;
+            res.vect = lv_vect_alloc(old->len);
+            for(size_t i = 0; i < old->len; i++) {
+                res.vect->data[i] = *lv_vect_at(old, i);
+                incRefCount(&res.vect->data[i]);
+            }
+        }
+        LvVect* vect = res.vect;
+        TextBufferObj* tmp = lv_alloc((vect->len / 2 + 1) * sizeof(TextBufferObj));
+        mergeSort(&cmp, vect->data, tmp, vect->len);
+        lv_free(tmp);
+    } else {
+        res.type = OPT_UNDEFINED;
+    }
+    return res;
+}
+
+//maps
+
+/**
+ * Associates a key with a value, or removes the key if the
+ * value is undefined. Maps never contain undefined values.
+ */
+static LvMap* assocOrDissoc(LvMap* map, TextBufferObj* key, TextBufferObj* value) {
+
+    if(value->type == OPT_UNDEFINED)
+        return lv_map_dissoc(map, key);
+    return lv_map_assoc(map, key, value);
+}
+
+/**
+ * Creates a hash map from the given keys and values,
+ * which alternate in the arguments.
+ */
+static TextBufferObj hashmap(TextBufferObj* args) {
+
+    TextBufferObj res;
+    LvVect* kvs = args[0].vect;
+    assert(!kvs->root);
+    if(kvs->len % 2 != 0) {
+        res.type = OPT_UNDEFINED;
+    } else {
+        LvMap* map = lv_map_alloc();
+        for(size_t i = 0; i < kvs->len; i += 2) {
+            LvMap* next = assocOrDissoc(map, &kvs->data[i], &kvs->data[i + 1]);
+            if(next != map)
+                lv_map_free(map);
+            map = next;
+        }
+        res.type = OPT_MAP;
+        res.map = map;
+    }
+    return res;
+}
+
+/** Returns the value of the given key in the given map */
+static TextBufferObj get(TextBufferObj* args) {
+
+    TextBufferObj res;
+    TextBufferObj* value = NULL;
+    if(args[0].type == OPT_MAP)
+        value = lv_map_get(args[0].map, &args[1]);
+    if(value)
+        res = *value;
+    else
+        res.type = OPT_UNDEFINED;
+    return res;
+}
+
+/** Returns the given map with the key set to the value */
+static TextBufferObj assoc(TextBufferObj* args) {
+
+    TextBufferObj res;
+    if(args[0].type == OPT_MAP) {
+        res.type = OPT_MAP;
+        res.map = assocOrDissoc(args[0].map, &args[1], &args[2]);
+    } else {
+        res.type = OPT_UNDEFINED;
+    }
+    return res;
+}
+
+/** Returns the given map without the key */
+static TextBufferObj dissoc(TextBufferObj* args) {
+
+    TextBufferObj res;
+    if(args[0].type == OPT_MAP) {
+        res.type = OPT_MAP;
+        res.map = lv_map_dissoc(args[0].map, &args[1]);
+    } else {
+        res.type = OPT_UNDEFINED;
+    }
+    return res;
+}
+
+static bool addEntry(LvMapEntry* entry, void* data) {
+
+    LvVect* vect = data;
+    LvVect* pair = lv_vect_alloc(2);
+    pair->refCount = 1;
+    pair->data[0] = entry->key;
+    pair->data[1] = entry->value;
+    incRefCount(&pair->data[0]);
+    incRefCount(&pair->data[1]);
+    vect->data[vect->len].type = OPT_VECT;
+    vect->data[vect->len++].vect = pair;
+    return true;
+}
+
+/**
+ * Returns the entries of the given map as a vect
+ * of { key, value } vects, in no particular order.
+ */
+static TextBufferObj entries(TextBufferObj* args) {
+
+    TextBufferObj res;
+    if(args[0].type == OPT_MAP) {
+        LvVect* vect = lv_vect_alloc(args[0].map->len);
+        vect->len = 0;
+        lv_map_forEach(args[0].map, addEntry, vect);
+        assert(vect->len == args[0].map->len);
+        res.type = OPT_VECT;
+        res.vect = vect;
+    } else {
+        res.type = OPT_UNDEFINED;
+    }
+    return res;
+}
+
+/**
+ * Returns the line starting at the given offset in the file at
+ * the given path, or stdin if the path is "-". See input.h.
+ */
+static TextBufferObj lineAt(TextBufferObj* args) {
+
+    TextBufferObj res;
+    res.type = OPT_UNDEFINED;
+    if(args[0].type == OPT_STRING && args[1].type == OPT_INTEGER && !isNegative(args[1].integer)) {
+        LvString* line = lv_in_lineAt(args[0].str->value, args[1].integer);
+        if(line) {
+            res.type = OPT_STRING;
+            res.str = line;
+        }
+    }
+    return res;
+}
+
+/**
+ * Returns the offset of the line after the line starting at the
+ * given offset in the file at the given path, or stdin if the path
+ * is "-". See input.h.
+ */
+static TextBufferObj nextLine(TextBufferObj* args) {
+
+    TextBufferObj res;
+    size_t next;
+    if(args[0].type == OPT_STRING && args[1].type == OPT_INTEGER && !isNegative(args[1].integer)
+        && lv_in_nextLine(args[0].str->value, args[1].integer, &next)) {
+        res.type = OPT_INTEGER;
+        res.integer = next;
+    } else {
+        res.type = OPT_UNDEFINED;
+    }
+    return res;
+}
+
+/**
+ * Returns the contents of the file at the given path as a
+ * string mapped from the file. See lv_in_mapFile.
+ */
+static TextBufferObj mapFile(TextBufferObj* args) {
+
+    TextBufferObj res;
+    res.type = OPT_UNDEFINED;
+    if(args[0].type == OPT_STRING) {
+        LvString* str = lv_in_mapFile(args[0].str->value);
+        if(str) {
+            res.type = OPT_STRING;
+            res.str = str;
+        }
+    }
+    return res;
+}
+
+/**
+ * Runs the requests string with a new -serve process, returning
+ * its replies. See lv_in_serve.
+ */
+static TextBufferObj serve(TextBufferObj* args) {
+
+    TextBufferObj res;
+    res.type = OPT_UNDEFINED;
+    if(args[0].type == OPT_STRING) {
+        LvString* str = lv_in_serve(args[0].str->value, args[0].str->len);
+        if(str) {
+            res.type = OPT_STRING;
+            res.str = str;
+        }
+    }
+    return res;
+}
+
 void lv_blt_onStartup(void) {
 
     mkTypes();
@@ -1072,6 +1640,17 @@ void lv_blt_onStartup(void) {
     MK_FUNCN(filter, 2);
     MK_FUNCN(fold, 3);
     MK_FUNCN(slice, 3);
+    MK_FUNCN(update, 3);
+    MK_FUNCN(sort, 2);
+    MK_FUNC(hashmap, 1); op->varargs = true;
+    MK_FUNCN(get, 2);
+    MK_FUNCN(assoc, 3);
+    MK_FUNCN(dissoc, 2);
+    MK_FUNCN(entries, 1);
+    MK_FUNCN(lineAt, 2);
+    MK_FUNCN(nextLine, 2);
+    MK_FUNCN(mapFile, 1);
+    MK_FUNCN(serve, 1);
     #undef MK_FUNC
     #undef MK_FUNCN
     #undef MK_FUNCR
@@ -1,9 +1,91 @@
 #ifndef BUILTIN_H
 #define BUILTIN_H
-#include "textbuffer_fwd.h"
+#include "textbuffer.h"
+#include <stdint.h>
 
 bool lv_blt_toBool(TextBufferObj* obj);
 
+/**
+ * Returns whether the two objects are structurally equal.
+ */
+bool lv_blt_equal(TextBufferObj* a, TextBufferObj* b);
+
+/**
+ * Hashes the object. Objects that are equal according
+ * to lv_blt_equal have the same hash.
+ */
+uint64_t lv_blt_hash(TextBufferObj* obj);
+
+/**
+ * Computes the given arithmetic builtin for two ints or two
+ * numbers, the same as the builtin would. Returns false if the
+ * builtin must be called for the operand types.
+ */
+static inline bool lv_blt_arith(int arith, TextBufferObj* args, TextBufferObj* res) {
+
+    switch(TYPE_PAIR(args[0].type, args[1].type)) {
+        case TYPE_PAIR(OPT_INTEGER, OPT_INTEGER): {
+            uint64_t a = args[0].integer;
+            uint64_t b = args[1].integer;
+            res->type = OPT_INTEGER;
+            switch(arith) {
+                case ARITH_ADD:
+                    res->integer = a + b;
+                    return true;
+                case ARITH_SUB:
+                    res->integer = a - b;
+                    return true;
+                case ARITH_MUL:
+                    res->integer = a * b;
+                    return true;
+                case ARITH_LT:
+                    res->integer = (int64_t)a < (int64_t)b;
+                    return true;
+                case ARITH_GE:
+                    res->integer = (int64_t)a >= (int64_t)b;
+                    return true;
+                default:
+                    return false;
+            }
+        }
+        case TYPE_PAIR(OPT_NUMBER, OPT_NUMBER): {
+            double a = args[0].number;
+            double b = args[1].number;
+            res->type = OPT_NUMBER;
+            switch(arith) {
+                case ARITH_ADD:
+                    res->number = a + b;
+                    return true;
+                case ARITH_SUB:
+                    res->number = a - b;
+                    return true;
+                case ARITH_MUL:
+                    res->number = a * b;
+                    return true;
+                case ARITH_DIV:
+                    //the builtin handles division by zero
+                    if(b == 0.0)
+                        return false;
+                    res->number = a / b;
+                    return true;
+                //comparisons are false for NaN
+                case ARITH_LT:
+                    res->type = OPT_INTEGER;
+                    res->integer = a < b;
+                    return true;
+                case ARITH_GE:
+                    res->type = OPT_INTEGER;
+                    res->integer = a >= b;
+                    return true;
+                default:
+                    return false;
+            }
+        }
+        default:
+            return false;
+    }
+}
+
 void lv_blt_onStartup(void);
 void lv_blt_onShutdown(void);
 
@@ -1,7 +1,9 @@
 #include "command.h"
 #include "lavender.h"
 #include "operator.h"
+#include "dynbuffer.h"
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
 
 typedef struct CommandElement {
@@ -50,6 +52,7 @@ typedef struct StrHashNode {
     //key and value must be dynamically allocated
     char* key;
     char* value;
+    size_t seq;     //order of addition, see visibleSeq
     struct StrHashNode* next;
 } StrHashNode;
 
@@ -66,6 +69,9 @@ static void tableClear(StrHashtable* table);
 static void tableResize(StrHashtable* table);
 static void nodeFree(StrHashNode* node);
 
+static size_t addedSeq;                 //number of entries ever added
+static size_t visibleSeq = SIZE_MAX;    //entries added later are hidden
+
 static size_t hash(char* str) {
     //djb2 hash
     size_t res = 5381;
@@ -81,7 +87,7 @@ static char* tableGet(StrHashtable* table, char* key) {
     StrHashNode* head = table->table[idx];
     while(head && strcmp(key, head->key) != 0)
         head = head->next;
-    return head ? head->value : NULL;
+    return head && head->seq <= visibleSeq ? head->value : NULL;
 }
 
 static bool tableAdd(StrHashtable* table, char* key, char* value) {
@@ -99,6 +105,7 @@ static bool tableAdd(StrHashtable* table, char* key, char* value) {
         tmp = lv_alloc(sizeof(StrHashNode));
         tmp->key = key;
         tmp->value = value;
+        tmp->seq = ++addedSeq;
         tmp->next = head;
         table->table[idx] = tmp;
         table->size++;
@@ -190,6 +197,82 @@ static void freeNameScopes(void) {
     lv_free(nameScopes.data);
 }
 
+struct LvNameEnv {
+    size_t refCount;
+    size_t seq;         //using names visible
+    size_t len;
+    char* scopes[];     //using scopes
+};
+
+//the last saved env, shared while the names do not change
+static LvNameEnv* lastEnv;
+//names hidden by lv_cmd_enterEnv
+typedef struct SavedEnv {
+    struct Scopes scopes;
+    size_t seq;
+} SavedEnv;
+static DynBuffer savedEnvs; //of SavedEnv
+
+static bool isLastEnv(void) {
+
+    if(!lastEnv || lastEnv->seq != addedSeq || lastEnv->len != nameScopes.len)
+        return false;
+    for(size_t i = 0; i < nameScopes.len; i++) {
+        if(strcmp(lastEnv->scopes[i], nameScopes.data[i]) != 0)
+            return false;
+    }
+    return true;
+}
+
+LvNameEnv* lv_cmd_saveEnv(void) {
+
+    if(!isLastEnv()) {
+        lv_cmd_releaseEnv(lastEnv);
+        lastEnv = lv_alloc(sizeof(LvNameEnv) + nameScopes.len * sizeof(char*));
+        lastEnv->refCount = 1;
+        lastEnv->seq = addedSeq;
+        lastEnv->len = nameScopes.len;
+        for(size_t i = 0; i < nameScopes.len; i++) {
+            size_t len = strlen(nameScopes.data[i]) + 1;
+            lastEnv->scopes[i] = lv_alloc(len);
+            memcpy(lastEnv->scopes[i], nameScopes.data[i], len);
+        }
+    }
+    lastEnv->refCount++;
+    return lastEnv;
+}
+
+void lv_cmd_releaseEnv(LvNameEnv* env) {
+
+    if(!env || --env->refCount > 0)
+        return;
+    for(size_t i = 0; i < env->len; i++)
+        lv_free(env->scopes[i]);
+    lv_free(env);
+}
+
+void lv_cmd_enterEnv(LvNameEnv* env) {
+
+    if(!savedEnvs.data)
+        lv_buf_init(&savedEnvs, sizeof(SavedEnv));
+    SavedEnv saved = { nameScopes, visibleSeq };
+    lv_buf_push(&savedEnvs, &saved);
+    //commands do not run until lv_cmd_leaveEnv,
+    //so the scopes are never added to or freed
+    nameScopes.data = env->scopes;
+    nameScopes.len = env->len;
+    nameScopes.cap = env->len + 1;
+    visibleSeq = env->seq;
+}
+
+void lv_cmd_leaveEnv(void) {
+
+    SavedEnv saved;
+    lv_buf_pop(&savedEnvs, &saved);
+    nameScopes = saved.scopes;
+    visibleSeq = saved.seq;
+}
+
 void lv_cmd_onStartup(void) {
     
     importNames.table = lv_alloc(INIT_TABLE_LEN * sizeof(StrHashNode*));
@@ -205,11 +288,19 @@ void lv_cmd_onStartup(void) {
 
 void lv_cmd_onShutdown(void) {
     
+    //shutdown may happen while a deferred body is parsed
+    while(savedEnvs.len > 0)
+        lv_cmd_leaveEnv();
     freeNameScopes();
     tableClear(&importNames);
     tableClear(&usingNames);
     lv_free(importNames.table);
     lv_free(usingNames.table);
+    lv_cmd_releaseEnv(lastEnv);
+    lastEnv = NULL;
+    lv_free(savedEnvs.data);
+    savedEnvs.data = NULL;
+    savedEnvs.len = savedEnvs.cap = 0;
 }
 
 //end hashtable impl
@@ -30,6 +30,28 @@ void lv_cmd_getUsingScopes(char*** scopes, size_t* len);
  */
 char* lv_cmd_getQualNameFor(char* simpleName);
 
+/**
+ * The names visible to a function body where it appears in its file:
+ * the using scopes and the using names added before it.
+ */
+typedef struct LvNameEnv LvNameEnv;
+
+/**
+ * Returns the names visible now, so that a body can be
+ * compiled later with the same names visible.
+ */
+LvNameEnv* lv_cmd_saveEnv(void);
+
+void lv_cmd_releaseEnv(LvNameEnv* env);
+
+/**
+ * Makes only the names saved in env visible, until the
+ * matching call of lv_cmd_leaveEnv.
+ */
+void lv_cmd_enterEnv(LvNameEnv* env);
+
+void lv_cmd_leaveEnv(void);
+
 void lv_cmd_onStartup();
 void lv_cmd_onShutdown();
 
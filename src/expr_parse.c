@@ -1,13 +1,16 @@
 #include "expression.h"
+#include "textbuffer.h"
 #include "lavender.h"
 #include "operator.h"
 #include "command.h"
+#include "number.h"
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
-#include <inttypes.h>
 
 #define INIT_STACK_LEN 16
+//longest function body inlined into callers
+#define INLINE_MAX_LEN 8
 typedef struct TextStack {
     size_t len;
     TextBufferObj* top;
@@ -52,6 +55,7 @@ static void shuntingYard(TextBufferObj* obj, ExprContext* cxt);
 static void handleRightBracket(ExprContext* cxt);
 static bool isLiteral(TextBufferObj* obj, char c);
 static bool shuntOps(ExprContext* cxts);
+static void inlineCalls(TextStack* out);
 
 #define IF_ERROR_CLEANUP \
     if(LV_EXPR_ERROR) { \
@@ -129,6 +133,7 @@ Token* lv_expr_parseExpr(Token* head, Operator* decl, TextBufferObj** res, size_
         shuntOps(&cxt);
         IF_ERROR_CLEANUP;
     }
+    inlineCalls(&cxt.out);
     *res = cxt.out.stack;
     *len = cxt.out.top - cxt.out.stack + 1;
     //calling plain lv_free is ok because ops is empty
@@ -449,7 +454,8 @@ static void parseNumber(TextBufferObj* obj, ExprContext* cxt) {
         LV_EXPR_ERROR = XPE_EXPECT_PRE;
         return;
     }
-    double num = strtod(cxt->head->value, NULL);
+    double num;
+    lv_num_parseNumber(cxt->head->value, strlen(cxt->head->value), &num);
     obj->type = OPT_NUMBER;
     obj->number = num;
     cxt->expectOperand = false;
@@ -461,7 +467,8 @@ static void parseInteger(TextBufferObj* obj, ExprContext* cxt) {
         LV_EXPR_ERROR = XPE_EXPECT_PRE;
         return;
     }
-    uint64_t num = (uint64_t) strtoumax(cxt->head->value, NULL, 10);
+    uint64_t num;
+    lv_num_parseInteger(cxt->head->value, strlen(cxt->head->value), &num);
     obj->type = OPT_INTEGER;
     obj->integer = num;
     cxt->expectOperand = false;
@@ -476,6 +483,7 @@ static void parseString(TextBufferObj* obj, ExprContext* cxt) {
     char* c = cxt->head->value + 1; //skip open quote
     LvString* newStr = lv_alloc(sizeof(LvString) + strlen(c) + 1);
     newStr->refCount = 1; //it will be added to the text buffer
+    newStr->hash = 0;
     size_t len = 0;
     while(*c != '"') {
         if(*c == '\\') {
@@ -874,3 +882,154 @@ static void shuntingYard(TextBufferObj* obj, ExprContext* cxt) {
             pushParam(&cxt->params, -2);
     }
 }
+
+static bool isParamRef(TextBufferObj* obj) {
+
+    return obj->type == OPT_PARAM || obj->type == OPT_MOVE_PARAM
+        || obj->type == OPT_PARAM_CALL2 || obj->type == OPT_MOVE_CALL2;
+}
+
+/**
+ * Returns the length of the body of the function, without the
+ * return, if calls of it may be inlined, or -1 otherwise. Only small
+ * functions with a single body and no locals or captures are inlined.
+ * Short deferred bodies are defined here. Calls of functions that are
+ * still declarations, such as those being defined, stay calls, so no
+ * function is inlined into itself. Functions cannot be redefined, so
+ * inlined bodies never go stale.
+ */
+static int inlineLen(Operator* func) {
+
+    lv_tb_defineIfShort(func);
+    if(func->type != FUN_FUNCTION || func->captureCount > 0
+        || func->locals > 0 || func->varargs)
+        return -1;
+    TextBufferObj* body = &TEXT_BUFFER[func->textOffset];
+    for(int i = 0; i <= INLINE_MAX_LEN; i++) {
+        switch(body[i].type) {
+            case OPT_RETURN:
+                return i;
+            case OPT_FUNCTION:
+            case OPT_BUILTIN1:
+            case OPT_BUILTIN2:
+            case OPT_ARITH:
+                if(body[i].func == func)
+                    return -1;
+                break;
+            case OPT_UNDEFINED:
+            case OPT_NUMBER:
+            case OPT_INTEGER:
+            case OPT_STRING:
+            case OPT_PARAM:
+            case OPT_MOVE_PARAM:
+            case OPT_PARAM_CALL2:
+            case OPT_MOVE_CALL2:
+            case OPT_FUNCTION_VAL:
+            case OPT_FUNC_CAP:
+            case OPT_FUNC_CALL:
+            case OPT_FUNC_CALL2:
+            case OPT_MAKE_VECT:
+                break;
+            default:
+                //branches and locals
+                return -1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Pushes a copy of an instruction from a function body, undoing
+ * the changes made to it once the body was parsed. The caller's
+ * body gets its own moves and fused instructions.
+ */
+static void pushInlined(TextStack* out, TextBufferObj* inst) {
+
+    TextBufferObj obj = *inst;
+    switch(obj.type) {
+        case OPT_MOVE_PARAM:
+        case OPT_PARAM_CALL2:
+        case OPT_MOVE_CALL2:
+            obj.type = OPT_PARAM;
+            break;
+        case OPT_BUILTIN1:
+        case OPT_BUILTIN2:
+        case OPT_ARITH:
+            obj.type = OPT_FUNCTION;
+            break;
+        case OPT_STRING: {
+            //each string in the text buffer has its own owner
+            size_t size = sizeof(LvString) + obj.str->len + 1;
+            obj.str = lv_alloc(size);
+            memcpy(obj.str, inst->str, size);
+            obj.str->refCount = 1;
+            break;
+        }
+        default:
+            break;
+    }
+    pushStack(out, &obj);
+}
+
+//values that may be copied or dropped in place of a param
+static bool isSimpleArg(TextBufferObj* obj) {
+
+    return obj->type == OPT_PARAM || obj->type == OPT_NUMBER
+        || obj->type == OPT_INTEGER || obj->type == OPT_UNDEFINED
+        || (obj->type == OPT_FUNCTION_VAL && obj->func->captureCount == 0);
+}
+
+/**
+ * Replaces calls of small functions in the expression with the
+ * function body, saving the frame. If the body reads the params in
+ * order before anything else, the args are left on the stack and
+ * the rest of the body follows them. Otherwise the body is inlined
+ * only if the args are simple values, which replace the params.
+ */
+static void inlineCalls(TextStack* out) {
+
+    TextStack res;
+    res.len = out->len;
+    res.stack = lv_alloc(res.len * sizeof(TextBufferObj));
+    res.top = res.stack;
+    res.stack[0].type = OPT_LITERAL;
+    for(TextBufferObj* obj = out->stack + 1; obj <= out->top; obj++) {
+        int len = obj->type == OPT_FUNCTION ? inlineLen(obj->func) : -1;
+        if(len < 0) {
+            pushStack(&res, obj);
+            continue;
+        }
+        TextBufferObj* body = &TEXT_BUFFER[obj->func->textOffset];
+        int arity = obj->func->arity;
+        bool inOrder = arity <= len;
+        for(int i = 0; i < len && inOrder; i++) {
+            if(isParamRef(&body[i]))
+                inOrder = i < arity && body[i].param == i;
+            else
+                inOrder = i >= arity;
+        }
+        if(inOrder) {
+            for(int i = arity; i < len; i++)
+                pushInlined(&res, &body[i]);
+            continue;
+        }
+        bool simple = res.top - res.stack >= arity;
+        for(int i = 0; i < arity && simple; i++)
+            simple = isSimpleArg(res.top - i);
+        if(!simple) {
+            pushStack(&res, obj);
+            continue;
+        }
+        TextBufferObj args[arity];
+        res.top -= arity;
+        memcpy(args, res.top + 1, arity * sizeof(TextBufferObj));
+        for(int i = 0; i < len; i++) {
+            if(isParamRef(&body[i]))
+                pushStack(&res, &args[body[i].param]);
+            else
+                pushInlined(&res, &body[i]);
+        }
+    }
+    lv_free(out->stack);
+    *out = res;
+}
@@ -2,7 +2,12 @@
 #include "textbuffer.h"
 #include "operator.h"
 #include "lavender.h"
+#include "vect.h"
+#include "hashmap.h"
+#include "dynbuffer.h"
+#include "input.h"
 #include <assert.h>
+#include <stdint.h>
 
 char* lv_expr_getError(ExprError error) {
     #define LEN 14
@@ -27,6 +32,53 @@ char* lv_expr_getError(ExprError error) {
     #undef LEN
 }
 
+static DynBuffer released; //of TextBufferObj, refCount reached zero
+static bool draining;
+
+/**
+ * Frees an object whose refCount reached zero. Its contents are
+ * queued on released rather than freed recursively, so releasing
+ * long chains of captures or vects does not overflow the C stack.
+ */
+static void freeObj(TextBufferObj* obj) {
+
+    switch(obj->type) {
+        case OPT_CAPTURE:
+            lv_expr_cleanup(obj->capture->value, obj->capture->func->captureCount);
+            lv_free(obj->capture);
+            break;
+        case OPT_VECT:
+            lv_vect_free(obj->vect);
+            break;
+        case OPT_MAP:
+            lv_map_free(obj->map);
+            break;
+        default:
+            assert(false);
+    }
+}
+
+void lv_expr_drain(size_t max) {
+
+    if(draining)
+        return;
+    draining = true;
+    while(max > 0 && released.len > 0) {
+        TextBufferObj obj;
+        lv_buf_pop(&released, &obj);
+        freeObj(&obj);
+        max--;
+    }
+    draining = false;
+}
+
+static void release(TextBufferObj* obj) {
+
+    if(!released.data)
+        lv_buf_init(&released, sizeof(TextBufferObj));
+    lv_buf_push(&released, obj);
+}
+
 void lv_expr_cleanup(TextBufferObj* obj, size_t len) {
 
     for(size_t i = 0; i < len; i++) {
@@ -34,20 +86,36 @@ void lv_expr_cleanup(TextBufferObj* obj, size_t len) {
             assert(obj[i].str->refCount);
             if(--obj[i].str->refCount == 0)
                 lv_free(obj[i].str);
+            else if(obj[i].str->refCount == LV_STR_MAPPED)
+                lv_in_unmap(obj[i].str);
         } else if(obj[i].type == OPT_CAPTURE) {
             assert(obj[i].capture->refCount);
-            if(--obj[i].capture->refCount == 0) {
-                lv_expr_cleanup(obj[i].capture->value, obj[i].capfunc->captureCount);
-                lv_free(obj[i].capture);
-            }
+            if(--obj[i].capture->refCount == 0)
+                release(&obj[i]);
         } else if(obj[i].type == OPT_VECT) {
             assert(obj[i].vect->refCount);
-            if(--obj[i].vect->refCount == 0) {
-                lv_expr_cleanup(obj[i].vect->data, obj[i].vect->len);
-                lv_free(obj[i].vect);
-            }
+            if(--obj[i].vect->refCount == 0)
+                release(&obj[i]);
+        } else if(obj[i].type == OPT_MAP) {
+            assert(obj[i].map->refCount);
+            if(--obj[i].map->refCount == 0)
+                release(&obj[i]);
+        } else if(obj[i].type == OPT_DISPATCH) {
+            //only found in the text buffer, which owns the table
+            lv_free(obj[i].dispatch);
         }
     }
+    //when deferred, allocations drain the queue instead
+    if(!lv_deferFree)
+        lv_expr_drain(SIZE_MAX);
+}
+
+void lv_expr_onShutdown(void) {
+
+    lv_expr_drain(SIZE_MAX);
+    lv_free(released.data);
+    released.data = NULL;
+    released.len = released.cap = 0;
 }
 
 void lv_expr_free(TextBufferObj* obj, size_t len) {
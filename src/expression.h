@@ -50,8 +50,19 @@ Token* lv_expr_parseExpr(Token* tokens, Operator* decl, TextBufferObj** res, siz
 void lv_expr_free(TextBufferObj* obj, size_t len);
 
 /**
- * Frees data associated with the objects given.
+ * Frees data associated with the objects given. Objects whose
+ * refCount reaches zero are queued and freed one at a time, so
+ * nested objects of any depth are freed without recursion. The
+ * queue is drained before returning unless lv_deferFree is set.
  */
 void lv_expr_cleanup(TextBufferObj* obj, size_t len);
 
+/**
+ * Frees up to max queued objects. Objects they contain are
+ * queued in turn.
+ */
+void lv_expr_drain(size_t max);
+
+void lv_expr_onShutdown(void);
+
 #endif
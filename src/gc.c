@@ -0,0 +1,172 @@
+#include "gc.h"
+#include "lavender.h"
+#include "expression.h"
+#include "dynbuffer.h"
+#include "vect.h"
+#include "hashmap.h"
+#include "operator.h"
+#include <stdint.h>
+#include <assert.h>
+
+//set in the refCount of marked objects, above the counted bits
+#define GC_MARK ((size_t)1 << 50)
+//adopted objects before the first collection
+#define MIN_HEAP (64 * 1024)
+
+static DynBuffer heap;      //of TextBufferObj, adopted objects
+static DynBuffer gray;      //of TextBufferObj, marked but not scanned
+static DynBuffer marked;    //of size_t*, marked refcounted objects
+static DynBuffer dead;      //of TextBufferObj
+static size_t limit = MIN_HEAP;
+
+static void init(DynBuffer* buf, size_t dataSize) {
+
+    if(!buf->data)
+        lv_buf_init(buf, dataSize);
+}
+
+void lv_gc_adopt(TextBufferObj* obj) {
+
+    assert((obj->type & LV_DYNAMIC) && *obj->refCount == 0);
+    init(&heap, sizeof(TextBufferObj));
+    *obj->refCount = LV_GC_OWNED;
+    lv_buf_push(&heap, obj);
+}
+
+bool lv_gc_due(void) {
+
+    return heap.len >= limit;
+}
+
+bool lv_gc_markNode(size_t* refCount) {
+
+    if(*refCount & GC_MARK)
+        return false;
+    *refCount |= GC_MARK;
+    lv_buf_push(&marked, &refCount);
+    return true;
+}
+
+void lv_gc_mark(TextBufferObj* obj) {
+
+    if(!(obj->type & LV_DYNAMIC))
+        return;
+    size_t* refCount = obj->refCount;
+    if(*refCount & GC_MARK)
+        return;
+    if(lv_gc_isOwned(*refCount)) {
+        //cleared again by the sweep
+        *refCount |= GC_MARK;
+    } else if(obj->type == OPT_STRING) {
+        //refcounted strings refer to nothing
+        return;
+    } else {
+        lv_gc_markNode(refCount);
+    }
+    if(obj->type != OPT_STRING)
+        lv_buf_push(&gray, obj);
+}
+
+static void scan(TextBufferObj* obj) {
+
+    switch(obj->type) {
+        case OPT_CAPTURE:
+            for(int i = 0; i < obj->capture->func->captureCount; i++)
+                lv_gc_mark(&obj->capture->value[i]);
+            break;
+        case OPT_VECT:
+            lv_vect_mark(obj->vect);
+            break;
+        case OPT_MAP:
+            lv_map_mark(obj->map);
+            break;
+        default:
+            assert(false);
+    }
+}
+
+/**
+ * Releases what the adopted object refers to, leaving it allocated.
+ */
+static void releaseContents(TextBufferObj* obj) {
+
+    switch(obj->type) {
+        case OPT_CAPTURE:
+            lv_expr_cleanup(obj->capture->value, obj->capture->func->captureCount);
+            break;
+        case OPT_VECT:
+            lv_vect_releaseElems(obj->vect);
+            break;
+        case OPT_MAP:
+            lv_map_releaseEntries(obj->map);
+            break;
+        default:
+            break;
+    }
+}
+
+void lv_gc_collect(TextBufferObj* roots, size_t len) {
+
+    init(&heap, sizeof(TextBufferObj));
+    init(&gray, sizeof(TextBufferObj));
+    init(&marked, sizeof(size_t*));
+    init(&dead, sizeof(TextBufferObj));
+    //queued frees may still release adopted objects
+    lv_expr_drain(SIZE_MAX);
+    for(size_t i = 0; i < len; i++)
+        lv_gc_mark(&roots[i]);
+    while(gray.len > 0) {
+        TextBufferObj obj;
+        lv_buf_pop(&gray, &obj);
+        scan(&obj);
+    }
+    //release the contents of every unreachable object before
+    //freeing any, since releasing an object may touch others
+    TextBufferObj* objs = heap.data;
+    size_t live = 0;
+    dead.len = 0;
+    for(size_t i = 0; i < heap.len; i++) {
+        if(*objs[i].refCount & GC_MARK) {
+            *objs[i].refCount &= ~GC_MARK;
+            objs[live++] = objs[i];
+        } else {
+            releaseContents(&objs[i]);
+            lv_buf_push(&dead, &objs[i]);
+        }
+    }
+    heap.len = live;
+    lv_expr_drain(SIZE_MAX);
+    size_t** refCounts = marked.data;
+    for(size_t i = 0; i < marked.len; i++)
+        *refCounts[i] &= ~GC_MARK;
+    marked.len = 0;
+    objs = dead.data;
+    for(size_t i = 0; i < dead.len; i++) {
+        //the refCount is the first member of every object
+        lv_free(objs[i].refCount);
+    }
+    dead.len = 0;
+    limit = 2 * live > MIN_HEAP ? 2 * live : MIN_HEAP;
+}
+
+void lv_gc_releaseAll(void) {
+
+    TextBufferObj* objs = heap.data;
+    for(size_t i = 0; i < heap.len; i++)
+        releaseContents(&objs[i]);
+    lv_expr_drain(SIZE_MAX);
+}
+
+void lv_gc_onShutdown(void) {
+
+    TextBufferObj* objs = heap.data;
+    for(size_t i = 0; i < heap.len; i++)
+        lv_free(objs[i].refCount);
+    DynBuffer* bufs[] = { &heap, &gray, &marked, &dead };
+    for(size_t i = 0; i < sizeof(bufs) / sizeof(bufs[0]); i++) {
+        lv_free(bufs[i]->data);
+        bufs[i]->data = NULL;
+        bufs[i]->len = bufs[i]->cap = 0;
+    }
+    limit = MIN_HEAP;
+}
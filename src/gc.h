@@ -0,0 +1,74 @@
+#ifndef GC_H
+#define GC_H
+#include "textbuffer.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Tracing collector used with -gc. New objects entering the stack
+ * are adopted by the collector instead of being counted: their
+ * refCount is set to LV_GC_OWNED, which counting never brings down
+ * to zero or one, so the refcounting code never frees them or
+ * updates them in place, and stack pushes and pops of them write
+ * nothing. Adopted objects are freed by marking from the stack and
+ * sweeping. Objects that already have an owner when pushed stay
+ * refcounted, so the rest of the runtime works unchanged.
+ *
+ * The text buffer is not a root, since its literals are refcounted
+ * and never hold adopted objects. Collections only run when no
+ * builtin is waiting on a nested call, so objects held by builtins
+ * never need to be found. For the same reason, objects made while a
+ * builtin waits, such as those of a map or fold callback, are not
+ * adopted. They stay refcounted and are freed as soon as they die,
+ * instead of piling up until the builtin returns.
+ */
+
+//refCount of adopted objects. Counting only changes the low bits.
+#define LV_GC_OWNED (((size_t)1 << 62) + ((size_t)1 << 40))
+
+static inline bool lv_gc_isOwned(size_t refCount) {
+
+    return refCount >= ((size_t)1 << 61);
+}
+
+/**
+ * Hands the object, whose refCount is zero, over to the collector.
+ */
+void lv_gc_adopt(TextBufferObj* obj);
+
+/**
+ * Returns whether enough objects were adopted since
+ * the last collection to collect again.
+ */
+bool lv_gc_due(void);
+
+/**
+ * Frees the adopted objects not reachable from the roots.
+ */
+void lv_gc_collect(TextBufferObj* roots, size_t len);
+
+/**
+ * Marks the object and the objects it refers to as reachable.
+ */
+void lv_gc_mark(TextBufferObj* obj);
+
+/**
+ * Marks the refCounted node of a vect or map, returning false
+ * if it was already marked. Used by the mark functions of vects
+ * and maps to visit shared nodes once.
+ */
+bool lv_gc_markNode(size_t* refCount);
+
+/**
+ * Releases what all adopted objects refer to, before the
+ * operators of captures are freed on shutdown.
+ */
+void lv_gc_releaseAll(void);
+
+/**
+ * Frees all adopted objects. Called last on shutdown, as
+ * refcounted objects may still refer to them until then.
+ */
+void lv_gc_onShutdown(void);
+
+#endif
@@ -0,0 +1,372 @@
+#include "hashmap.h"
+#include "builtin.h"
+#include "lavender.h"
+#include "expression.h"
+#include "gc.h"
+#include <assert.h>
+
+#define MAP_BITS 5
+#define MAP_MASK ((1u << MAP_BITS) - 1)
+//nodes at this shift have used up all 64 hash bits
+#define MAP_MAX_SHIFT 65
+
+static void incRefCount(TextBufferObj* obj) {
+
+    if(obj->type & LV_DYNAMIC)
+        ++*obj->refCount;
+}
+
+static bool isCollision(unsigned shift) {
+
+    return shift >= MAP_MAX_SHIFT;
+}
+
+static unsigned numEntries(LvMapNode* node, unsigned shift) {
+
+    return isCollision(shift) ? node->datamap : (unsigned)__builtin_popcount(node->datamap);
+}
+
+static LvMapNode** children(LvMapNode* node, unsigned shift) {
+
+    return (LvMapNode**)(node->entry + numEntries(node, shift));
+}
+
+static uint32_t bitFor(uint64_t hash, unsigned shift) {
+
+    return 1u << ((hash >> shift) & MAP_MASK);
+}
+
+//index of the slot for bit among the slots set in bitmap
+static unsigned slot(uint32_t bitmap, uint32_t bit) {
+
+    return __builtin_popcount(bitmap & (bit - 1));
+}
+
+static void copyEntry(LvMapEntry* dst, LvMapEntry* src) {
+
+    *dst = *src;
+    incRefCount(&dst->key);
+    incRefCount(&dst->value);
+}
+
+/**
+ * Allocates a node with room for the given number of
+ * entries and a child for every bit in nodemap.
+ */
+static LvMapNode* mkNode(uint32_t datamap, uint32_t nodemap, unsigned entries) {
+
+    unsigned nodes = __builtin_popcount(nodemap);
+    LvMapNode* res = lv_alloc(sizeof(LvMapNode)
+        + entries * sizeof(LvMapEntry)
+        + nodes * sizeof(LvMapNode*));
+    res->refCount = 1;
+    res->datamap = datamap;
+    res->nodemap = nodemap;
+    return res;
+}
+
+/**
+ * Releases a reference to the node at the given level.
+ */
+static void release(LvMapNode* node, unsigned shift) {
+
+    assert(node->refCount);
+    if(--node->refCount == 0) {
+        unsigned n = numEntries(node, shift);
+        for(unsigned i = 0; i < n; i++) {
+            lv_expr_cleanup(&node->entry[i].key, 1);
+            lv_expr_cleanup(&node->entry[i].value, 1);
+        }
+        LvMapNode** child = children(node, shift);
+        n = __builtin_popcount(node->nodemap);
+        for(unsigned i = 0; i < n; i++)
+            release(child[i], shift + MAP_BITS);
+        lv_free(node);
+    }
+}
+
+/**
+ * Copies a node with the given bitmaps. The slot for bit is
+ * filled with a copy of entry or with child (taking the reference)
+ * when given, every other slot is shared with the old node.
+ */
+static LvMapNode* rebuild(LvMapNode* node, unsigned shift,
+    uint32_t datamap, uint32_t nodemap,
+    uint32_t bit, LvMapEntry* entry, LvMapNode* child) {
+
+    LvMapNode* res = mkNode(datamap, nodemap, __builtin_popcount(datamap));
+    LvMapNode** oldChildren = children(node, shift);
+    LvMapNode** newChildren = children(res, shift);
+    unsigned e = 0;
+    unsigned c = 0;
+    for(unsigned i = 0; i <= MAP_MASK; i++) {
+        uint32_t b = 1u << i;
+        if(datamap & b) {
+            if(b == bit && entry) {
+                copyEntry(&res->entry[e++], entry);
+            } else {
+                assert(node->datamap & b);
+                copyEntry(&res->entry[e++], &node->entry[slot(node->datamap, b)]);
+            }
+        } else if(nodemap & b) {
+            if(b == bit && child) {
+                newChildren[c++] = child;
+            } else {
+                assert(node->nodemap & b);
+                newChildren[c] = oldChildren[slot(node->nodemap, b)];
+                newChildren[c++]->refCount++;
+            }
+        }
+    }
+    return res;
+}
+
+/**
+ * Creates a node at the given level holding the two entries,
+ * whose keys are not equal.
+ */
+static LvMapNode* mkPair(LvMapEntry* a, LvMapEntry* b, unsigned shift) {
+
+    LvMapNode* res;
+    if(isCollision(shift)) {
+        res = mkNode(2, 0, 2);
+        copyEntry(&res->entry[0], a);
+        copyEntry(&res->entry[1], b);
+        return res;
+    }
+    uint32_t abit = bitFor(a->hash, shift);
+    uint32_t bbit = bitFor(b->hash, shift);
+    if(abit == bbit) {
+        res = mkNode(0, abit, 0);
+        children(res, shift)[0] = mkPair(a, b, shift + MAP_BITS);
+    } else {
+        res = mkNode(abit | bbit, 0, 2);
+        if(abit > bbit) {
+            LvMapEntry* tmp = a;
+            a = b;
+            b = tmp;
+        }
+        copyEntry(&res->entry[0], a);
+        copyEntry(&res->entry[1], b);
+    }
+    return res;
+}
+
+/**
+ * Returns a copy of the node with the entry added or its
+ * value replaced. Sets added if the key is new.
+ */
+static LvMapNode* assoc(LvMapNode* node, unsigned shift, LvMapEntry* e, bool* added) {
+
+    if(isCollision(shift)) {
+        unsigned n = node->datamap;
+        unsigned idx = n;
+        for(unsigned i = 0; i < n; i++) {
+            if(lv_blt_equal(&node->entry[i].key, &e->key))
+                idx = i;
+        }
+        if(idx == n)
+            *added = true;
+        LvMapNode* res = mkNode(n + *added, 0, n + *added);
+        for(unsigned i = 0; i < n; i++) {
+            if(i != idx)
+                copyEntry(&res->entry[i], &node->entry[i]);
+        }
+        copyEntry(&res->entry[idx], e);
+        return res;
+    }
+    uint32_t bit = bitFor(e->hash, shift);
+    if(node->datamap & bit) {
+        LvMapEntry* old = &node->entry[slot(node->datamap, bit)];
+        if(old->hash == e->hash && lv_blt_equal(&old->key, &e->key)) {
+            //keep the old key
+            LvMapEntry tmp = *old;
+            tmp.value = e->value;
+            return rebuild(node, shift, node->datamap, node->nodemap, bit, &tmp, NULL);
+        }
+        //move both entries down a level
+        *added = true;
+        LvMapNode* child = mkPair(old, e, shift + MAP_BITS);
+        return rebuild(node, shift, node->datamap & ~bit, node->nodemap | bit, bit, NULL, child);
+    }
+    if(node->nodemap & bit) {
+        LvMapNode* old = children(node, shift)[slot(node->nodemap, bit)];
+        LvMapNode* child = assoc(old, shift + MAP_BITS, e, added);
+        return rebuild(node, shift, node->datamap, node->nodemap, bit, NULL, child);
+    }
+    *added = true;
+    return rebuild(node, shift, node->datamap | bit, node->nodemap, bit, e, NULL);
+}
+
+/**
+ * Returns a copy of the node without the given key, or NULL
+ * if the node does not contain the key. Child nodes left with a
+ * single entry are merged into their parent.
+ */
+static LvMapNode* dissoc(LvMapNode* node, unsigned shift, uint64_t hash, TextBufferObj* key) {
+
+    if(isCollision(shift)) {
+        unsigned n = node->datamap;
+        for(unsigned i = 0; i < n; i++) {
+            if(lv_blt_equal(&node->entry[i].key, key)) {
+                LvMapNode* res = mkNode(n - 1, 0, n - 1);
+                for(unsigned j = 0; j < n - 1; j++)
+                    copyEntry(&res->entry[j], &node->entry[j < i ? j : j + 1]);
+                return res;
+            }
+        }
+        return NULL;
+    }
+    uint32_t bit = bitFor(hash, shift);
+    if(node->datamap & bit) {
+        LvMapEntry* old = &node->entry[slot(node->datamap, bit)];
+        if(old->hash != hash || !lv_blt_equal(&old->key, key))
+            return NULL;
+        return rebuild(node, shift, node->datamap & ~bit, node->nodemap, 0, NULL, NULL);
+    }
+    if(node->nodemap & bit) {
+        unsigned childShift = shift + MAP_BITS;
+        LvMapNode* old = children(node, shift)[slot(node->nodemap, bit)];
+        LvMapNode* child = dissoc(old, childShift, hash, key);
+        if(!child)
+            return NULL;
+        LvMapNode* res;
+        if(child->nodemap == 0 && numEntries(child, childShift) <= 1) {
+            //pull the remaining entry (if any) up into this node
+            if(numEntries(child, childShift) == 1)
+                res = rebuild(node, shift, node->datamap | bit, node->nodemap & ~bit, bit, child->entry, NULL);
+            else
+                res = rebuild(node, shift, node->datamap, node->nodemap & ~bit, 0, NULL, NULL);
+            release(child, childShift);
+        } else {
+            res = rebuild(node, shift, node->datamap, node->nodemap, bit, NULL, child);
+        }
+        return res;
+    }
+    return NULL;
+}
+
+static bool forEach(LvMapNode* node, unsigned shift, bool (*func)(LvMapEntry*, void*), void* data) {
+
+    unsigned n = numEntries(node, shift);
+    for(unsigned i = 0; i < n; i++) {
+        if(!func(&node->entry[i], data))
+            return false;
+    }
+    LvMapNode** child = children(node, shift);
+    n = __builtin_popcount(node->nodemap);
+    for(unsigned i = 0; i < n; i++) {
+        if(!forEach(child[i], shift + MAP_BITS, func, data))
+            return false;
+    }
+    return true;
+}
+
+LvMap* lv_map_alloc(void) {
+
+    LvMap* res = lv_alloc(sizeof(LvMap));
+    res->refCount = 0;
+    res->len = 0;
+    res->root = NULL;
+    return res;
+}
+
+void lv_map_releaseEntries(LvMap* self) {
+
+    if(self->root)
+        release(self->root, 0);
+}
+
+void lv_map_free(LvMap* self) {
+
+    lv_map_releaseEntries(self);
+    lv_free(self);
+}
+
+static void markNode(LvMapNode* node, unsigned shift) {
+
+    if(!lv_gc_markNode(&node->refCount))
+        return;
+    unsigned n = numEntries(node, shift);
+    for(unsigned i = 0; i < n; i++) {
+        lv_gc_mark(&node->entry[i].key);
+        lv_gc_mark(&node->entry[i].value);
+    }
+    LvMapNode** child = children(node, shift);
+    n = __builtin_popcount(node->nodemap);
+    for(unsigned i = 0; i < n; i++)
+        markNode(child[i], shift + MAP_BITS);
+}
+
+void lv_map_mark(LvMap* self) {
+
+    if(self->root)
+        markNode(self->root, 0);
+}
+
+TextBufferObj* lv_map_get(LvMap* self, TextBufferObj* key) {
+
+    if(!self->root)
+        return NULL;
+    uint64_t hash = lv_blt_hash(key);
+    LvMapNode* node = self->root;
+    unsigned shift = 0;
+    while(!isCollision(shift)) {
+        uint32_t bit = bitFor(hash, shift);
+        if(node->datamap & bit) {
+            LvMapEntry* e = &node->entry[slot(node->datamap, bit)];
+            if(e->hash == hash && lv_blt_equal(&e->key, key))
+                return &e->value;
+            return NULL;
+        } else if(node->nodemap & bit) {
+            node = children(node, shift)[slot(node->nodemap, bit)];
+            shift += MAP_BITS;
+        } else {
+            return NULL;
+        }
+    }
+    for(unsigned i = 0; i < node->datamap; i++) {
+        if(lv_blt_equal(&node->entry[i].key, key))
+            return &node->entry[i].value;
+    }
+    return NULL;
+}
+
+LvMap* lv_map_assoc(LvMap* self, TextBufferObj* key, TextBufferObj* value) {
+
+    LvMapEntry e = { lv_blt_hash(key), *key, *value };
+    bool added = false;
+    LvMapNode* root;
+    if(!self->root) {
+        root = mkNode(bitFor(e.hash, 0), 0, 1);
+        copyEntry(&root->entry[0], &e);
+        added = true;
+    } else {
+        root = assoc(self->root, 0, &e, &added);
+    }
+    LvMap* res = lv_map_alloc();
+    res->root = root;
+    res->len = self->len + added;
+    return res;
+}
+
+LvMap* lv_map_dissoc(LvMap* self, TextBufferObj* key) {
+
+    if(!self->root)
+        return self;
+    LvMapNode* root = dissoc(self->root, 0, lv_blt_hash(key), key);
+    if(!root)
+        return self;
+    LvMap* res = lv_map_alloc();
+    res->len = self->len - 1;
+    if(root->datamap == 0 && root->nodemap == 0)
+        release(root, 0);
+    else
+        res->root = root;
+    return res;
+}
+
+bool lv_map_forEach(LvMap* self, bool (*func)(LvMapEntry*, void*), void* data) {
+
+    return !self->root || forEach(self->root, 0, func, data);
+}
@@ -0,0 +1,78 @@
+#ifndef HASHMAP_H
+#define HASHMAP_H
+#include "textbuffer.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * A key-value pair in a hash map, along with the hash of the key.
+ */
+typedef struct LvMapEntry {
+    uint64_t hash;
+    TextBufferObj key;
+    TextBufferObj value;
+} LvMapEntry;
+
+/**
+ * A node in a hash map trie. Each level consumes five bits of
+ * the hash. Bits set in datamap mark slots holding an entry, bits
+ * set in nodemap mark slots holding a child node. The entries
+ * are followed in memory by the child node pointers. Nodes below
+ * the last level hold keys whose hashes collide completely; for
+ * these nodes datamap is the number of entries.
+ * Nodes are shared between maps and are never modified once they
+ * are reachable from a map.
+ */
+struct LvMapNode {
+    size_t refCount;
+    uint32_t datamap;
+    uint32_t nodemap;
+    LvMapEntry entry[];
+};
+
+/**
+ * Allocates an empty map with refCount zero.
+ */
+LvMap* lv_map_alloc(void);
+
+/**
+ * Frees the map and releases its entries. Called when the
+ * map's refCount reaches zero.
+ */
+void lv_map_free(LvMap* self);
+
+/**
+ * Releases the entries of the map without freeing it.
+ */
+void lv_map_releaseEntries(LvMap* self);
+
+/**
+ * Marks the nodes and entries of the map for the collector.
+ */
+void lv_map_mark(LvMap* self);
+
+/**
+ * Returns the value associated with the key, or NULL if the
+ * map does not contain the key.
+ */
+TextBufferObj* lv_map_get(LvMap* self, TextBufferObj* key);
+
+/**
+ * Returns a map with the key associated with the given value.
+ * The map itself is not modified.
+ */
+LvMap* lv_map_assoc(LvMap* self, TextBufferObj* key, TextBufferObj* value);
+
+/**
+ * Returns a map without the given key. Returns the map itself
+ * if it does not contain the key.
+ */
+LvMap* lv_map_dissoc(LvMap* self, TextBufferObj* key);
+
+/**
+ * Calls func for every entry in the map, stopping early if
+ * func returns false. Returns whether every call returned true.
+ */
+bool lv_map_forEach(LvMap* self, bool (*func)(LvMapEntry*, void*), void* data);
+
+#endif
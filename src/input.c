@@ -0,0 +1,368 @@
+#include "input.h"
+#include "lavender.h"
+#include "dynbuffer.h"
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <spawn.h>
+
+extern char** environ;
+
+//bytes read from a stream at a time
+#define CHUNK_SIZE (1024 * 1024)
+
+typedef struct Input {
+    char* path;
+    int fd;
+    bool mapped;        //the whole file is in data
+    bool eof;           //nothing more to read from fd
+    FILE* spill;        //every byte read from a stream so far
+    size_t spilled;     //bytes in spill, or in a mapped file
+    char* data;
+    size_t start;       //offset of data[0]
+    size_t len;         //bytes in data
+    size_t cap;         //window capacity
+    size_t lineStart;   //last line found
+    size_t lineEnd;     //offset of its terminator
+} Input;
+
+static DynBuffer inputs;    //of Input*
+
+static Input* openInput(char* path) {
+
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+    Input* in = lv_alloc(sizeof(Input));
+    in->path = lv_alloc(strlen(path) + 1);
+    strcpy(in->path, path);
+    in->fd = fd;
+    in->mapped = false;
+    in->eof = false;
+    in->spill = NULL;
+    in->spilled = 0;
+    in->data = NULL;
+    in->start = in->len = in->cap = 0;
+    in->lineStart = in->lineEnd = SIZE_MAX;
+    struct stat st;
+    if(fd != STDIN_FILENO && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        in->mapped = true;
+        in->eof = true;
+        in->len = st.st_size;
+        if(in->len > 0) {
+            in->data = mmap(NULL, in->len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(in->data == MAP_FAILED) {
+                //read it as a stream instead
+                in->data = NULL;
+                in->mapped = in->eof = false;
+                in->len = 0;
+            } else {
+                madvise(in->data, in->len, MADV_SEQUENTIAL);
+            }
+        }
+        if(in->mapped)
+            in->spilled = in->len;
+    }
+    //streams cannot be read again, so what they have
+    //read is kept for lines before the window
+    if(!in->mapped)
+        in->spill = tmpfile();
+    return in;
+}
+
+static Input* getInput(char* path) {
+
+    if(!inputs.data)
+        lv_buf_init(&inputs, sizeof(Input*));
+    for(size_t i = 0; i < inputs.len; i++) {
+        Input* in = *(Input**)lv_buf_get(&inputs, i);
+        if(strcmp(in->path, path) == 0)
+            return in;
+    }
+    Input* in = openInput(path);
+    if(in)
+        lv_buf_push(&inputs, &in);
+    return in;
+}
+
+/**
+ * Returns whether there is nothing more to read into the window.
+ */
+static bool atEnd(Input* in) {
+
+    return in->eof && in->start + in->len == in->spilled;
+}
+
+/**
+ * Reads the next chunk of a stream into the window, first
+ * dropping the bytes before the given offset. Bytes already
+ * read are read again from the spill file.
+ */
+static void fill(Input* in, size_t keep) {
+
+    size_t drop = keep - in->start < in->len ? keep - in->start : in->len;
+    if(drop > 0)
+        memmove(in->data, in->data + drop, in->len - drop);
+    in->len -= drop;
+    in->start += drop;
+    //the last line found may have been dropped
+    if(in->lineStart < in->start)
+        in->lineStart = in->lineEnd = SIZE_MAX;
+    if(in->cap - in->len < CHUNK_SIZE) {
+        in->cap = in->len + CHUNK_SIZE;
+        in->data = lv_realloc(in->data, in->cap);
+    }
+    size_t end = in->start + in->len;
+    ssize_t n;
+    if(end < in->spilled) {
+        size_t count = in->cap - in->len;
+        if(count > in->spilled - end)
+            count = in->spilled - end;
+        do {
+            n = pread(fileno(in->spill), in->data + in->len, count, end);
+        } while(n < 0 && errno == EINTR);
+        if(n <= 0) {
+            //the spill file is gone, so nothing more can be read
+            in->eof = true;
+            in->spilled = end;
+        } else {
+            in->len += n;
+        }
+        return;
+    }
+    do {
+        n = read(in->fd, in->data + in->len, in->cap - in->len);
+    } while(n < 0 && errno == EINTR);
+    if(n <= 0) {
+        in->eof = true;
+        return;
+    }
+    if(in->spill && pwrite(fileno(in->spill), in->data + in->len, n, end) != n) {
+        //lines before the window can no longer be read
+        fclose(in->spill);
+        in->spill = NULL;
+    }
+    in->len += n;
+    in->spilled += n;
+}
+
+/**
+ * Finds the end of the line starting at the offset, reading
+ * the stream up to it. Returns false if there is no such line.
+ */
+static bool findLine(Input* in, size_t offset) {
+
+    if(offset == in->lineStart)
+        return true;
+    if(offset < in->start) {
+        //already dropped from the window
+        if(!in->spill)
+            return false;
+        in->start = offset;
+        in->len = 0;
+        in->lineStart = in->lineEnd = SIZE_MAX;
+    }
+    size_t scanned = offset;   //searched up to here
+    for(;;) {
+        if(offset - in->start < in->len) {
+            char* nl = memchr(in->data + (scanned - in->start), '\n', in->len - (scanned - in->start));
+            if(nl || atEnd(in)) {
+                in->lineStart = offset;
+                in->lineEnd = nl ? in->start + (nl - in->data) : in->start + in->len;
+                return true;
+            }
+            scanned = in->start + in->len;
+        } else if(atEnd(in)) {
+            return false;
+        }
+        //mapped files are never filled, as they are at eof
+        fill(in, offset);
+    }
+}
+
+LvString* lv_in_lineAt(char* path, size_t offset) {
+
+    Input* in = getInput(path);
+    if(!in || !findLine(in, offset))
+        return NULL;
+    char* line = in->data + (offset - in->start);
+    size_t len = in->lineEnd - offset;
+    if(len > 0 && line[len - 1] == '\r')
+        len--;
+    LvString* res = lv_alloc(sizeof(LvString) + len + 1);
+    res->refCount = 0;
+    res->hash = 0;
+    res->len = len;
+    memcpy(res->value, line, len);
+    res->value[len] = '\0';
+    return res;
+}
+
+bool lv_in_nextLine(char* path, size_t offset, size_t* next) {
+
+    Input* in = getInput(path);
+    if(!in || !findLine(in, offset))
+        return false;
+    *next = in->lineEnd + 1;
+    return true;
+}
+
+static size_t pageSize(void) {
+
+    static size_t size;
+    if(!size)
+        size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+/**
+ * Size of the region holding a mapped string of the given length:
+ * a page ending with the header, then the pages of the file and
+ * at least one zero byte after them for the terminator.
+ */
+static size_t regionSize(size_t len) {
+
+    size_t page = pageSize();
+    return page + (len / page + 1) * page;
+}
+
+LvString* lv_in_mapFile(char* path) {
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+    size_t len = st.st_size;
+    size_t page = pageSize();
+    char* region = mmap(NULL, regionSize(len), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(region == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    //the file replaces the pages after the header, the rest of
+    //its last page and the page after it read as zeroes
+    if(len > 0) {
+        char* chars = mmap(region + page, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+        if(chars == MAP_FAILED) {
+            munmap(region, regionSize(len));
+            close(fd);
+            return NULL;
+        }
+        madvise(chars, len, MADV_SEQUENTIAL);
+    }
+    //the mapping stays valid once the file is closed
+    close(fd);
+    LvString* res = (LvString*)(region + page - sizeof(LvString));
+    res->refCount = LV_STR_MAPPED;
+    res->hash = 0;
+    res->len = len;
+    return res;
+}
+
+void lv_in_unmap(LvString* str) {
+
+    munmap(str->value - pageSize(), regionSize(str->len));
+}
+
+/**
+ * Runs the -serve process with the given stdin and stdout.
+ * Returns whether it ran and exited normally.
+ */
+static bool runServe(int in, int out) {
+
+    char* argv[10];
+    int argc = 0;
+    argv[argc++] = lv_programName;
+    argv[argc++] = "-serve";
+    argv[argc++] = "-fp";
+    argv[argc++] = lv_filepath;
+    if(lv_regvm)
+        argv[argc++] = "-regvm";
+    if(lv_deferFree)
+        argv[argc++] = "-deferFree";
+    if(lv_gc)
+        argv[argc++] = "-gc";
+    if(lv_formatG)
+        argv[argc++] = "-formatG";
+    argv[argc] = NULL;
+    posix_spawn_file_actions_t acts;
+    if(posix_spawn_file_actions_init(&acts) != 0)
+        return false;
+    pid_t pid;
+    bool res = posix_spawn_file_actions_adddup2(&acts, in, STDIN_FILENO) == 0
+        && posix_spawn_file_actions_adddup2(&acts, out, STDOUT_FILENO) == 0
+        && posix_spawnp(&pid, lv_programName, &acts, NULL, argv, environ) == 0;
+    posix_spawn_file_actions_destroy(&acts);
+    if(!res)
+        return false;
+    int status;
+    while(waitpid(pid, &status, 0) < 0) {
+        if(errno != EINTR)
+            return false;
+    }
+    return WIFEXITED(status);
+}
+
+LvString* lv_in_serve(char* requests, size_t len) {
+
+    //the process reads and writes temporary files, so
+    //neither side waits on the other
+    FILE* in = tmpfile();
+    FILE* out = tmpfile();
+    LvString* res = NULL;
+    struct stat st;
+    if(in && out
+        && fwrite(requests, 1, len, in) == len
+        && fflush(in) == 0
+        && lseek(fileno(in), 0, SEEK_SET) == 0
+        && runServe(fileno(in), fileno(out))
+        && fstat(fileno(out), &st) == 0) {
+        size_t outLen = st.st_size;
+        res = lv_alloc(sizeof(LvString) + outLen + 1);
+        res->refCount = 0;
+        res->hash = 0;
+        res->len = outLen;
+        if(pread(fileno(out), res->value, outLen, 0) != (ssize_t)outLen) {
+            lv_free(res);
+            res = NULL;
+        } else {
+            res->value[outLen] = '\0';
+        }
+    }
+    if(in)
+        fclose(in);
+    if(out)
+        fclose(out);
+    return res;
+}
+
+void lv_in_onShutdown(void) {
+
+    for(size_t i = 0; i < inputs.len; i++) {
+        Input* in = *(Input**)lv_buf_get(&inputs, i);
+        if(in->mapped) {
+            if(in->data)
+                munmap(in->data, in->len);
+        } else {
+            lv_free(in->data);
+        }
+        if(in->spill)
+            fclose(in->spill);
+        if(in->fd != STDIN_FILENO)
+            close(in->fd);
+        lv_free(in->path);
+        lv_free(in);
+    }
+    lv_free(inputs.data);
+    inputs.data = NULL;
+    inputs.len = inputs.cap = 0;
+}
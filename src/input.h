@@ -0,0 +1,59 @@
+#ifndef INPUT_H
+#define INPUT_H
+#include "textbuffer.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Line by line reading of files and stdin, for the io namespace.
+ * Inputs are named by path, with "-" naming stdin, and lines are
+ * addressed by the byte offset of their first character. Files are
+ * mapped into memory. Other inputs are read in large chunks into a
+ * window that only keeps the line last asked for, so an input of
+ * any size is read in constant memory. What they read is also kept
+ * in a temporary file, so earlier lines read the same as before.
+ * Whole files may also be mapped as strings.
+ */
+
+/**
+ * Returns the line starting at the offset without its line
+ * terminator, or NULL past the end of the input or if the
+ * offset can no longer be read.
+ */
+LvString* lv_in_lineAt(char* path, size_t offset);
+
+/**
+ * Sets next to the offset of the line after the line starting
+ * at the offset. Returns false under the same conditions as
+ * lv_in_lineAt.
+ */
+bool lv_in_nextLine(char* path, size_t offset, size_t* next);
+
+/**
+ * Maps the file at the path read only and returns its contents as
+ * a string with no references, or NULL if it is not a regular file
+ * or could not be mapped. The chars of the string are the pages of
+ * the file, so it is never copied, and the string header is placed
+ * right before them. Its refCount starts at LV_STR_MAPPED, and the
+ * file is unmapped when the count returns to it. The file should
+ * not be truncated while the string is alive.
+ */
+LvString* lv_in_mapFile(char* path);
+
+/**
+ * Unmaps a string returned by lv_in_mapFile.
+ */
+void lv_in_unmap(LvString* str);
+
+/**
+ * Runs the requests, given as the bytes of the request lines, in a
+ * new Lavender process started with -serve and the same -fp, -regvm,
+ * -deferFree, -gc, and -formatG options as this one, then returns
+ * its replies as a string with no references. Returns NULL if the
+ * process could not be run.
+ */
+LvString* lv_in_serve(char* requests, size_t len);
+
+void lv_in_onShutdown(void);
+
+#endif
@@ -4,51 +4,153 @@
 #include "builtin.h"
 #include "command.h"
 #include "dynbuffer.h"
+#include "vect.h"
+#include "profile.h"
+#include "regvm.h"
+#include "gc.h"
+#include "prefetch.h"
+#include "input.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 bool lv_debug = false;
+bool lv_profile = false;
+bool lv_regvm = false;
+bool lv_deferFree = false;
+bool lv_gc = false;
+bool lv_serve = false;
+bool lv_formatG = false;
 char* lv_filepath = ".";
+char* lv_programName = "lavender";
 char* lv_mainFile = NULL;
-size_t lv_maxStackSize = 512 * 1024; //512KiB
+size_t lv_maxStackSize = 32 * 1024 * 1024; //32MiB
+FILE* lv_out = NULL;
+//objects freed per allocation when frees are deferred
+#define FREE_BATCH 32
+//bytes of requests read at a time with -serve
+#define SERVE_CHUNK (64 * 1024)
+//size of the output buffer with -serve
+#define SERVE_BUFFER (1024 * 1024)
 struct LvMainArgs lv_mainArgs = { NULL, 0 };
 
 static void readInput(FILE* in, bool repl);
+static void serve(void);
+static void endRequest(void);
 static size_t jumpAndLink(Operator* func);
 static void runCycle(void);
 
-static DynBuffer stack; //of TextBufferObj
+static DynBuffer stack; //of TextBufferObj, see mapStack
+//the output of the running request of -serve, see serve
+static FILE* requestOut;
+static char* requestText;
+static size_t requestLen;
+static unsigned char* stackGuard; //inaccessible page past the stack
+static size_t pageSize;
+static sigjmp_buf overflowJump; //taken when a push hits stackGuard
 static size_t pc;   //program counter
 static size_t fp;   //frame pointer: index of the first argument
 static Operator* atFunc; //built in sys:__at__
+static DynBuffer callCaches; //of CallCache
+static _Thread_local bool isMainThread; //files are split on other threads
+static int nesting; //calls run for builtins by finishCall
+
+//number of callees remembered by a call site
+#define CACHE_WAYS 4
+
+/**
+ * Inline cache of a call instruction. Each entry holds a callee
+ * already checked against the site's arity, so later calls of the
+ * same function or capture skip the checks in setUpFuncCall.
+ */
+typedef struct CallCache {
+    struct {
+        Operator* op;   //NULL for an unused entry
+        OpType type;    //OPT_FUNCTION_VAL or OPT_CAPTURE
+        int vectLen;    //args collected into varargs, -1 if none
+    } entry[CACHE_WAYS];
+    unsigned next;      //entry to replace when all are used
+} CallCache;
+
+/**
+ * Takes a reference to the object for the stack. With -gc, new
+ * objects are adopted by the collector instead, unless a builtin
+ * is waiting on a nested call, see gc.h.
+ */
+static inline void retain(TextBufferObj* obj) {
+
+    if(obj->type & LV_DYNAMIC) {
+        if(lv_gc && nesting == 0 && *obj->refCount == 0)
+            lv_gc_adopt(obj);
+        else
+            ++*obj->refCount;
+    }
+}
+
+/**
+ * Pushes the object without taking a reference.
+ */
+static void pushSlot(TextBufferObj* obj, bool borrowed) {
+
+    //overflow faults on the guard page, see mapStack
+    TextBufferObj* slot = (TextBufferObj*)stack.data + stack.len;
+    *slot = *obj;
+    slot->borrowed = borrowed;
+    stack.len++;
+}
 
 static void push(TextBufferObj* obj) {
 
-    if(obj->type & LV_DYNAMIC)
-        ++*obj->refCount;
-    if(lv_maxStackSize
-        && (stack.len + 1) == stack.cap
-        && stack.len >= lv_maxStackSize) {
-        //we've exceeded the maximum stack size
-        LvString* inst = lv_tb_getString(&TEXT_BUFFER[pc]);
-        LvString* arg = lv_tb_getString(obj);
-        printf("Stack overflow: pc=%lu, inst=%s, toPush=%s\n",
-            pc, inst->value, arg->value);
-        if(inst->refCount == 0)
-            lv_free(inst);
-        if(arg->refCount == 0)
-            lv_free(arg);
-        lv_shutdown();
+    retain(obj);
+    pushSlot(obj, false);
+}
+
+/**
+ * Pushes an object that outlives the slot without taking a
+ * reference, such as a param, which its frame holds until it
+ * returns, or a literal, which the text buffer holds. Borrowed
+ * slots that outlive the holder's reference are promoted first,
+ * as are slots stored anywhere else.
+ */
+static void pushBorrowed(TextBufferObj* obj) {
+
+    TextBufferObj tmp = *obj;
+    pushSlot(&tmp, (tmp.type & LV_DYNAMIC) != 0);
+}
+
+/**
+ * Takes a reference for a borrowed slot.
+ */
+static void promote(TextBufferObj* slot) {
+
+    if(slot->borrowed) {
+        ++*slot->refCount;
+        slot->borrowed = false;
+    }
+}
+
+/**
+ * Releases the references held by stack slots.
+ */
+static void releaseSlots(TextBufferObj* slots, size_t len) {
+
+    for(size_t i = 0; i < len; i++) {
+        if((slots[i].type & LV_DYNAMIC) && !slots[i].borrowed)
+            lv_expr_cleanup(&slots[i], 1);
     }
-    lv_buf_push(&stack, obj);
 }
 
 static void popAll(size_t numToPop) {
 
     TextBufferObj* start = lv_buf_get(&stack, stack.len - numToPop);
-    lv_expr_cleanup(start, numToPop);
+    releaseSlots(start, numToPop);
     stack.len -= numToPop;
 }
 
@@ -56,36 +158,141 @@ static TextBufferObj removeTop(void) {
 
     TextBufferObj res;
     lv_buf_pop(&stack, &res);
-    if(res.type & LV_DYNAMIC)
+    if((res.type & LV_DYNAMIC) && !res.borrowed)
         --*res.refCount;
     return res;
 }
 
+/**
+ * Pops the top object along with its reference.
+ */
+static TextBufferObj popOwned(void) {
+
+    TextBufferObj* top = lv_buf_get(&stack, stack.len - 1);
+    promote(top);
+    TextBufferObj res;
+    lv_buf_pop(&stack, &res);
+    return res;
+}
+
+/**
+ * Promotes the borrowed slots above the frame holding the same
+ * object as the i'th param, before the frame gives up its reference.
+ */
+static void promoteCopies(int i) {
+
+    TextBufferObj* slots = stack.data;
+    TextBufferObj* param = &slots[fp + i];
+    if(!(param->type & LV_DYNAMIC))
+        return;
+    for(size_t j = fp; j < stack.len; j++) {
+        if(slots[j].borrowed && slots[j].refCount == param->refCount)
+            promote(&slots[j]);
+    }
+}
+
+bool lv_isBorrowed(TextBufferObj* obj) {
+
+    uintptr_t addr = (uintptr_t)obj;
+    uintptr_t base = (uintptr_t)stack.data;
+    return addr >= base && addr < base + stack.len * sizeof(TextBufferObj) && obj->borrowed;
+}
+
+static void onSegv(int sig, siginfo_t* info, void* context) {
+
+    unsigned char* addr = info->si_addr;
+    if(addr >= stackGuard && addr < stackGuard + pageSize)
+        siglongjmp(overflowJump, 1);
+    //not an overflow, fault again with the default action
+    signal(SIGSEGV, SIG_DFL);
+}
+
+/**
+ * Reserves lv_maxStackSize bytes of address space for the stack,
+ * followed by a guard page. Pages are only backed by memory once
+ * the stack grows into them, so the stack never moves, and pushes
+ * need no capacity check. Pushing past the end faults on the guard
+ * page, which jumps to overflowJump to report the overflow.
+ */
+static void mapStack(void) {
+
+    pageSize = sysconf(_SC_PAGESIZE);
+    size_t size = (lv_maxStackSize + pageSize - 1) / pageSize * pageSize;
+    if(size == 0)
+        size = pageSize;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    unsigned char* base = mmap(NULL, size + pageSize, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if(base == MAP_FAILED) {
+        fprintf(lv_out, "Allocation failed: %lu bytes\n", size);
+        exit(1);
+    }
+    stackGuard = base + size;
+    mprotect(stackGuard, pageSize, PROT_NONE);
+    stack.data = base;
+    stack.len = 0;
+    stack.cap = size / sizeof(TextBufferObj);
+    stack.dataSize = sizeof(TextBufferObj);
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_sigaction = onSegv;
+    act.sa_flags = SA_SIGINFO;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGSEGV, &act, NULL);
+}
+
 //simple linear storage should be enough
 //for the relatively small number of namespaces
 static DynBuffer importedFiles; //of char*
 
-static bool addFile(char* file) {
+static bool isImported(char* file) {
 
     for(size_t i = 0; i < importedFiles.len; i++) {
         char* str = *(char**)lv_buf_get(&importedFiles, i);
         if(strcmp(str, file) == 0)
-            return false; //already imported
+            return true;
     }
+    return false;
+}
+
+/**
+ * Records the file as imported. Returns the copy of its name kept
+ * until shutdown, or NULL if it was already imported.
+ */
+static char* addFile(char* file) {
+
+    if(isImported(file))
+        return NULL;
     size_t len = strlen(file) + 1;
     char* tmp = lv_alloc(len);
     memcpy(tmp, file, len);
     lv_buf_push(&importedFiles, &tmp);
-    return true;
+    return tmp;
 }
 
 void lv_run(void) {
 
+    lv_out = stdout;
+    //results are written in large blocks, see serve
+    if(lv_serve)
+        setvbuf(stdout, NULL, _IOFBF, SERVE_BUFFER);
     lv_startup();
+    if(sigsetjmp(overflowJump, 1)) {
+        //we've exceeded the maximum stack size
+        LvString* inst = lv_tb_getString(&TEXT_BUFFER[pc]);
+        fprintf(lv_out, "Stack overflow: pc=%lu, inst=%s\n", pc, inst->value);
+        if(inst->refCount == 0)
+            lv_free(inst);
+        lv_shutdown();
+    }
     if(lv_mainFile) {
         bool read = lv_readFile(lv_mainFile);
         if(!read) {
-            puts("Error reading main file");
+            fputs("Error reading main file\n", lv_out);
+        } else if(lv_serve) {
+            serve();
         } else {
             //get the main function
             char mainName[] = ":main";
@@ -97,14 +304,13 @@ void lv_run(void) {
                 //box params
                 TextBufferObj args;
                 args.type = OPT_VECT;
-                args.vect = lv_alloc(sizeof(LvVect) + lv_mainArgs.count * sizeof(TextBufferObj));
-                args.vect->refCount = 0;
-                args.vect->len = lv_mainArgs.count;
+                args.vect = lv_vect_alloc(lv_mainArgs.count);
                 for(size_t i = 0; i < args.vect->len; i++) {
                     size_t argLen = strlen(lv_mainArgs.args[i]);
                     LvString* str =
                         lv_alloc(sizeof(LvString) + argLen + 1);
                     str->refCount = 1;
+                    str->hash = 0;
                     str->len = argLen;
                     strcpy(str->value, lv_mainArgs.args[i]);
                     args.vect->data[i].type = OPT_STRING;
@@ -116,29 +322,30 @@ void lv_run(void) {
                 //and there's no expression in the text buffer
                 //so we have to go by stack size.
                 jumpAndLink(entryPoint);
-                do {
+                while(stack.len != 1) {
                     runCycle();
-                } while(stack.len != 1);
+                }
                 //print result
-                TextBufferObj obj;
-                lv_buf_pop(&stack, &obj);
+                TextBufferObj obj = popOwned();
                 LvString* str = lv_tb_getString(&obj);
-                puts(str->value);
+                fprintf(lv_out, "%s\n", str->value);
                 if(str->refCount == 0) {
                     lv_free(str);
                 }
                 lv_expr_cleanup(&obj, 1);
             } else {
                 //cannot call function
-                puts("Main function missing or incompatible");
+                fputs("Main function missing or incompatible\n", lv_out);
             }
         }
+    } else if(lv_serve) {
+        serve();
     } else {
         if(lv_debug)
-            puts("Running in debug mode");
-        puts("Lavender runtime v. 1.0 by Chris Nero\n"
-             "Open source at https://github.com/kvverti/clavender\n"
-             "Enter function definitions or expressions");
+            fputs("Running in debug mode\n", lv_out);
+        fputs("Lavender runtime v. 1.0 by Chris Nero\n"
+              "Open source at https://github.com/kvverti/clavender\n"
+              "Enter function definitions or expressions\n", lv_out);
         while(!feof(stdin)) {
             lv_repl();
         }
@@ -148,9 +355,12 @@ void lv_run(void) {
 
 void* lv_alloc(size_t size) {
 
+    //allocations pay for deferred frees a batch at a time
+    if(lv_deferFree && isMainThread)
+        lv_expr_drain(FREE_BATCH);
     void* value = malloc(size);
     if(!value) {
-        printf("Allocation failed: %lu bytes\n", size);
+        fprintf(lv_out, "Allocation failed: %lu bytes\n", size);
         lv_shutdown();
     }
     return value;
@@ -161,7 +371,7 @@ void* lv_realloc(void* ptr, size_t size) {
     void* tmp = realloc(ptr, size);
     if(!tmp) {
         free(ptr);
-        printf("Allocation failed: %lu bytes\n", size);
+        fprintf(lv_out, "Allocation failed: %lu bytes\n", size);
         lv_shutdown();
     }
     return tmp;
@@ -175,8 +385,10 @@ void lv_free(void* ptr) {
 void lv_startup(void) {
 
     pc = fp = 0;
-    lv_buf_init(&stack, sizeof(TextBufferObj));
+    isMainThread = true;
+    mapStack();
     lv_buf_init(&importedFiles, sizeof(char*));
+    lv_buf_init(&callCaches, sizeof(CallCache));
     lv_op_onStartup();
     lv_tb_onStartup();
     lv_blt_onStartup();
@@ -186,16 +398,31 @@ void lv_startup(void) {
 
 void lv_shutdown(void) {
 
+    //a request that ends the program still gets its reply
+    if(requestOut && lv_out == requestOut)
+        endRequest();
+    //operators are freed below, so captures must be freed first
+    lv_deferFree = false;
+    releaseSlots(stack.data, stack.len);
+    lv_expr_drain(SIZE_MAX);
+    lv_gc_releaseAll();
+    if(lv_profile)
+        lv_prof_report();
+    lv_prof_onShutdown();
+    lv_pf_onShutdown();
     lv_cmd_onShutdown();
     lv_blt_onShutdown();
+    lv_in_onShutdown();
     lv_tb_onShutdown();
     lv_op_onShutdown();
-    lv_expr_cleanup(stack.data, stack.len);
     for(size_t i = 0; i < importedFiles.len; i++) {
         lv_free(*(char**)lv_buf_get(&importedFiles, i));
     }
     lv_free(importedFiles.data);
-    lv_free(stack.data);
+    lv_free(callCaches.data);
+    munmap(stack.data, stackGuard + pageSize - (unsigned char*)stack.data);
+    lv_expr_onShutdown();
+    lv_gc_onShutdown();
     exit(0);
 }
 
@@ -219,32 +446,36 @@ typedef struct HelperDeclObj {
     Operator* func;
     Token* exprStart;
     Token* body;
+    size_t line;
 } HelperDeclObj;
 
-static bool getFuncSig(FILE* file, Operator* scope, DynBuffer* decls);
+static bool getFuncSig(Token* head, size_t line, Operator* scope, DynBuffer* decls);
+
+/**
+ * Starts splitting the files imported by the commands
+ * in decls, so they are ready when the commands run.
+ */
+static void prefetchImports(DynBuffer* decls) {
+
+    for(size_t i = 0; i < decls->len; i++) {
+        HelperDeclObj* obj = lv_buf_get(decls, i);
+        Token* cmd = obj->body;
+        if(!obj->func && cmd && strcmp(cmd->value, "import") == 0
+            && cmd->next && cmd->next->type == TTY_IDENT && !cmd->next->next
+            && !isImported(cmd->next->value))
+            lv_pf_prefetch(cmd->next->value);
+    }
+}
 
 bool lv_readFile(char* name) {
 
-    if(!addFile(name))
+    char* file = addFile(name);
+    if(!file)
         return true; //nothing to do..
-    //open file
-    //TODO clean up a bit (i.e. less strlen)
-    static char ext[] = ".lv";  //lv_filepath/name.lv
-    char* file = lv_alloc(strlen(lv_filepath) + 1 + strlen(name) + sizeof(ext));
-    strcpy(file, lv_filepath);
-    strcat(file, "/");  // '/' works on all major OS (Windows, Mac, Linux)
-    strcat(file, name);
-    strcat(file, ext);
-    //try the current directory first, then the Lavender filepath
-    FILE* importFile = fopen(file + strlen(lv_filepath) + 1, "r");
-    if(!importFile) {
-        importFile = fopen(file, "r");
-        if(!importFile) {
-            lv_free(file);
-            return false;
-        }
-    }
-    //end open file
+    //split the file, or take it from the worker that split it
+    LvSplitFile* split = lv_pf_read(name);
+    if(!split)
+        return false;
     //parse file
     DynBuffer decls;    //of HelperDeclObj
     lv_buf_init(&decls, sizeof(HelperDeclObj));
@@ -255,32 +486,38 @@ bool lv_readFile(char* name) {
     scope.type = FUN_FWD_DECL;
     //parse all function declarations (not the bodies)
     //and gather runtime commands
-    while(!feof(importFile) && res) {
-        res = getFuncSig(importFile, &scope, &decls);
+    Token** stmts = split->stmts.data;
+    size_t* lines = split->lines.data;
+    for(size_t i = 0; i < split->stmts.len && res; i++) {
+        res = getFuncSig(stmts[i], lines[i], &scope, &decls);
+        stmts[i] = NULL;
     }
+    if(res && split->error) {
+        fprintf(lv_out, "Error parsing input: %s\nHere: '%s'\n",
+            lv_tkn_getError(split->error), split->errcxt);
+        res = false;
+    }
+    lv_pf_free(split);
     //successful parse of all declarations
     if(res) {
-        //parse function definitions
+        prefetchImports(&decls);
+        //run the commands and save the function bodies, which are
+        //parsed the first time each function is used
         for(size_t i = 0; i < decls.len; i++) {
             HelperDeclObj* obj = lv_buf_get(&decls, i);
             if(!obj->func) {
                 //runtime command
                 bool successful = lv_cmd_run(obj->body);
                 if(!successful || lv_debug)
-                    puts(lv_cmd_message);
+                    fprintf(lv_out, "%s\n", lv_cmd_message);
                 if(!successful) {
                     res = false;
                     break; //stop execution because of command error
                 }
             } else {
-                //function definition
-                lv_tb_defineFunctionBody(obj->body, obj->func);
-                if(LV_EXPR_ERROR) {
-                    res = false;
-                    printf("Error parsing function body: %s\n", lv_expr_getError(LV_EXPR_ERROR));
-                    LV_EXPR_ERROR = 0;
-                    break;
-                }
+                //function definition, the body owns the tokens
+                lv_tb_deferFunctionBody(obj->exprStart, obj->body, obj->func, file, obj->line);
+                obj->exprStart = NULL;
             }
         }
     }
@@ -289,29 +526,16 @@ bool lv_readFile(char* name) {
         lv_tkn_free(obj->exprStart);
     }
     lv_free(decls.data);
-    fclose(importFile);
-    lv_free(file);
     return res;
 }
 
 /** Parse a function definition OR a runtime command. */
-static bool getFuncSig(FILE* file, Operator* scope, DynBuffer* decls) {
+static bool getFuncSig(Token* head, size_t line, Operator* scope, DynBuffer* decls) {
 
-    Token* head = lv_tkn_split(file);
-    if(LV_TKN_ERROR) {
-        printf("Error parsing input: %s\nHere: '%s'\n",
-            lv_tkn_getError(LV_TKN_ERROR), lv_tkn_errcxt);
-        LV_TKN_ERROR = 0;
-        return false;
-    }
-    if(!head) {
-        //empty line
-        return true;
-    }
     if(head->value[0] == '@') {
         //runtime command
         //push next and free '@' token
-        HelperDeclObj toPush = { NULL, head, head->next };
+        HelperDeclObj toPush = { NULL, head, head->next, line };
         lv_buf_push(decls, &toPush);
         // head->next = NULL;
         // lv_tkn_free(head);
@@ -319,7 +543,7 @@ static bool getFuncSig(FILE* file, Operator* scope, DynBuffer* decls) {
     }
     if(!isFuncDef(head)) {
         //must be function definitions
-        puts("Error parsing input: Not a function definition");
+        fputs("Error parsing input: Not a function definition\n", lv_out);
         lv_tkn_free(head);
         return false;
     }
@@ -327,14 +551,14 @@ static bool getFuncSig(FILE* file, Operator* scope, DynBuffer* decls) {
     Token* body;
     Operator* op = lv_expr_declareFunction(head, scope, &body);
     if(LV_EXPR_ERROR) {
-        printf("Error parsing function signatures: %s\n",
+        fprintf(lv_out, "Error parsing function signatures: %s\n",
             lv_expr_getError(LV_EXPR_ERROR));
         LV_EXPR_ERROR = 0;
         lv_tkn_free(head);
         return false;
     }
     //push declaration and body pointer
-    HelperDeclObj toPush = { op, head, body };
+    HelperDeclObj toPush = { op, head, body, line };
     lv_buf_push(decls, &toPush);
     //free decl tokens only
     // Token* tmp = head;
@@ -345,14 +569,65 @@ static bool getFuncSig(FILE* file, Operator* scope, DynBuffer* decls) {
     return true;
 }
 
+/**
+ * Writes a reply of -serve on one line. Newlines and
+ * backslashes are escaped as in string literals.
+ */
+static void putServed(FILE* out, char* str, size_t len) {
+
+    for(size_t i = 0; i < len; i++) {
+        if(str[i] == '\n') {
+            fputs("\\n", out);
+        } else {
+            if(str[i] == '\\')
+                fputc('\\', out);
+            fputc(str[i], out);
+        }
+    }
+    fputc('\n', out);
+}
+
+/**
+ * Starts capturing the output of a request of -serve. Everything
+ * printed while it runs, such as the errors of a nested import,
+ * goes to requestOut through lv_out, and so into its reply.
+ */
+static void beginRequest(void) {
+
+    rewind(requestOut);
+    lv_out = requestOut;
+}
+
+/**
+ * Writes the captured output of the running request of -serve
+ * to stdout as its reply line, without the final newline.
+ */
+static void endRequest(void) {
+
+    fflush(requestOut);
+    lv_out = stdout;
+    size_t len = ftell(requestOut);
+    if(len > 0 && requestText[len - 1] == '\n')
+        len--;
+    putServed(stdout, requestText, len);
+}
+
+/**
+ * Reads and runs one statement. In the REPL, prompts for it and
+ * reports the tokens past the body. Otherwise, the statement is a
+ * request of -serve, whose output serve makes into one line.
+ */
 static void readInput(FILE* in, bool repl) {
 
     if(repl)
-        printf("> ");
+        fprintf(lv_out, "> ");
     Token* toks = lv_tkn_split(in);
     if(LV_TKN_ERROR) {
-        printf("Error parsing input: %s\nHere: '%s'\n",
-            lv_tkn_getError(LV_TKN_ERROR), lv_tkn_errcxt);
+        if(repl)
+            fprintf(lv_out, "Error parsing input: %s\nHere: '%s'\n",
+                lv_tkn_getError(LV_TKN_ERROR), lv_tkn_errcxt);
+        else
+            fprintf(lv_out, "Error parsing input: %s\n", lv_tkn_getError(LV_TKN_ERROR));
         LV_TKN_ERROR = 0;
         return;
     }
@@ -365,7 +640,7 @@ static void readInput(FILE* in, bool repl) {
             Token* cmd = toks->next;
             lv_free(toks); //free '@' token because we may not return
             lv_cmd_run(cmd);
-            puts(lv_cmd_message);
+            fprintf(lv_out, "%s\n", lv_cmd_message);
             toks = cmd; //so it's freed later
         } else if(isFuncDef(toks)) {
             //define function
@@ -373,13 +648,13 @@ static void readInput(FILE* in, bool repl) {
             scope.name = "repl";    //namespace
             Token* end = lv_tb_defineFunction(toks, &scope, &op);
             if(LV_EXPR_ERROR) {
-                printf("Error parsing function: %s\n",
+                fprintf(lv_out, "Error parsing function: %s\n",
                     lv_expr_getError(LV_EXPR_ERROR));
                 LV_EXPR_ERROR = 0;
             } else {
-                puts(op->name);
-                if(end)
-                    printf("First token past body: type=%d, value=%s\n",
+                fprintf(lv_out, "%s\n", op->name);
+                if(end && repl)
+                    fprintf(lv_out, "First token past body: type=%d, value=%s\n",
                         end->type,
                         end->value);
             }
@@ -389,26 +664,27 @@ static void readInput(FILE* in, bool repl) {
             size_t startIdx, endIdx;
             Token* end = lv_tb_parseExpr(toks, &scope, &startIdx, &endIdx);
             if(LV_EXPR_ERROR) {
-                printf("Error parsing expression: %s\n",
+                fprintf(lv_out, "Error parsing expression: %s\n",
                     lv_expr_getError(LV_EXPR_ERROR));
                 LV_EXPR_ERROR = 0;
             } else {
                 pc = startIdx;
-                while(pc != endIdx) {
+                //bodies defined while the expression runs may start
+                //at endIdx, but then their frame is on the stack
+                while(pc != endIdx || stack.len != 1) {
                     runCycle();
                 }
                 assert(stack.len == 1);
-                TextBufferObj obj;
-                lv_buf_pop(&stack, &obj);
+                TextBufferObj obj = popOwned();
                 LvString* str = lv_tb_getString(&obj);
-                puts(str->value);
+                fprintf(lv_out, "%s\n", str->value);
                 if(str->refCount == 0) {
                     lv_free(str);
                 }
                 lv_expr_cleanup(&obj, 1);
                 lv_tb_clearExpr();
-                if(end)
-                    printf("First token past body: type=%d, value=%s\n",
+                if(end && repl)
+                    fprintf(lv_out, "First token past body: type=%d, value=%s\n",
                         end->type,
                         end->value);
             }
@@ -417,16 +693,82 @@ static void readInput(FILE* in, bool repl) {
     lv_tkn_free(toks);
 }
 
+/**
+ * Runs the requests of -serve, one per line of stdin, with the
+ * imported files kept loaded between them. All the output of a
+ * request, errors included, is its one reply line. Results are only
+ * flushed before waiting for more requests, so clients may send
+ * requests in large batches and read the results in order.
+ */
+static void serve(void) {
+
+    requestOut = open_memstream(&requestText, &requestLen);
+    if(!requestOut) {
+        fputs("Error capturing requests\n", lv_out);
+        return;
+    }
+    size_t cap = SERVE_CHUNK;
+    char* buf = lv_alloc(cap);
+    size_t start = 0;   //first byte of the next request
+    size_t len = 0;
+    bool eof = false;
+    for(;;) {
+        char* nl = memchr(buf + start, '\n', len - start);
+        if(!nl && !eof) {
+            //waiting on the client, so send what it is owed
+            fflush(stdout);
+            memmove(buf, buf + start, len - start);
+            len -= start;
+            start = 0;
+            if(cap - len < SERVE_CHUNK) {
+                cap *= 2;
+                buf = lv_realloc(buf, cap);
+            }
+            ssize_t n;
+            do {
+                n = read(STDIN_FILENO, buf + len, cap - len);
+            } while(n < 0 && errno == EINTR);
+            if(n <= 0)
+                eof = true;
+            else
+                len += n;
+            continue;
+        }
+        //the last request may lack a newline
+        size_t end = nl ? (size_t)(nl - buf) : len;
+        if(end == start && !nl)
+            break;
+        //blank requests still get their line
+        beginRequest();
+        if(end > start) {
+            FILE* in = fmemopen(buf + start, end - start, "r");
+            if(in) {
+                readInput(in, false);
+                fclose(in);
+            } else {
+                fputs("Error reading request\n", lv_out);
+            }
+        }
+        endRequest();
+        if(!nl)
+            break;
+        start = end + 1;
+    }
+    fflush(stdout);
+    lv_free(buf);
+    fclose(requestOut);
+    free(requestText);  //allocated by open_memstream
+    requestOut = NULL;
+}
+
 static void makeVect(int length) {
 
     TextBufferObj vect;
     vect.type = OPT_VECT;
-    vect.vect = lv_alloc(sizeof(LvVect) + length * sizeof(TextBufferObj));
-    vect.vect->refCount = 0;
-    vect.vect->len = length;
+    vect.vect = lv_vect_alloc(length);
     for(size_t i = vect.vect->len; i > 0; i--) {
         //preserve refCounts because we are transferring to vect
-        lv_buf_pop(&stack, &vect.vect->data[i - 1]);
+        vect.vect->data[i - 1] = popOwned();
     }
     push(&vect);
 }
@@ -434,9 +776,9 @@ static void makeVect(int length) {
 /**
  * Prepares the stack for calling the given function with the
  * given number of arguments. Returns whether the setup is successful
- * and sets op to the underlying operator. If the function is a string
- * or a vector, and one argument is passed, the underlying operator is
- * set to the built in __at__ function.
+ * and sets op to the underlying operator. If the function is a string,
+ * vector, or map, and one argument is passed, the underlying operator
+ * is set to the built in __at__ function.
  */
 static bool setUpFuncCall(TextBufferObj* func, size_t numArgs, Operator** underlying) {
 
@@ -460,7 +802,7 @@ static bool setUpFuncCall(TextBufferObj* func, size_t numArgs, Operator** underl
             break;
         }
         case OPT_CAPTURE: {
-            op = func->capfunc;
+            op = func->capture->func;
             int nonCapArity = op->arity - op->captureCount;
             //collect varargs into vect
             if(op->varargs) {
@@ -481,6 +823,7 @@ static bool setUpFuncCall(TextBufferObj* func, size_t numArgs, Operator** underl
         }
         case OPT_STRING:
         case OPT_VECT:
+        case OPT_MAP:
             if(numArgs == 1) {
                 op = atFunc;
                 push(func);
@@ -497,6 +840,158 @@ static bool setUpFuncCall(TextBufferObj* func, size_t numArgs, Operator** underl
     return success;
 }
 
+static CallCache* cacheFor(TextBufferObj* site) {
+
+    if(!site->callSite) {
+        CallCache cache;
+        memset(&cache, 0, sizeof(cache));
+        lv_buf_push(&callCaches, &cache);
+        site->callSite = callCaches.len;
+    }
+    return (CallCache*)callCaches.data + (site->callSite - 1);
+}
+
+/**
+ * Like setUpFuncCall, but checks the call site's inline cache first.
+ * Successful calls of functions and captures are added to the cache,
+ * replacing the oldest entry if the cache is full.
+ */
+static bool setUpCachedCall(TextBufferObj* site, TextBufferObj* func, size_t numArgs, Operator** underlying) {
+
+    Operator* op;
+    if(func->type == OPT_FUNCTION_VAL)
+        op = func->func;
+    else if(func->type == OPT_CAPTURE)
+        op = func->capture->func;
+    else
+        return setUpFuncCall(func, numArgs, underlying);
+    CallCache* cache = cacheFor(site);
+    for(int i = 0; i < CACHE_WAYS; i++) {
+        if(cache->entry[i].op == op && cache->entry[i].type == func->type) {
+            if(cache->entry[i].vectLen >= 0)
+                makeVect(cache->entry[i].vectLen);
+            if(func->type == OPT_CAPTURE) {
+                for(int j = 0; j < op->captureCount; j++)
+                    push(&func->capture->value[j]);
+            }
+            *underlying = op;
+            return true;
+        }
+    }
+    if(!setUpFuncCall(func, numArgs, underlying))
+        return false;
+    unsigned i = cache->next++ % CACHE_WAYS;
+    cache->entry[i].op = op;
+    cache->entry[i].type = func->type;
+    if(op->varargs) {
+        int arity = op->arity - (func->type == OPT_CAPTURE ? op->captureCount : 0);
+        cache->entry[i].vectLen = numArgs - (arity - 1);
+    } else {
+        cache->entry[i].vectLen = -1;
+    }
+    return true;
+}
+
+/**
+ * Pushes the result of a builtin whose reference is already held.
+ * Replaces the function of a paren call if it is on top.
+ */
+static void pushResult(TextBufferObj* res) {
+
+    if(stack.len > 0) {
+        TextBufferObj* top = lv_buf_get(&stack, stack.len - 1);
+        if(top->type == OPT_FUNC_CALL2) {
+            *top = *res;
+            top->borrowed = false;
+            return;
+        }
+    } //else
+    push(res);
+    if(res->type & LV_DYNAMIC)
+        --*res->refCount;
+}
+
+/**
+ * Replaces the top arity args with the result of a builtin,
+ * whose reference is already held. The result replaces the
+ * function of a paren call instead if there is one.
+ */
+static void replaceArgs(int arity, TextBufferObj* res) {
+
+    TextBufferObj* args = lv_buf_get(&stack, stack.len - arity);
+    releaseSlots(args, arity);
+    stack.len -= arity;
+    if(stack.len > 0 && args[-1].type == OPT_FUNC_CALL2) {
+        args[-1] = *res;
+        args[-1].borrowed = false;
+    } else {
+        args[0] = *res;
+        args[0].borrowed = false;
+        stack.len++;
+    }
+}
+
+/**
+ * Calls the builtin on the top arity args in place.
+ */
+static void callBuiltin(Operator* func, int arity) {
+
+    TextBufferObj res = func->builtin(lv_buf_get(&stack, stack.len - arity));
+    retain(&res);
+    //the stack may have been reallocated by the builtin
+    replaceArgs(arity, &res);
+}
+
+/**
+ * Pushes the i'th param and clears its slot, handing
+ * the frame's reference over to the pushed value.
+ */
+static void moveParam(int i) {
+
+    promoteCopies(i);
+    push(lv_buf_get(&stack, fp + i));
+    //push may have reallocated the stack
+    TextBufferObj* param = lv_buf_get(&stack, fp + i);
+    if(param->type & LV_DYNAMIC)
+        --*param->refCount;
+    param->type = OPT_UNDEFINED;
+}
+
+static void callArith(TextBufferObj* inst) {
+
+    TextBufferObj* args = lv_buf_get(&stack, stack.len - 2);
+    TextBufferObj res;
+    if(lv_blt_arith(inst->arith, args, &res))
+        replaceArgs(2, &res);
+    else
+        callBuiltin(inst->func, 2);
+}
+
+/**
+ * Returns the value of an operand of a fused instruction with a
+ * reference held for the caller. Moved params give the frame's
+ * reference to the caller, like OPT_MOVE_PARAM.
+ */
+static TextBufferObj loadOperand(OpType type, TextBufferObj* inst) {
+
+    TextBufferObj res;
+    if(type == OPT_PARAM || type == OPT_MOVE_PARAM) {
+        if(type == OPT_MOVE_PARAM)
+            promoteCopies(inst->param);
+        TextBufferObj* param = lv_buf_get(&stack, fp + inst->param);
+        res = *param;
+        if(type == OPT_MOVE_PARAM) {
+            param->type = OPT_UNDEFINED;
+            return res;
+        }
+    } else {
+        res = *inst;
+    }
+    if(res.type & LV_DYNAMIC)
+        ++*res.refCount;
+    return res;
+}
+
 /**
  * Calls the given function by saving the current stack frame
  * and jumping to the first instruction of the given function.
@@ -505,6 +1000,14 @@ static bool setUpFuncCall(TextBufferObj* func, size_t numArgs, Operator** underl
 static size_t jumpAndLink(Operator* func) {
 
     assert(func);
+    //builtins waiting on nested calls may hold objects that
+    //only refer to adopted objects from C locals
+    if(lv_gc && nesting == 0 && lv_gc_due())
+        lv_gc_collect(stack.data, stack.len);
+    if(func->type == FUN_FWD_DECL) {
+        //the body is deferred until the first call
+        lv_tb_defineDeferred(func);
+    }
     size_t frame = fp;
     switch(func->type) {
         case FUN_FWD_DECL: {
@@ -518,21 +1021,28 @@ static size_t jumpAndLink(Operator* func) {
             //(current) value.
             size_t tmpFp = stack.len - func->arity;
             TextBufferObj res = func->builtin(lv_buf_get(&stack, tmpFp));
+            //hold the result while the args are popped, since it
+            //may be part of an arg that is freed (e.g. __at__)
+            retain(&res);
             popAll(func->arity);
-            if(stack.len > 0) {
-                TextBufferObj* top = lv_buf_get(&stack, stack.len - 1);
-                if(top->type == OPT_FUNC_CALL2) {
-                    //must increment refCount manually
-                    if(res.type & LV_DYNAMIC)
-                        ++*res.refCount;
-                    *top = res;
-                    break;
-                }
-            } //else
-            push(&res);
+            pushResult(&res);
             break;
         }
         case FUN_FUNCTION: {
+            //the callee's params hold references
+            TextBufferObj* args = lv_buf_get(&stack, stack.len - func->arity);
+            for(int i = 0; i < func->arity; i++)
+                promote(&args[i]);
+            if(lv_regvm) {
+                //run to completion on the register VM, which
+                //takes over the args' references
+                TextBufferObj res;
+                if(lv_reg_call(func, args, &res)) {
+                    stack.len -= func->arity;
+                    pushResult(&res);
+                    break;
+                }
+            }
             //calling convention
             //  0. push <undefined> into local slots
             //  1. push fp
@@ -561,8 +1071,13 @@ static size_t jumpAndLink(Operator* func) {
     return frame;
 }
 
+/**
+ * Runs the instruction at pc.
+ */
 static void runCycle(void) {
 
+    if(lv_profile)
+        lv_prof_record(pc);
     TextBufferObj* value = &TEXT_BUFFER[pc++];
     TextBufferObj func; //used in some operations
     switch(value->type) {
@@ -573,13 +1088,13 @@ static void runCycle(void) {
             assert(func.func->type == FUN_FUNCTION); //only Lv functions can capture
             TextBufferObj obj;
             obj.type = OPT_CAPTURE;
-            obj.capfunc = func.func;
             obj.capture = lv_alloc(sizeof(CaptureObj)
                 + func.func->captureCount * sizeof(TextBufferObj));
             obj.capture->refCount = 0;
+            obj.capture->func = func.func;
             for(int i = func.func->captureCount - 1; i >= 0; i--) {
                 //preserve refCounts because we are transferring to capture
-                lv_buf_pop(&stack, &obj.capture->value[i]);
+                obj.capture->value[i] = popOwned();
             }
             push(&obj);
             break;
@@ -595,20 +1110,73 @@ static void runCycle(void) {
         case OPT_STRING:
         case OPT_CAPTURE:
         case OPT_VECT:
+        case OPT_MAP:
             //push it on the stack
-            push(value);
+            pushBorrowed(value);
             break;
         case OPT_PARAM:
             //push i'th param
-            push(lv_buf_get(&stack, fp + value->param));
+            pushBorrowed(lv_buf_get(&stack, fp + value->param));
             break;
         case OPT_PUT_PARAM: {
             //pop top and place in i'th param
+            func = popOwned();
             TextBufferObj* param = lv_buf_get(&stack, fp + value->param);
-            lv_buf_pop(&stack, &func);
             *param = func;
             break;
         }
+        case OPT_DISPATCH: {
+            //jump to the body for a function value, otherwise
+            //push the param and test the conditions in order
+            TextBufferObj* param = lv_buf_get(&stack, fp + value->dispatch->param);
+            if(param->type == OPT_FUNCTION_VAL)
+                pc += lv_tb_dispatch(value->dispatch, param->func) - 1;
+            else
+                pushBorrowed(param);
+            break;
+        }
+        case OPT_PARAM_CALL2:
+        case OPT_MOVE_CALL2: {
+            //fused param, operand, and arity 2 builtin call. The args
+            //are loaded straight from the frame and the text buffer.
+            TextBufferObj args[2];
+            args[0] = loadOperand(value->type == OPT_PARAM_CALL2 ? OPT_PARAM : OPT_MOVE_PARAM, value);
+            args[1] = loadOperand(TEXT_BUFFER[pc].type, &TEXT_BUFFER[pc]);
+            TextBufferObj* call = &TEXT_BUFFER[pc + 1];
+            pc += 2;
+            TextBufferObj res;
+            if(call->arith && lv_blt_arith(call->arith, args, &res)) {
+                pushResult(&res);
+                break;
+            }
+            res = call->func->builtin(args);
+            retain(&res);
+            lv_expr_cleanup(args, 2);
+            pushResult(&res);
+            break;
+        }
+        case OPT_BUILTIN1:
+            callBuiltin(value->func, 1);
+            break;
+        case OPT_BUILTIN2:
+            callBuiltin(value->func, 2);
+            break;
+        case OPT_ARITH:
+            callArith(value);
+            break;
+        case OPT_PARAM_BNE: {
+            //fused param, literal, =, and beqz. The literal is not
+            //object-like, so = is the same as sys:__eq__.
+            TextBufferObj* param = lv_buf_get(&stack, fp + value->param);
+            if(lv_blt_equal(param, &TEXT_BUFFER[pc]))
+                pc += 3;
+            else
+                pc += 2 + TEXT_BUFFER[pc + 2].branchAddr;
+            break;
+        }
+        case OPT_MOVE_PARAM:
+            moveParam(value->param);
+            break;
         case OPT_BEQZ: {
             TextBufferObj obj = removeTop();
             if(!lv_blt_toBool(&obj))
@@ -618,9 +1186,9 @@ static void runCycle(void) {
         case OPT_FUNC_CALL: {
             Operator* op;
             lv_buf_pop(&stack, &func);
-            bool setup = setUpFuncCall(&func, value->callArity, &op);
+            bool setup = setUpCachedCall(value, &func, value->callArity, &op);
             //cleanup memory
-            lv_expr_cleanup(&func, 1);
+            releaseSlots(&func, 1);
             if(!setup) {
                 TextBufferObj nan;
                 nan.type = OPT_UNDEFINED;
@@ -639,10 +1207,11 @@ static void runCycle(void) {
                 func = *pos;
                 //signal for return instruction to remove bottom func
                 pos->type = OPT_FUNC_CALL2;
+                pos->borrowed = false;
             }
             Operator* op;
-            bool setup = setUpFuncCall(&func, arity - 1, &op);
-            lv_expr_cleanup(&func, 1);
+            bool setup = setUpCachedCall(value, &func, arity - 1, &op);
+            releaseSlots(&func, 1);
             if(!setup) {
                 assert(stack.len > 0);
                 TextBufferObj* top = lv_buf_get(&stack, stack.len - 1);
@@ -660,8 +1229,7 @@ static void runCycle(void) {
             //bypass removeTop for the return value
             //so we keep its string refCount intact
             //this keeps popAll from freeing the return value
-            TextBufferObj retVal;
-            lv_buf_pop(&stack, &retVal);
+            TextBufferObj retVal = popOwned();
             //reset pc and fp
             pc = removeTop().addr;
             size_t tmpFp = removeTop().addr;
@@ -675,7 +1243,7 @@ static void runCycle(void) {
                     break;
                 }
             } //else
-            lv_buf_push(&stack, &retVal);
+            pushSlot(&retVal, false);
             break;
         }
         case OPT_LITERAL:
@@ -686,6 +1254,23 @@ static void runCycle(void) {
     }
 }
 
+/**
+ * Runs the function called by jumpAndLink until it returns
+ * and pops the result.
+ */
+static void finishCall(Operator* op, TextBufferObj* ret) {
+
+    nesting++;
+    size_t frame = jumpAndLink(op);
+    //we stop executing when the frame pushed by
+    //jumpAndLink is popped.
+    while(fp != frame) {
+        runCycle();
+    }
+    *ret = removeTop();
+    nesting--;
+}
+
 /**
  * Calls the function given with the parameters given and returns
  * the result. This function handles captures, vects, strings, and functions.
@@ -700,12 +1285,14 @@ void lv_callFunction(TextBufferObj* func, size_t numArgs, TextBufferObj* args, T
     if(!setUpFuncCall(func, numArgs, &op)) {
         ret->type = OPT_UNDEFINED;
     } else {
-        size_t frame = jumpAndLink(op);
-        //we stop executing when the frame pushed by
-        //jumpAndLink is popped.
-        while(fp != frame) {
-            runCycle();
-        }
-        *ret = removeTop();
+        finishCall(op, ret);
+    }
+}
+
+void lv_callOperator(Operator* op, TextBufferObj* args, TextBufferObj* ret) {
+
+    for(int i = 0; i < op->arity; i++) {
+        push(&args[i]);
     }
+    finishCall(op, ret);
 }
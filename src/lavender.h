@@ -3,11 +3,24 @@
 #include "textbuffer.h"
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
 
 bool lv_debug;
+bool lv_profile;
+bool lv_regvm;
+bool lv_deferFree;
+bool lv_gc;
+bool lv_serve;
+bool lv_formatG;
 char* lv_filepath;
+char* lv_programName;  //argv[0], see lv_in_serve
 char* lv_mainFile;
 size_t lv_maxStackSize;
+/**
+ * Where the running program prints. This is stdout, except that
+ * -serve points it at the captured output of each request.
+ */
+FILE* lv_out;
 struct LvMainArgs {
     char** args;
     int count;
@@ -17,6 +30,16 @@ void lv_run(void);
 void lv_repl(void);
 bool lv_readFile(char* name);
 void lv_callFunction(TextBufferObj* func, size_t numArgs, TextBufferObj* args, TextBufferObj* ret);
+/**
+ * Calls the function with exactly its arity args on the stack VM.
+ */
+void lv_callOperator(Operator* op, TextBufferObj* args, TextBufferObj* ret);
+/**
+ * Returns whether the object is a stack slot borrowing the reference
+ * of a param or literal instead of holding its own. Builtins must not
+ * modify borrowed args in place.
+ */
+bool lv_isBorrowed(TextBufferObj* obj);
 void lv_startup(void);
 void lv_shutdown(void);
 void* lv_alloc(size_t size);
@@ -7,6 +7,7 @@
 int main(int argc, char* argv[]) {
     
     bool usingMain = false;
+    lv_programName = argv[0];
     //parse command line arguments
     for(int i = 1; i < argc; i++) {
         if(usingMain) {
@@ -23,6 +24,18 @@ int main(int argc, char* argv[]) {
             lv_filepath = argv[i];
         } else if(strcmp(argv[i], "-debug") == 0) {
             lv_debug = true;
+        } else if(strcmp(argv[i], "-profile") == 0) {
+            lv_profile = true;
+        } else if(strcmp(argv[i], "-regvm") == 0) {
+            lv_regvm = true;
+        } else if(strcmp(argv[i], "-deferFree") == 0) {
+            lv_deferFree = true;
+        } else if(strcmp(argv[i], "-gc") == 0) {
+            lv_gc = true;
+        } else if(strcmp(argv[i], "-serve") == 0) {
+            lv_serve = true;
+        } else if(strcmp(argv[i], "-formatG") == 0) {
+            lv_formatG = true;
         } else if(strcmp(argv[i], "-maxStackSize") == 0) {
             //-maxStackSize takes one argument
             if(i == (argc - 1)) {
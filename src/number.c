@@ -0,0 +1,1178 @@
+#include "number.h"
+#include "lavender.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+
+/**
+ * Doubles are formatted with Grisu2 (Loitsch, "Printing Floating-Point
+ * Numbers Quickly and Accurately with Integers"). It finds digits that
+ * read back as the same double, which are the shortest such digits for
+ * almost all doubles, using only 64 bit integer arithmetic.
+ */
+
+//a floating point value f * 2^e with a 64 bit significand
+typedef struct DiyFp {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+#define SIGNIFICAND_BITS 52
+#define HIDDEN_BIT ((uint64_t)1 << SIGNIFICAND_BITS)
+#define SIGNIFICAND_MASK (HIDDEN_BIT - 1)
+#define EXPONENT_BIAS (0x3ff + SIGNIFICAND_BITS)
+
+//normalized significands of 10^-348, 10^-340, ..., 10^340
+static const uint64_t cachedPowersF[] = {
+    0xfa8fd5a0081c0288, 0xbaaee17fa23ebf76, 0x8b16fb203055ac76,
+    0xcf42894a5dce35ea, 0x9a6bb0aa55653b2d, 0xe61acf033d1a45df,
+    0xab70fe17c79ac6ca, 0xff77b1fcbebcdc4f, 0xbe5691ef416bd60c,
+    0x8dd01fad907ffc3c, 0xd3515c2831559a83, 0x9d71ac8fada6c9b5,
+    0xea9c227723ee8bcb, 0xaecc49914078536d, 0x823c12795db6ce57,
+    0xc21094364dfb5637, 0x9096ea6f3848984f, 0xd77485cb25823ac7,
+    0xa086cfcd97bf97f4, 0xef340a98172aace5, 0xb23867fb2a35b28e,
+    0x84c8d4dfd2c63f3b, 0xc5dd44271ad3cdba, 0x936b9fcebb25c996,
+    0xdbac6c247d62a584, 0xa3ab66580d5fdaf6, 0xf3e2f893dec3f126,
+    0xb5b5ada8aaff80b8, 0x87625f056c7c4a8b, 0xc9bcff6034c13053,
+    0x964e858c91ba2655, 0xdff9772470297ebd, 0xa6dfbd9fb8e5b88f,
+    0xf8a95fcf88747d94, 0xb94470938fa89bcf, 0x8a08f0f8bf0f156b,
+    0xcdb02555653131b6, 0x993fe2c6d07b7fac, 0xe45c10c42a2b3b06,
+    0xaa242499697392d3, 0xfd87b5f28300ca0e, 0xbce5086492111aeb,
+    0x8cbccc096f5088cc, 0xd1b71758e219652c, 0x9c40000000000000,
+    0xe8d4a51000000000, 0xad78ebc5ac620000, 0x813f3978f8940984,
+    0xc097ce7bc90715b3, 0x8f7e32ce7bea5c70, 0xd5d238a4abe98068,
+    0x9f4f2726179a2245, 0xed63a231d4c4fb27, 0xb0de65388cc8ada8,
+    0x83c7088e1aab65db, 0xc45d1df942711d9a, 0x924d692ca61be758,
+    0xda01ee641a708dea, 0xa26da3999aef774a, 0xf209787bb47d6b85,
+    0xb454e4a179dd1877, 0x865b86925b9bc5c2, 0xc83553c5c8965d3d,
+    0x952ab45cfa97a0b3, 0xde469fbd99a05fe3, 0xa59bc234db398c25,
+    0xf6c69a72a3989f5c, 0xb7dcbf5354e9bece, 0x88fcf317f22241e2,
+    0xcc20ce9bd35c78a5, 0x98165af37b2153df, 0xe2a0b5dc971f303a,
+    0xa8d9d1535ce3b396, 0xfb9b7cd9a4a7443c, 0xbb764c4ca7a44410,
+    0x8bab8eefb6409c1a, 0xd01fef10a657842c, 0x9b10a4e5e9913129,
+    0xe7109bfba19c0c9d, 0xac2820d9623bf429, 0x80444b5e7aa7cf85,
+    0xbf21e44003acdd2d, 0x8e679c2f5e44ff8f, 0xd433179d9c8cb841,
+    0x9e19db92b4e31ba9, 0xeb96bf6ebadf77d9, 0xaf87023b9bf0ee6b,
+};
+
+//binary exponents of cachedPowersF
+static const int16_t cachedPowersE[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+static const uint64_t pow10[] = {
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull,
+    10000000ull, 100000000ull, 1000000000ull, 10000000000ull,
+    100000000000ull, 1000000000000ull, 10000000000000ull,
+    100000000000000ull, 1000000000000000ull, 10000000000000000ull,
+    100000000000000000ull, 1000000000000000000ull,
+    10000000000000000000ull
+};
+
+//pairs of decimal digits 00 to 99
+static const char digitPairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static DiyFp fromDouble(double value) {
+
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    int biased = (bits >> SIGNIFICAND_BITS) & 0x7ff;
+    uint64_t significand = bits & SIGNIFICAND_MASK;
+    DiyFp res;
+    if(biased) {
+        res.f = significand + HIDDEN_BIT;
+        res.e = biased - EXPONENT_BIAS;
+    } else {
+        //subnormal
+        res.f = significand;
+        res.e = 1 - EXPONENT_BIAS;
+    }
+    return res;
+}
+
+//the product rounded to 64 bits
+static DiyFp multiply(DiyFp a, DiyFp b) {
+
+    unsigned __int128 p = (unsigned __int128)a.f * b.f;
+    DiyFp res;
+    res.f = (uint64_t)(p >> 64) + (((uint64_t)p >> 63) & 1);
+    res.e = a.e + b.e + 64;
+    return res;
+}
+
+static DiyFp normalize(DiyFp x) {
+
+    int shift = __builtin_clzll(x.f);
+    x.f <<= shift;
+    x.e -= shift;
+    return x;
+}
+
+/**
+ * Sets lo and hi to the midpoints between the value and its
+ * neighbouring doubles, normalized to the same exponent.
+ */
+static void boundaries(DiyFp v, DiyFp* lo, DiyFp* hi) {
+
+    *hi = normalize((DiyFp){ (v.f << 1) + 1, v.e - 1 });
+    //the gap below a power of two is half the gap above it
+    if(v.f == HIDDEN_BIT)
+        *lo = (DiyFp){ (v.f << 2) - 1, v.e - 2 };
+    else
+        *lo = (DiyFp){ (v.f << 1) - 1, v.e - 1 };
+    lo->f <<= lo->e - hi->e;
+    lo->e = hi->e;
+}
+
+/**
+ * Returns the cached power of ten c = 10^-k such that the
+ * exponent of a product with c is small, setting k.
+ */
+static DiyFp cachedPower(int e, int* k) {
+
+    //log10(2) and the offset of the first cached power
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int ik = (int)dk;
+    if(dk - ik > 0.0)
+        ik++;
+    unsigned idx = (ik >> 3) + 1;
+    *k = -(-348 + (int)(idx << 3));
+    return (DiyFp){ cachedPowersF[idx], cachedPowersE[idx] };
+}
+
+/**
+ * Moves the last digit towards w while the digits stay
+ * within the rounding interval.
+ */
+static void roundWeed(char* buf, int len, uint64_t delta, uint64_t rest, uint64_t tenKappa, uint64_t wpw) {
+
+    while(rest < wpw && delta - rest >= tenKappa
+        && (rest + tenKappa < wpw || wpw - rest > rest + tenKappa - wpw)) {
+        buf[len - 1]--;
+        rest += tenKappa;
+    }
+}
+
+static int countDigits(uint32_t n) {
+
+    int res = 1;
+    while(n >= 10) {
+        n /= 10;
+        res++;
+    }
+    return res;
+}
+
+/**
+ * Writes the digits of w that fall within delta of mp,
+ * adding the scale of the last digit to k.
+ */
+static int digitGen(DiyFp w, DiyFp mp, uint64_t delta, char* buf, int* k) {
+
+    DiyFp one = { (uint64_t)1 << -mp.e, mp.e };
+    uint64_t wpw = mp.f - w.f;
+    uint32_t p1 = (uint32_t)(mp.f >> -one.e);
+    uint64_t p2 = mp.f & (one.f - 1);
+    int kappa = countDigits(p1);
+    int len = 0;
+    //integral part
+    while(kappa > 0) {
+        uint32_t d = p1 / pow10[kappa - 1];
+        p1 %= pow10[kappa - 1];
+        if(d || len)
+            buf[len++] = '0' + d;
+        kappa--;
+        uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+        if(rest <= delta) {
+            *k += kappa;
+            roundWeed(buf, len, delta, rest, pow10[kappa] << -one.e, wpw);
+            return len;
+        }
+    }
+    //fractional part
+    for(;;) {
+        p2 *= 10;
+        delta *= 10;
+        char d = (char)(p2 >> -one.e);
+        if(d || len)
+            buf[len++] = '0' + d;
+        p2 &= one.f - 1;
+        kappa--;
+        if(p2 < delta) {
+            *k += kappa;
+            int idx = -kappa;
+            roundWeed(buf, len, delta, p2, one.f, wpw * (idx < 20 ? pow10[idx] : 0));
+            return len;
+        }
+    }
+}
+
+/**
+ * Writes the digits of a positive finite double, returning their
+ * count. The value is the digits times 10^k.
+ */
+static int grisu2(double value, char* buf, int* k) {
+
+    DiyFp v = fromDouble(value);
+    DiyFp lo, hi;
+    boundaries(v, &lo, &hi);
+    DiyFp c = cachedPower(hi.e, k);
+    DiyFp w = multiply(normalize(v), c);
+    DiyFp wp = multiply(hi, c);
+    DiyFp wm = multiply(lo, c);
+    //stay inside the interval despite the rounding of multiply
+    wm.f++;
+    wp.f--;
+    return digitGen(w, wp, wp.f - wm.f, buf, k);
+}
+
+static char* writeExponent(int exp, char* out) {
+
+    *out++ = 'e';
+    if(exp < 0) {
+        *out++ = '-';
+        exp = -exp;
+    } else {
+        *out++ = '+';
+    }
+    //at least two digits, as with %g
+    if(exp >= 100) {
+        *out++ = '0' + exp / 100;
+        exp %= 100;
+    }
+    memcpy(out, digitPairs + 2 * exp, 2);
+    return out + 2;
+}
+
+size_t lv_num_formatNumber(double value, char* out) {
+
+    if(lv_formatG || !isfinite(value))
+        return snprintf(out, LV_NUM_FORMAT_LEN, "%g", value);
+    char* start = out;
+    if(signbit(value)) {
+        *out++ = '-';
+        value = -value;
+    }
+    if(value == 0) {
+        *out++ = '0';
+        *out = '\0';
+        return out - start;
+    }
+    char digits[20];
+    int k;
+    int len = grisu2(value, digits, &k);
+    //the value is d.ddd * 10^exp
+    int exp = len + k - 1;
+    //%g switches notation at its precision of 6 digits, and
+    //longer digits count as a longer precision. So when the
+    //digits fit in 6 digits, the result is the same as %g.
+    int precision = len > 6 ? len : 6;
+    if(exp < -4 || exp >= precision) {
+        *out++ = digits[0];
+        if(len > 1) {
+            *out++ = '.';
+            memcpy(out, digits + 1, len - 1);
+            out += len - 1;
+        }
+        out = writeExponent(exp, out);
+    } else if(exp < 0) {
+        //0.000ddd
+        *out++ = '0';
+        *out++ = '.';
+        memset(out, '0', -exp - 1);
+        out += -exp - 1;
+        memcpy(out, digits, len);
+        out += len;
+    } else if(len <= exp + 1) {
+        //ddd000
+        memcpy(out, digits, len);
+        memset(out + len, '0', exp + 1 - len);
+        out += exp + 1;
+    } else {
+        //ddd.ddd
+        memcpy(out, digits, exp + 1);
+        out += exp + 1;
+        *out++ = '.';
+        memcpy(out, digits + exp + 1, len - exp - 1);
+        out += len - exp - 1;
+    }
+    *out = '\0';
+    return out - start;
+}
+
+size_t lv_num_formatInteger(uint64_t value, char* out) {
+
+    char* start = out;
+    //integers are two's complement
+    if(value >> 63) {
+        *out++ = '-';
+        value = -value;
+    }
+    //write the digits backwards, two at a time
+    char buf[20];
+    char* p = buf + sizeof(buf);
+    while(value >= 100) {
+        p -= 2;
+        memcpy(p, digitPairs + 2 * (value % 100), 2);
+        value /= 100;
+    }
+    if(value >= 10) {
+        p -= 2;
+        memcpy(p, digitPairs + 2 * value, 2);
+    } else {
+        *--p = '0' + value;
+    }
+    size_t len = buf + sizeof(buf) - p;
+    memcpy(out, p, len);
+    out[len] = '\0';
+    return out + len - start;
+}
+
+/**
+ * Decimal text is parsed with Clinger's fast path when the digits and
+ * the power of ten are both exact doubles, and otherwise with the
+ * Eisel-Lemire algorithm (Lemire, "Number Parsing at a Gigabyte per
+ * Second"), which multiplies the digits by a 128 bit approximation of
+ * the power of ten and gives up in the rare cases where the product
+ * is too close to a rounding boundary to be sure of the result. Those
+ * cases, and any text that is not plain decimal digits, are left to
+ * strtod, which gives the same results much more slowly.
+ */
+
+#define MIN_POW10 (-342)
+#define MAX_POW10 308
+//most digits that always fit in a uint64_t
+#define MAX_DIGITS 19
+
+//10^MIN_POW10 to 10^MAX_POW10 as { low, high } 64 bits of a
+//normalized 128 bit significand, rounded down
+static const uint64_t pow10Wide[][2] = {
+{ 0x113faa2906a13b3f, 0xeef453d6923bd65a },
+    { 0x4ac7ca59a424c507, 0x9558b4661b6565f8 },
+    { 0x5d79bcf00d2df649, 0xbaaee17fa23ebf76 },
+    { 0xf4d82c2c107973dc, 0xe95a99df8ace6f53 },
+    { 0x79071b9b8a4be869, 0x91d8a02bb6c10594 },
+    { 0x9748e2826cdee284, 0xb64ec836a47146f9 },
+    { 0xfd1b1b2308169b25, 0xe3e27a444d8d98b7 },
+    { 0xfe30f0f5e50e20f7, 0x8e6d8c6ab0787f72 },
+    { 0xbdbd2d335e51a935, 0xb208ef855c969f4f },
+    { 0xad2c788035e61382, 0xde8b2b66b3bc4723 },
+    { 0x4c3bcb5021afcc31, 0x8b16fb203055ac76 },
+    { 0xdf4abe242a1bbf3d, 0xaddcb9e83c6b1793 },
+    { 0xd71d6dad34a2af0d, 0xd953e8624b85dd78 },
+    { 0x8672648c40e5ad68, 0x87d4713d6f33aa6b },
+    { 0x680efdaf511f18c2, 0xa9c98d8ccb009506 },
+    { 0x0212bd1b2566def2, 0xd43bf0effdc0ba48 },
+    { 0x014bb630f7604b57, 0x84a57695fe98746d },
+    { 0x419ea3bd35385e2d, 0xa5ced43b7e3e9188 },
+    { 0x52064cac828675b9, 0xcf42894a5dce35ea },
+    { 0x7343efebd1940993, 0x818995ce7aa0e1b2 },
+    { 0x1014ebe6c5f90bf8, 0xa1ebfb4219491a1f },
+    { 0xd41a26e077774ef6, 0xca66fa129f9b60a6 },
+    { 0x8920b098955522b4, 0xfd00b897478238d0 },
+    { 0x55b46e5f5d5535b0, 0x9e20735e8cb16382 },
+    { 0xeb2189f734aa831d, 0xc5a890362fddbc62 },
+    { 0xa5e9ec7501d523e4, 0xf712b443bbd52b7b },
+    { 0x47b233c92125366e, 0x9a6bb0aa55653b2d },
+    { 0x999ec0bb696e840a, 0xc1069cd4eabe89f8 },
+    { 0xc00670ea43ca250d, 0xf148440a256e2c76 },
+    { 0x380406926a5e5728, 0x96cd2a865764dbca },
+    { 0xc605083704f5ecf2, 0xbc807527ed3e12bc },
+    { 0xf7864a44c633682e, 0xeba09271e88d976b },
+    { 0x7ab3ee6afbe0211d, 0x93445b8731587ea3 },
+    { 0x5960ea05bad82964, 0xb8157268fdae9e4c },
+    { 0x6fb92487298e33bd, 0xe61acf033d1a45df },
+    { 0xa5d3b6d479f8e056, 0x8fd0c16206306bab },
+    { 0x8f48a4899877186c, 0xb3c4f1ba87bc8696 },
+    { 0x331acdabfe94de87, 0xe0b62e2929aba83c },
+    { 0x9ff0c08b7f1d0b14, 0x8c71dcd9ba0b4925 },
+    { 0x07ecf0ae5ee44dd9, 0xaf8e5410288e1b6f },
+    { 0xc9e82cd9f69d6150, 0xdb71e91432b1a24a },
+    { 0xbe311c083a225cd2, 0x892731ac9faf056e },
+    { 0x6dbd630a48aaf406, 0xab70fe17c79ac6ca },
+    { 0x092cbbccdad5b108, 0xd64d3d9db981787d },
+    { 0x25bbf56008c58ea5, 0x85f0468293f0eb4e },
+    { 0xaf2af2b80af6f24e, 0xa76c582338ed2621 },
+    { 0x1af5af660db4aee1, 0xd1476e2c07286faa },
+    { 0x50d98d9fc890ed4d, 0x82cca4db847945ca },
+    { 0xe50ff107bab528a0, 0xa37fce126597973c },
+    { 0x1e53ed49a96272c8, 0xcc5fc196fefd7d0c },
+    { 0x25e8e89c13bb0f7a, 0xff77b1fcbebcdc4f },
+    { 0x77b191618c54e9ac, 0x9faacf3df73609b1 },
+    { 0xd59df5b9ef6a2417, 0xc795830d75038c1d },
+    { 0x4b0573286b44ad1d, 0xf97ae3d0d2446f25 },
+    { 0x4ee367f9430aec32, 0x9becce62836ac577 },
+    { 0x229c41f793cda73f, 0xc2e801fb244576d5 },
+    { 0x6b43527578c1110f, 0xf3a20279ed56d48a },
+    { 0x830a13896b78aaa9, 0x9845418c345644d6 },
+    { 0x23cc986bc656d553, 0xbe5691ef416bd60c },
+    { 0x2cbfbe86b7ec8aa8, 0xedec366b11c6cb8f },
+    { 0x7bf7d71432f3d6a9, 0x94b3a202eb1c3f39 },
+    { 0xdaf5ccd93fb0cc53, 0xb9e08a83a5e34f07 },
+    { 0xd1b3400f8f9cff68, 0xe858ad248f5c22c9 },
+    { 0x23100809b9c21fa1, 0x91376c36d99995be },
+    { 0xabd40a0c2832a78a, 0xb58547448ffffb2d },
+    { 0x16c90c8f323f516c, 0xe2e69915b3fff9f9 },
+    { 0xae3da7d97f6792e3, 0x8dd01fad907ffc3b },
+    { 0x99cd11cfdf41779c, 0xb1442798f49ffb4a },
+    { 0x40405643d711d583, 0xdd95317f31c7fa1d },
+    { 0x482835ea666b2572, 0x8a7d3eef7f1cfc52 },
+    { 0xda3243650005eecf, 0xad1c8eab5ee43b66 },
+    { 0x90bed43e40076a82, 0xd863b256369d4a40 },
+    { 0x5a7744a6e804a291, 0x873e4f75e2224e68 },
+    { 0x711515d0a205cb36, 0xa90de3535aaae202 },
+    { 0x0d5a5b44ca873e03, 0xd3515c2831559a83 },
+    { 0xe858790afe9486c2, 0x8412d9991ed58091 },
+    { 0x626e974dbe39a872, 0xa5178fff668ae0b6 },
+    { 0xfb0a3d212dc8128f, 0xce5d73ff402d98e3 },
+    { 0x7ce66634bc9d0b99, 0x80fa687f881c7f8e },
+    { 0x1c1fffc1ebc44e80, 0xa139029f6a239f72 },
+    { 0xa327ffb266b56220, 0xc987434744ac874e },
+    { 0x4bf1ff9f0062baa8, 0xfbe9141915d7a922 },
+    { 0x6f773fc3603db4a9, 0x9d71ac8fada6c9b5 },
+    { 0xcb550fb4384d21d3, 0xc4ce17b399107c22 },
+    { 0x7e2a53a146606a48, 0xf6019da07f549b2b },
+    { 0x2eda7444cbfc426d, 0x99c102844f94e0fb },
+    { 0xfa911155fefb5308, 0xc0314325637a1939 },
+    { 0x793555ab7eba27ca, 0xf03d93eebc589f88 },
+    { 0x4bc1558b2f3458de, 0x96267c7535b763b5 },
+    { 0x9eb1aaedfb016f16, 0xbbb01b9283253ca2 },
+    { 0x465e15a979c1cadc, 0xea9c227723ee8bcb },
+    { 0x0bfacd89ec191ec9, 0x92a1958a7675175f },
+    { 0xcef980ec671f667b, 0xb749faed14125d36 },
+    { 0x82b7e12780e7401a, 0xe51c79a85916f484 },
+    { 0xd1b2ecb8b0908810, 0x8f31cc0937ae58d2 },
+    { 0x861fa7e6dcb4aa15, 0xb2fe3f0b8599ef07 },
+    { 0x67a791e093e1d49a, 0xdfbdcece67006ac9 },
+    { 0xe0c8bb2c5c6d24e0, 0x8bd6a141006042bd },
+    { 0x58fae9f773886e18, 0xaecc49914078536d },
+    { 0xaf39a475506a899e, 0xda7f5bf590966848 },
+    { 0x6d8406c952429603, 0x888f99797a5e012d },
+    { 0xc8e5087ba6d33b83, 0xaab37fd7d8f58178 },
+    { 0xfb1e4a9a90880a64, 0xd5605fcdcf32e1d6 },
+    { 0x5cf2eea09a55067f, 0x855c3be0a17fcd26 },
+    { 0xf42faa48c0ea481e, 0xa6b34ad8c9dfc06f },
+    { 0xf13b94daf124da26, 0xd0601d8efc57b08b },
+    { 0x76c53d08d6b70858, 0x823c12795db6ce57 },
+    { 0x54768c4b0c64ca6e, 0xa2cb1717b52481ed },
+    { 0xa9942f5dcf7dfd09, 0xcb7ddcdda26da268 },
+    { 0xd3f93b35435d7c4c, 0xfe5d54150b090b02 },
+    { 0xc47bc5014a1a6daf, 0x9efa548d26e5a6e1 },
+    { 0x359ab6419ca1091b, 0xc6b8e9b0709f109a },
+    { 0xc30163d203c94b62, 0xf867241c8cc6d4c0 },
+    { 0x79e0de63425dcf1d, 0x9b407691d7fc44f8 },
+    { 0x985915fc12f542e4, 0xc21094364dfb5636 },
+    { 0x3e6f5b7b17b2939d, 0xf294b943e17a2bc4 },
+    { 0xa705992ceecf9c42, 0x979cf3ca6cec5b5a },
+    { 0x50c6ff782a838353, 0xbd8430bd08277231 },
+    { 0xa4f8bf5635246428, 0xece53cec4a314ebd },
+    { 0x871b7795e136be99, 0x940f4613ae5ed136 },
+    { 0x28e2557b59846e3f, 0xb913179899f68584 },
+    { 0x331aeada2fe589cf, 0xe757dd7ec07426e5 },
+    { 0x3ff0d2c85def7621, 0x9096ea6f3848984f },
+    { 0x0fed077a756b53a9, 0xb4bca50b065abe63 },
+    { 0xd3e8495912c62894, 0xe1ebce4dc7f16dfb },
+    { 0x64712dd7abbbd95c, 0x8d3360f09cf6e4bd },
+    { 0xbd8d794d96aacfb3, 0xb080392cc4349dec },
+    { 0xecf0d7a0fc5583a0, 0xdca04777f541c567 },
+    { 0xf41686c49db57244, 0x89e42caaf9491b60 },
+    { 0x311c2875c522ced5, 0xac5d37d5b79b6239 },
+    { 0x7d633293366b828b, 0xd77485cb25823ac7 },
+    { 0xae5dff9c02033197, 0x86a8d39ef77164bc },
+    { 0xd9f57f830283fdfc, 0xa8530886b54dbdeb },
+    { 0xd072df63c324fd7b, 0xd267caa862a12d66 },
+    { 0x4247cb9e59f71e6d, 0x8380dea93da4bc60 },
+    { 0x52d9be85f074e608, 0xa46116538d0deb78 },
+    { 0x67902e276c921f8b, 0xcd795be870516656 },
+    { 0x00ba1cd8a3db53b6, 0x806bd9714632dff6 },
+    { 0x80e8a40eccd228a4, 0xa086cfcd97bf97f3 },
+    { 0x6122cd128006b2cd, 0xc8a883c0fdaf7df0 },
+    { 0x796b805720085f81, 0xfad2a4b13d1b5d6c },
+    { 0xcbe3303674053bb0, 0x9cc3a6eec6311a63 },
+    { 0xbedbfc4411068a9c, 0xc3f490aa77bd60fc },
+    { 0xee92fb5515482d44, 0xf4f1b4d515acb93b },
+    { 0x751bdd152d4d1c4a, 0x991711052d8bf3c5 },
+    { 0xd262d45a78a0635d, 0xbf5cd54678eef0b6 },
+    { 0x86fb897116c87c34, 0xef340a98172aace4 },
+    { 0xd45d35e6ae3d4da0, 0x9580869f0e7aac0e },
+    { 0x8974836059cca109, 0xbae0a846d2195712 },
+    { 0x2bd1a438703fc94b, 0xe998d258869facd7 },
+    { 0x7b6306a34627ddcf, 0x91ff83775423cc06 },
+    { 0x1a3bc84c17b1d542, 0xb67f6455292cbf08 },
+    { 0x20caba5f1d9e4a93, 0xe41f3d6a7377eeca },
+    { 0x547eb47b7282ee9c, 0x8e938662882af53e },
+    { 0xe99e619a4f23aa43, 0xb23867fb2a35b28d },
+    { 0x6405fa00e2ec94d4, 0xdec681f9f4c31f31 },
+    { 0xde83bc408dd3dd04, 0x8b3c113c38f9f37e },
+    { 0x9624ab50b148d445, 0xae0b158b4738705e },
+    { 0x3badd624dd9b0957, 0xd98ddaee19068c76 },
+    { 0xe54ca5d70a80e5d6, 0x87f8a8d4cfa417c9 },
+    { 0x5e9fcf4ccd211f4c, 0xa9f6d30a038d1dbc },
+    { 0x7647c3200069671f, 0xd47487cc8470652b },
+    { 0x29ecd9f40041e073, 0x84c8d4dfd2c63f3b },
+    { 0xf468107100525890, 0xa5fb0a17c777cf09 },
+    { 0x7182148d4066eeb4, 0xcf79cc9db955c2cc },
+    { 0xc6f14cd848405530, 0x81ac1fe293d599bf },
+    { 0xb8ada00e5a506a7c, 0xa21727db38cb002f },
+    { 0xa6d90811f0e4851c, 0xca9cf1d206fdc03b },
+    { 0x908f4a166d1da663, 0xfd442e4688bd304a },
+    { 0x9a598e4e043287fe, 0x9e4a9cec15763e2e },
+    { 0x40eff1e1853f29fd, 0xc5dd44271ad3cdba },
+    { 0xd12bee59e68ef47c, 0xf7549530e188c128 },
+    { 0x82bb74f8301958ce, 0x9a94dd3e8cf578b9 },
+    { 0xe36a52363c1faf01, 0xc13a148e3032d6e7 },
+    { 0xdc44e6c3cb279ac1, 0xf18899b1bc3f8ca1 },
+    { 0x29ab103a5ef8c0b9, 0x96f5600f15a7b7e5 },
+    { 0x7415d448f6b6f0e7, 0xbcb2b812db11a5de },
+    { 0x111b495b3464ad21, 0xebdf661791d60f56 },
+    { 0xcab10dd900beec34, 0x936b9fcebb25c995 },
+    { 0x3d5d514f40eea742, 0xb84687c269ef3bfb },
+    { 0x0cb4a5a3112a5112, 0xe65829b3046b0afa },
+    { 0x47f0e785eaba72ab, 0x8ff71a0fe2c2e6dc },
+    { 0x59ed216765690f56, 0xb3f4e093db73a093 },
+    { 0x306869c13ec3532c, 0xe0f218b8d25088b8 },
+    { 0x1e414218c73a13fb, 0x8c974f7383725573 },
+    { 0xe5d1929ef90898fa, 0xafbd2350644eeacf },
+    { 0xdf45f746b74abf39, 0xdbac6c247d62a583 },
+    { 0x6b8bba8c328eb783, 0x894bc396ce5da772 },
+    { 0x066ea92f3f326564, 0xab9eb47c81f5114f },
+    { 0xc80a537b0efefebd, 0xd686619ba27255a2 },
+    { 0xbd06742ce95f5f36, 0x8613fd0145877585 },
+    { 0x2c48113823b73704, 0xa798fc4196e952e7 },
+    { 0xf75a15862ca504c5, 0xd17f3b51fca3a7a0 },
+    { 0x9a984d73dbe722fb, 0x82ef85133de648c4 },
+    { 0xc13e60d0d2e0ebba, 0xa3ab66580d5fdaf5 },
+    { 0x318df905079926a8, 0xcc963fee10b7d1b3 },
+    { 0xfdf17746497f7052, 0xffbbcfe994e5c61f },
+    { 0xfeb6ea8bedefa633, 0x9fd561f1fd0f9bd3 },
+    { 0xfe64a52ee96b8fc0, 0xc7caba6e7c5382c8 },
+    { 0x3dfdce7aa3c673b0, 0xf9bd690a1b68637b },
+    { 0x06bea10ca65c084e, 0x9c1661a651213e2d },
+    { 0x486e494fcff30a62, 0xc31bfa0fe5698db8 },
+    { 0x5a89dba3c3efccfa, 0xf3e2f893dec3f126 },
+    { 0xf89629465a75e01c, 0x986ddb5c6b3a76b7 },
+    { 0xf6bbb397f1135823, 0xbe89523386091465 },
+    { 0x746aa07ded582e2c, 0xee2ba6c0678b597f },
+    { 0xa8c2a44eb4571cdc, 0x94db483840b717ef },
+    { 0x92f34d62616ce413, 0xba121a4650e4ddeb },
+    { 0x77b020baf9c81d17, 0xe896a0d7e51e1566 },
+    { 0x0ace1474dc1d122e, 0x915e2486ef32cd60 },
+    { 0x0d819992132456ba, 0xb5b5ada8aaff80b8 },
+    { 0x10e1fff697ed6c69, 0xe3231912d5bf60e6 },
+    { 0xca8d3ffa1ef463c1, 0x8df5efabc5979c8f },
+    { 0xbd308ff8a6b17cb2, 0xb1736b96b6fd83b3 },
+    { 0xac7cb3f6d05ddbde, 0xddd0467c64bce4a0 },
+    { 0x6bcdf07a423aa96b, 0x8aa22c0dbef60ee4 },
+    { 0x86c16c98d2c953c6, 0xad4ab7112eb3929d },
+    { 0xe871c7bf077ba8b7, 0xd89d64d57a607744 },
+    { 0x11471cd764ad4972, 0x87625f056c7c4a8b },
+    { 0xd598e40d3dd89bcf, 0xa93af6c6c79b5d2d },
+    { 0x4aff1d108d4ec2c3, 0xd389b47879823479 },
+    { 0xcedf722a585139ba, 0x843610cb4bf160cb },
+    { 0xc2974eb4ee658828, 0xa54394fe1eedb8fe },
+    { 0x733d226229feea32, 0xce947a3da6a9273e },
+    { 0x0806357d5a3f525f, 0x811ccc668829b887 },
+    { 0xca07c2dcb0cf26f7, 0xa163ff802a3426a8 },
+    { 0xfc89b393dd02f0b5, 0xc9bcff6034c13052 },
+    { 0xbbac2078d443ace2, 0xfc2c3f3841f17c67 },
+    { 0xd54b944b84aa4c0d, 0x9d9ba7832936edc0 },
+    { 0x0a9e795e65d4df11, 0xc5029163f384a931 },
+    { 0x4d4617b5ff4a16d5, 0xf64335bcf065d37d },
+    { 0x504bced1bf8e4e45, 0x99ea0196163fa42e },
+    { 0xe45ec2862f71e1d6, 0xc06481fb9bcf8d39 },
+    { 0x5d767327bb4e5a4c, 0xf07da27a82c37088 },
+    { 0x3a6a07f8d510f86f, 0x964e858c91ba2655 },
+    { 0x890489f70a55368b, 0xbbe226efb628afea },
+    { 0x2b45ac74ccea842e, 0xeadab0aba3b2dbe5 },
+    { 0x3b0b8bc90012929d, 0x92c8ae6b464fc96f },
+    { 0x09ce6ebb40173744, 0xb77ada0617e3bbcb },
+    { 0xcc420a6a101d0515, 0xe55990879ddcaabd },
+    { 0x9fa946824a12232d, 0x8f57fa54c2a9eab6 },
+    { 0x47939822dc96abf9, 0xb32df8e9f3546564 },
+    { 0x59787e2b93bc56f7, 0xdff9772470297ebd },
+    { 0x57eb4edb3c55b65a, 0x8bfbea76c619ef36 },
+    { 0xede622920b6b23f1, 0xaefae51477a06b03 },
+    { 0xe95fab368e45eced, 0xdab99e59958885c4 },
+    { 0x11dbcb0218ebb414, 0x88b402f7fd75539b },
+    { 0xd652bdc29f26a119, 0xaae103b5fcd2a881 },
+    { 0x4be76d3346f0495f, 0xd59944a37c0752a2 },
+    { 0x6f70a4400c562ddb, 0x857fcae62d8493a5 },
+    { 0xcb4ccd500f6bb952, 0xa6dfbd9fb8e5b88e },
+    { 0x7e2000a41346a7a7, 0xd097ad07a71f26b2 },
+    { 0x8ed400668c0c28c8, 0x825ecc24c873782f },
+    { 0x728900802f0f32fa, 0xa2f67f2dfa90563b },
+    { 0x4f2b40a03ad2ffb9, 0xcbb41ef979346bca },
+    { 0xe2f610c84987bfa8, 0xfea126b7d78186bc },
+    { 0x0dd9ca7d2df4d7c9, 0x9f24b832e6b0f436 },
+    { 0x91503d1c79720dbb, 0xc6ede63fa05d3143 },
+    { 0x75a44c6397ce912a, 0xf8a95fcf88747d94 },
+    { 0xc986afbe3ee11aba, 0x9b69dbe1b548ce7c },
+    { 0xfbe85badce996168, 0xc24452da229b021b },
+    { 0xfae27299423fb9c3, 0xf2d56790ab41c2a2 },
+    { 0xdccd879fc967d41a, 0x97c560ba6b0919a5 },
+    { 0x5400e987bbc1c920, 0xbdb6b8e905cb600f },
+    { 0x290123e9aab23b68, 0xed246723473e3813 },
+    { 0xf9a0b6720aaf6521, 0x9436c0760c86e30b },
+    { 0xf808e40e8d5b3e69, 0xb94470938fa89bce },
+    { 0xb60b1d1230b20e04, 0xe7958cb87392c2c2 },
+    { 0xb1c6f22b5e6f48c2, 0x90bd77f3483bb9b9 },
+    { 0x1e38aeb6360b1af3, 0xb4ecd5f01a4aa828 },
+    { 0x25c6da63c38de1b0, 0xe2280b6c20dd5232 },
+    { 0x579c487e5a38ad0e, 0x8d590723948a535f },
+    { 0x2d835a9df0c6d851, 0xb0af48ec79ace837 },
+    { 0xf8e431456cf88e65, 0xdcdb1b2798182244 },
+    { 0x1b8e9ecb641b58ff, 0x8a08f0f8bf0f156b },
+    { 0xe272467e3d222f3f, 0xac8b2d36eed2dac5 },
+    { 0x5b0ed81dcc6abb0f, 0xd7adf884aa879177 },
+    { 0x98e947129fc2b4e9, 0x86ccbb52ea94baea },
+    { 0x3f2398d747b36224, 0xa87fea27a539e9a5 },
+    { 0x8eec7f0d19a03aad, 0xd29fe4b18e88640e },
+    { 0x1953cf68300424ac, 0x83a3eeeef9153e89 },
+    { 0x5fa8c3423c052dd7, 0xa48ceaaab75a8e2b },
+    { 0x3792f412cb06794d, 0xcdb02555653131b6 },
+    { 0xe2bbd88bbee40bd0, 0x808e17555f3ebf11 },
+    { 0x5b6aceaeae9d0ec4, 0xa0b19d2ab70e6ed6 },
+    { 0xf245825a5a445275, 0xc8de047564d20a8b },
+    { 0xeed6e2f0f0d56712, 0xfb158592be068d2e },
+    { 0x55464dd69685606b, 0x9ced737bb6c4183d },
+    { 0xaa97e14c3c26b886, 0xc428d05aa4751e4c },
+    { 0xd53dd99f4b3066a8, 0xf53304714d9265df },
+    { 0xe546a8038efe4029, 0x993fe2c6d07b7fab },
+    { 0xde98520472bdd033, 0xbf8fdb78849a5f96 },
+    { 0x963e66858f6d4440, 0xef73d256a5c0f77c },
+    { 0xdde7001379a44aa8, 0x95a8637627989aad },
+    { 0x5560c018580d5d52, 0xbb127c53b17ec159 },
+    { 0xaab8f01e6e10b4a6, 0xe9d71b689dde71af },
+    { 0xcab3961304ca70e8, 0x9226712162ab070d },
+    { 0x3d607b97c5fd0d22, 0xb6b00d69bb55c8d1 },
+    { 0x8cb89a7db77c506a, 0xe45c10c42a2b3b05 },
+    { 0x77f3608e92adb242, 0x8eb98a7a9a5b04e3 },
+    { 0x55f038b237591ed3, 0xb267ed1940f1c61c },
+    { 0x6b6c46dec52f6688, 0xdf01e85f912e37a3 },
+    { 0x2323ac4b3b3da015, 0x8b61313bbabce2c6 },
+    { 0xabec975e0a0d081a, 0xae397d8aa96c1b77 },
+    { 0x96e7bd358c904a21, 0xd9c7dced53c72255 },
+    { 0x7e50d64177da2e54, 0x881cea14545c7575 },
+    { 0xdde50bd1d5d0b9e9, 0xaa242499697392d2 },
+    { 0x955e4ec64b44e864, 0xd4ad2dbfc3d07787 },
+    { 0xbd5af13bef0b113e, 0x84ec3c97da624ab4 },
+    { 0xecb1ad8aeacdd58e, 0xa6274bbdd0fadd61 },
+    { 0x67de18eda5814af2, 0xcfb11ead453994ba },
+    { 0x80eacf948770ced7, 0x81ceb32c4b43fcf4 },
+    { 0xa1258379a94d028d, 0xa2425ff75e14fc31 },
+    { 0x096ee45813a04330, 0xcad2f7f5359a3b3e },
+    { 0x8bca9d6e188853fc, 0xfd87b5f28300ca0d },
+    { 0x775ea264cf55347d, 0x9e74d1b791e07e48 },
+    { 0x95364afe032a819d, 0xc612062576589dda },
+    { 0x3a83ddbd83f52204, 0xf79687aed3eec551 },
+    { 0xc4926a9672793542, 0x9abe14cd44753b52 },
+    { 0x75b7053c0f178293, 0xc16d9a0095928a27 },
+    { 0x5324c68b12dd6338, 0xf1c90080baf72cb1 },
+    { 0xd3f6fc16ebca5e03, 0x971da05074da7bee },
+    { 0x88f4bb1ca6bcf584, 0xbce5086492111aea },
+    { 0x2b31e9e3d06c32e5, 0xec1e4a7db69561a5 },
+    { 0x3aff322e62439fcf, 0x9392ee8e921d5d07 },
+    { 0x09befeb9fad487c2, 0xb877aa3236a4b449 },
+    { 0x4c2ebe687989a9b3, 0xe69594bec44de15b },
+    { 0x0f9d37014bf60a10, 0x901d7cf73ab0acd9 },
+    { 0x538484c19ef38c94, 0xb424dc35095cd80f },
+    { 0x2865a5f206b06fb9, 0xe12e13424bb40e13 },
+    { 0xf93f87b7442e45d3, 0x8cbccc096f5088cb },
+    { 0xf78f69a51539d748, 0xafebff0bcb24aafe },
+    { 0xb573440e5a884d1b, 0xdbe6fecebdedd5be },
+    { 0x31680a88f8953030, 0x89705f4136b4a597 },
+    { 0xfdc20d2b36ba7c3d, 0xabcc77118461cefc },
+    { 0x3d32907604691b4c, 0xd6bf94d5e57a42bc },
+    { 0xa63f9a49c2c1b10f, 0x8637bd05af6c69b5 },
+    { 0x0fcf80dc33721d53, 0xa7c5ac471b478423 },
+    { 0xd3c36113404ea4a8, 0xd1b71758e219652b },
+    { 0x645a1cac083126e9, 0x83126e978d4fdf3b },
+    { 0x3d70a3d70a3d70a3, 0xa3d70a3d70a3d70a },
+    { 0xcccccccccccccccc, 0xcccccccccccccccc },
+    { 0x0000000000000000, 0x8000000000000000 },
+    { 0x0000000000000000, 0xa000000000000000 },
+    { 0x0000000000000000, 0xc800000000000000 },
+    { 0x0000000000000000, 0xfa00000000000000 },
+    { 0x0000000000000000, 0x9c40000000000000 },
+    { 0x0000000000000000, 0xc350000000000000 },
+    { 0x0000000000000000, 0xf424000000000000 },
+    { 0x0000000000000000, 0x9896800000000000 },
+    { 0x0000000000000000, 0xbebc200000000000 },
+    { 0x0000000000000000, 0xee6b280000000000 },
+    { 0x0000000000000000, 0x9502f90000000000 },
+    { 0x0000000000000000, 0xba43b74000000000 },
+    { 0x0000000000000000, 0xe8d4a51000000000 },
+    { 0x0000000000000000, 0x9184e72a00000000 },
+    { 0x0000000000000000, 0xb5e620f480000000 },
+    { 0x0000000000000000, 0xe35fa931a0000000 },
+    { 0x0000000000000000, 0x8e1bc9bf04000000 },
+    { 0x0000000000000000, 0xb1a2bc2ec5000000 },
+    { 0x0000000000000000, 0xde0b6b3a76400000 },
+    { 0x0000000000000000, 0x8ac7230489e80000 },
+    { 0x0000000000000000, 0xad78ebc5ac620000 },
+    { 0x0000000000000000, 0xd8d726b7177a8000 },
+    { 0x0000000000000000, 0x878678326eac9000 },
+    { 0x0000000000000000, 0xa968163f0a57b400 },
+    { 0x0000000000000000, 0xd3c21bcecceda100 },
+    { 0x0000000000000000, 0x84595161401484a0 },
+    { 0x0000000000000000, 0xa56fa5b99019a5c8 },
+    { 0x0000000000000000, 0xcecb8f27f4200f3a },
+    { 0x4000000000000000, 0x813f3978f8940984 },
+    { 0x5000000000000000, 0xa18f07d736b90be5 },
+    { 0xa400000000000000, 0xc9f2c9cd04674ede },
+    { 0x4d00000000000000, 0xfc6f7c4045812296 },
+    { 0xf020000000000000, 0x9dc5ada82b70b59d },
+    { 0x6c28000000000000, 0xc5371912364ce305 },
+    { 0xc732000000000000, 0xf684df56c3e01bc6 },
+    { 0x3c7f400000000000, 0x9a130b963a6c115c },
+    { 0x4b9f100000000000, 0xc097ce7bc90715b3 },
+    { 0x1e86d40000000000, 0xf0bdc21abb48db20 },
+    { 0x1314448000000000, 0x96769950b50d88f4 },
+    { 0x17d955a000000000, 0xbc143fa4e250eb31 },
+    { 0x5dcfab0800000000, 0xeb194f8e1ae525fd },
+    { 0x5aa1cae500000000, 0x92efd1b8d0cf37be },
+    { 0xf14a3d9e40000000, 0xb7abc627050305ad },
+    { 0x6d9ccd05d0000000, 0xe596b7b0c643c719 },
+    { 0xe4820023a2000000, 0x8f7e32ce7bea5c6f },
+    { 0xdda2802c8a800000, 0xb35dbf821ae4f38b },
+    { 0xd50b2037ad200000, 0xe0352f62a19e306e },
+    { 0x4526f422cc340000, 0x8c213d9da502de45 },
+    { 0x9670b12b7f410000, 0xaf298d050e4395d6 },
+    { 0x3c0cdd765f114000, 0xdaf3f04651d47b4c },
+    { 0xa5880a69fb6ac800, 0x88d8762bf324cd0f },
+    { 0x8eea0d047a457a00, 0xab0e93b6efee0053 },
+    { 0x72a4904598d6d880, 0xd5d238a4abe98068 },
+    { 0x47a6da2b7f864750, 0x85a36366eb71f041 },
+    { 0x999090b65f67d924, 0xa70c3c40a64e6c51 },
+    { 0xfff4b4e3f741cf6d, 0xd0cf4b50cfe20765 },
+    { 0xbff8f10e7a8921a4, 0x82818f1281ed449f },
+    { 0xaff72d52192b6a0d, 0xa321f2d7226895c7 },
+    { 0x9bf4f8a69f764490, 0xcbea6f8ceb02bb39 },
+    { 0x02f236d04753d5b4, 0xfee50b7025c36a08 },
+    { 0x01d762422c946590, 0x9f4f2726179a2245 },
+    { 0x424d3ad2b7b97ef5, 0xc722f0ef9d80aad6 },
+    { 0xd2e0898765a7deb2, 0xf8ebad2b84e0d58b },
+    { 0x63cc55f49f88eb2f, 0x9b934c3b330c8577 },
+    { 0x3cbf6b71c76b25fb, 0xc2781f49ffcfa6d5 },
+    { 0x8bef464e3945ef7a, 0xf316271c7fc3908a },
+    { 0x97758bf0e3cbb5ac, 0x97edd871cfda3a56 },
+    { 0x3d52eeed1cbea317, 0xbde94e8e43d0c8ec },
+    { 0x4ca7aaa863ee4bdd, 0xed63a231d4c4fb27 },
+    { 0x8fe8caa93e74ef6a, 0x945e455f24fb1cf8 },
+    { 0xb3e2fd538e122b44, 0xb975d6b6ee39e436 },
+    { 0x60dbbca87196b616, 0xe7d34c64a9c85d44 },
+    { 0xbc8955e946fe31cd, 0x90e40fbeea1d3a4a },
+    { 0x6babab6398bdbe41, 0xb51d13aea4a488dd },
+    { 0xc696963c7eed2dd1, 0xe264589a4dcdab14 },
+    { 0xfc1e1de5cf543ca2, 0x8d7eb76070a08aec },
+    { 0x3b25a55f43294bcb, 0xb0de65388cc8ada8 },
+    { 0x49ef0eb713f39ebe, 0xdd15fe86affad912 },
+    { 0x6e3569326c784337, 0x8a2dbf142dfcc7ab },
+    { 0x49c2c37f07965404, 0xacb92ed9397bf996 },
+    { 0xdc33745ec97be906, 0xd7e77a8f87daf7fb },
+    { 0x69a028bb3ded71a3, 0x86f0ac99b4e8dafd },
+    { 0xc40832ea0d68ce0c, 0xa8acd7c0222311bc },
+    { 0xf50a3fa490c30190, 0xd2d80db02aabd62b },
+    { 0x792667c6da79e0fa, 0x83c7088e1aab65db },
+    { 0x577001b891185938, 0xa4b8cab1a1563f52 },
+    { 0xed4c0226b55e6f86, 0xcde6fd5e09abcf26 },
+    { 0x544f8158315b05b4, 0x80b05e5ac60b6178 },
+    { 0x696361ae3db1c721, 0xa0dc75f1778e39d6 },
+    { 0x03bc3a19cd1e38e9, 0xc913936dd571c84c },
+    { 0x04ab48a04065c723, 0xfb5878494ace3a5f },
+    { 0x62eb0d64283f9c76, 0x9d174b2dcec0e47b },
+    { 0x3ba5d0bd324f8394, 0xc45d1df942711d9a },
+    { 0xca8f44ec7ee36479, 0xf5746577930d6500 },
+    { 0x7e998b13cf4e1ecb, 0x9968bf6abbe85f20 },
+    { 0x9e3fedd8c321a67e, 0xbfc2ef456ae276e8 },
+    { 0xc5cfe94ef3ea101e, 0xefb3ab16c59b14a2 },
+    { 0xbba1f1d158724a12, 0x95d04aee3b80ece5 },
+    { 0x2a8a6e45ae8edc97, 0xbb445da9ca61281f },
+    { 0xf52d09d71a3293bd, 0xea1575143cf97226 },
+    { 0x593c2626705f9c56, 0x924d692ca61be758 },
+    { 0x6f8b2fb00c77836c, 0xb6e0c377cfa2e12e },
+    { 0x0b6dfb9c0f956447, 0xe498f455c38b997a },
+    { 0x4724bd4189bd5eac, 0x8edf98b59a373fec },
+    { 0x58edec91ec2cb657, 0xb2977ee300c50fe7 },
+    { 0x2f2967b66737e3ed, 0xdf3d5e9bc0f653e1 },
+    { 0xbd79e0d20082ee74, 0x8b865b215899f46c },
+    { 0xecd8590680a3aa11, 0xae67f1e9aec07187 },
+    { 0xe80e6f4820cc9495, 0xda01ee641a708de9 },
+    { 0x3109058d147fdcdd, 0x884134fe908658b2 },
+    { 0xbd4b46f0599fd415, 0xaa51823e34a7eede },
+    { 0x6c9e18ac7007c91a, 0xd4e5e2cdc1d1ea96 },
+    { 0x03e2cf6bc604ddb0, 0x850fadc09923329e },
+    { 0x84db8346b786151c, 0xa6539930bf6bff45 },
+    { 0xe612641865679a63, 0xcfe87f7cef46ff16 },
+    { 0x4fcb7e8f3f60c07e, 0x81f14fae158c5f6e },
+    { 0xe3be5e330f38f09d, 0xa26da3999aef7749 },
+    { 0x5cadf5bfd3072cc5, 0xcb090c8001ab551c },
+    { 0x73d9732fc7c8f7f6, 0xfdcb4fa002162a63 },
+    { 0x2867e7fddcdd9afa, 0x9e9f11c4014dda7e },
+    { 0xb281e1fd541501b8, 0xc646d63501a1511d },
+    { 0x1f225a7ca91a4226, 0xf7d88bc24209a565 },
+    { 0x3375788de9b06958, 0x9ae757596946075f },
+    { 0x0052d6b1641c83ae, 0xc1a12d2fc3978937 },
+    { 0xc0678c5dbd23a49a, 0xf209787bb47d6b84 },
+    { 0xf840b7ba963646e0, 0x9745eb4d50ce6332 },
+    { 0xb650e5a93bc3d898, 0xbd176620a501fbff },
+    { 0xa3e51f138ab4cebe, 0xec5d3fa8ce427aff },
+    { 0xc66f336c36b10137, 0x93ba47c980e98cdf },
+    { 0xb80b0047445d4184, 0xb8a8d9bbe123f017 },
+    { 0xa60dc059157491e5, 0xe6d3102ad96cec1d },
+    { 0x87c89837ad68db2f, 0x9043ea1ac7e41392 },
+    { 0x29babe4598c311fb, 0xb454e4a179dd1877 },
+    { 0xf4296dd6fef3d67a, 0xe16a1dc9d8545e94 },
+    { 0x1899e4a65f58660c, 0x8ce2529e2734bb1d },
+    { 0x5ec05dcff72e7f8f, 0xb01ae745b101e9e4 },
+    { 0x76707543f4fa1f73, 0xdc21a1171d42645d },
+    { 0x6a06494a791c53a8, 0x899504ae72497eba },
+    { 0x0487db9d17636892, 0xabfa45da0edbde69 },
+    { 0x45a9d2845d3c42b6, 0xd6f8d7509292d603 },
+    { 0x0b8a2392ba45a9b2, 0x865b86925b9bc5c2 },
+    { 0x8e6cac7768d7141e, 0xa7f26836f282b732 },
+    { 0x3207d795430cd926, 0xd1ef0244af2364ff },
+    { 0x7f44e6bd49e807b8, 0x8335616aed761f1f },
+    { 0x5f16206c9c6209a6, 0xa402b9c5a8d3a6e7 },
+    { 0x36dba887c37a8c0f, 0xcd036837130890a1 },
+    { 0xc2494954da2c9789, 0x802221226be55a64 },
+    { 0xf2db9baa10b7bd6c, 0xa02aa96b06deb0fd },
+    { 0x6f92829494e5acc7, 0xc83553c5c8965d3d },
+    { 0xcb772339ba1f17f9, 0xfa42a8b73abbf48c },
+    { 0xff2a760414536efb, 0x9c69a97284b578d7 },
+    { 0xfef5138519684aba, 0xc38413cf25e2d70d },
+    { 0x7eb258665fc25d69, 0xf46518c2ef5b8cd1 },
+    { 0xef2f773ffbd97a61, 0x98bf2f79d5993802 },
+    { 0xaafb550ffacfd8fa, 0xbeeefb584aff8603 },
+    { 0x95ba2a53f983cf38, 0xeeaaba2e5dbf6784 },
+    { 0xdd945a747bf26183, 0x952ab45cfa97a0b2 },
+    { 0x94f971119aeef9e4, 0xba756174393d88df },
+    { 0x7a37cd5601aab85d, 0xe912b9d1478ceb17 },
+    { 0xac62e055c10ab33a, 0x91abb422ccb812ee },
+    { 0x577b986b314d6009, 0xb616a12b7fe617aa },
+    { 0xed5a7e85fda0b80b, 0xe39c49765fdf9d94 },
+    { 0x14588f13be847307, 0x8e41ade9fbebc27d },
+    { 0x596eb2d8ae258fc8, 0xb1d219647ae6b31c },
+    { 0x6fca5f8ed9aef3bb, 0xde469fbd99a05fe3 },
+    { 0x25de7bb9480d5854, 0x8aec23d680043bee },
+    { 0xaf561aa79a10ae6a, 0xada72ccc20054ae9 },
+    { 0x1b2ba1518094da04, 0xd910f7ff28069da4 },
+    { 0x90fb44d2f05d0842, 0x87aa9aff79042286 },
+    { 0x353a1607ac744a53, 0xa99541bf57452b28 },
+    { 0x42889b8997915ce8, 0xd3fa922f2d1675f2 },
+    { 0x69956135febada11, 0x847c9b5d7c2e09b7 },
+    { 0x43fab9837e699095, 0xa59bc234db398c25 },
+    { 0x94f967e45e03f4bb, 0xcf02b2c21207ef2e },
+    { 0x1d1be0eebac278f5, 0x8161afb94b44f57d },
+    { 0x6462d92a69731732, 0xa1ba1ba79e1632dc },
+    { 0x7d7b8f7503cfdcfe, 0xca28a291859bbf93 },
+    { 0x5cda735244c3d43e, 0xfcb2cb35e702af78 },
+    { 0x3a0888136afa64a7, 0x9defbf01b061adab },
+    { 0x088aaa1845b8fdd0, 0xc56baec21c7a1916 },
+    { 0x8aad549e57273d45, 0xf6c69a72a3989f5b },
+    { 0x36ac54e2f678864b, 0x9a3c2087a63f6399 },
+    { 0x84576a1bb416a7dd, 0xc0cb28a98fcf3c7f },
+    { 0x656d44a2a11c51d5, 0xf0fdf2d3f3c30b9f },
+    { 0x9f644ae5a4b1b325, 0x969eb7c47859e743 },
+    { 0x873d5d9f0dde1fee, 0xbc4665b596706114 },
+    { 0xa90cb506d155a7ea, 0xeb57ff22fc0c7959 },
+    { 0x09a7f12442d588f2, 0x9316ff75dd87cbd8 },
+    { 0x0c11ed6d538aeb2f, 0xb7dcbf5354e9bece },
+    { 0x8f1668c8a86da5fa, 0xe5d3ef282a242e81 },
+    { 0xf96e017d694487bc, 0x8fa475791a569d10 },
+    { 0x37c981dcc395a9ac, 0xb38d92d760ec4455 },
+    { 0x85bbe253f47b1417, 0xe070f78d3927556a },
+    { 0x93956d7478ccec8e, 0x8c469ab843b89562 },
+    { 0x387ac8d1970027b2, 0xaf58416654a6babb },
+    { 0x06997b05fcc0319e, 0xdb2e51bfe9d0696a },
+    { 0x441fece3bdf81f03, 0x88fcf317f22241e2 },
+    { 0xd527e81cad7626c3, 0xab3c2fddeeaad25a },
+    { 0x8a71e223d8d3b074, 0xd60b3bd56a5586f1 },
+    { 0xf6872d5667844e49, 0x85c7056562757456 },
+    { 0xb428f8ac016561db, 0xa738c6bebb12d16c },
+    { 0xe13336d701beba52, 0xd106f86e69d785c7 },
+    { 0xecc0024661173473, 0x82a45b450226b39c },
+    { 0x27f002d7f95d0190, 0xa34d721642b06084 },
+    { 0x31ec038df7b441f4, 0xcc20ce9bd35c78a5 },
+    { 0x7e67047175a15271, 0xff290242c83396ce },
+    { 0x0f0062c6e984d386, 0x9f79a169bd203e41 },
+    { 0x52c07b78a3e60868, 0xc75809c42c684dd1 },
+    { 0xa7709a56ccdf8a82, 0xf92e0c3537826145 },
+    { 0x88a66076400bb691, 0x9bbcc7a142b17ccb },
+    { 0x6acff893d00ea435, 0xc2abf989935ddbfe },
+    { 0x0583f6b8c4124d43, 0xf356f7ebf83552fe },
+    { 0xc3727a337a8b704a, 0x98165af37b2153de },
+    { 0x744f18c0592e4c5c, 0xbe1bf1b059e9a8d6 },
+    { 0x1162def06f79df73, 0xeda2ee1c7064130c },
+    { 0x8addcb5645ac2ba8, 0x9485d4d1c63e8be7 },
+    { 0x6d953e2bd7173692, 0xb9a74a0637ce2ee1 },
+    { 0xc8fa8db6ccdd0437, 0xe8111c87c5c1ba99 },
+    { 0x1d9c9892400a22a2, 0x910ab1d4db9914a0 },
+    { 0x2503beb6d00cab4b, 0xb54d5e4a127f59c8 },
+    { 0x2e44ae64840fd61d, 0xe2a0b5dc971f303a },
+    { 0x5ceaecfed289e5d2, 0x8da471a9de737e24 },
+    { 0x7425a83e872c5f47, 0xb10d8e1456105dad },
+    { 0xd12f124e28f77719, 0xdd50f1996b947518 },
+    { 0x82bd6b70d99aaa6f, 0x8a5296ffe33cc92f },
+    { 0x636cc64d1001550b, 0xace73cbfdc0bfb7b },
+    { 0x3c47f7e05401aa4e, 0xd8210befd30efa5a },
+    { 0x65acfaec34810a71, 0x8714a775e3e95c78 },
+    { 0x7f1839a741a14d0d, 0xa8d9d1535ce3b396 },
+    { 0x1ede48111209a050, 0xd31045a8341ca07c },
+    { 0x934aed0aab460432, 0x83ea2b892091e44d },
+    { 0xf81da84d5617853f, 0xa4e4b66b68b65d60 },
+    { 0x36251260ab9d668e, 0xce1de40642e3f4b9 },
+    { 0xc1d72b7c6b426019, 0x80d2ae83e9ce78f3 },
+    { 0xb24cf65b8612f81f, 0xa1075a24e4421730 },
+    { 0xdee033f26797b627, 0xc94930ae1d529cfc },
+    { 0x169840ef017da3b1, 0xfb9b7cd9a4a7443c },
+    { 0x8e1f289560ee864e, 0x9d412e0806e88aa5 },
+    { 0xf1a6f2bab92a27e2, 0xc491798a08a2ad4e },
+    { 0xae10af696774b1db, 0xf5b5d7ec8acb58a2 },
+    { 0xacca6da1e0a8ef29, 0x9991a6f3d6bf1765 },
+    { 0x17fd090a58d32af3, 0xbff610b0cc6edd3f },
+    { 0xddfc4b4cef07f5b0, 0xeff394dcff8a948e },
+    { 0x4abdaf101564f98e, 0x95f83d0a1fb69cd9 },
+    { 0x9d6d1ad41abe37f1, 0xbb764c4ca7a4440f },
+    { 0x84c86189216dc5ed, 0xea53df5fd18d5513 },
+    { 0x32fd3cf5b4e49bb4, 0x92746b9be2f8552c },
+    { 0x3fbc8c33221dc2a1, 0xb7118682dbb66a77 },
+    { 0x0fabaf3feaa5334a, 0xe4d5e82392a40515 },
+    { 0x29cb4d87f2a7400e, 0x8f05b1163ba6832d },
+    { 0x743e20e9ef511012, 0xb2c71d5bca9023f8 },
+    { 0x914da9246b255416, 0xdf78e4b2bd342cf6 },
+    { 0x1ad089b6c2f7548e, 0x8bab8eefb6409c1a },
+    { 0xa184ac2473b529b1, 0xae9672aba3d0c320 },
+    { 0xc9e5d72d90a2741e, 0xda3c0f568cc4f3e8 },
+    { 0x7e2fa67c7a658892, 0x8865899617fb1871 },
+    { 0xddbb901b98feeab7, 0xaa7eebfb9df9de8d },
+    { 0x552a74227f3ea565, 0xd51ea6fa85785631 },
+    { 0xd53a88958f87275f, 0x8533285c936b35de },
+    { 0x8a892abaf368f137, 0xa67ff273b8460356 },
+    { 0x2d2b7569b0432d85, 0xd01fef10a657842c },
+    { 0x9c3b29620e29fc73, 0x8213f56a67f6b29b },
+    { 0x8349f3ba91b47b8f, 0xa298f2c501f45f42 },
+    { 0x241c70a936219a73, 0xcb3f2f7642717713 },
+    { 0xed238cd383aa0110, 0xfe0efb53d30dd4d7 },
+    { 0xf4363804324a40aa, 0x9ec95d1463e8a506 },
+    { 0xb143c6053edcd0d5, 0xc67bb4597ce2ce48 },
+    { 0xdd94b7868e94050a, 0xf81aa16fdc1b81da },
+    { 0xca7cf2b4191c8326, 0x9b10a4e5e9913128 },
+    { 0xfd1c2f611f63a3f0, 0xc1d4ce1f63f57d72 },
+    { 0xbc633b39673c8cec, 0xf24a01a73cf2dccf },
+    { 0xd5be0503e085d813, 0x976e41088617ca01 },
+    { 0x4b2d8644d8a74e18, 0xbd49d14aa79dbc82 },
+    { 0xddf8e7d60ed1219e, 0xec9c459d51852ba2 },
+    { 0xcabb90e5c942b503, 0x93e1ab8252f33b45 },
+    { 0x3d6a751f3b936243, 0xb8da1662e7b00a17 },
+    { 0x0cc512670a783ad4, 0xe7109bfba19c0c9d },
+    { 0x27fb2b80668b24c5, 0x906a617d450187e2 },
+    { 0xb1f9f660802dedf6, 0xb484f9dc9641e9da },
+    { 0x5e7873f8a0396973, 0xe1a63853bbd26451 },
+    { 0xdb0b487b6423e1e8, 0x8d07e33455637eb2 },
+    { 0x91ce1a9a3d2cda62, 0xb049dc016abc5e5f },
+    { 0x7641a140cc7810fb, 0xdc5c5301c56b75f7 },
+    { 0xa9e904c87fcb0a9d, 0x89b9b3e11b6329ba },
+    { 0x546345fa9fbdcd44, 0xac2820d9623bf429 },
+    { 0xa97c177947ad4095, 0xd732290fbacaf133 },
+    { 0x49ed8eabcccc485d, 0x867f59a9d4bed6c0 },
+    { 0x5c68f256bfff5a74, 0xa81f301449ee8c70 },
+    { 0x73832eec6fff3111, 0xd226fc195c6a2f8c },
+    { 0xc831fd53c5ff7eab, 0x83585d8fd9c25db7 },
+    { 0xba3e7ca8b77f5e55, 0xa42e74f3d032f525 },
+    { 0x28ce1bd2e55f35eb, 0xcd3a1230c43fb26f },
+    { 0x7980d163cf5b81b3, 0x80444b5e7aa7cf85 },
+    { 0xd7e105bcc332621f, 0xa0555e361951c366 },
+    { 0x8dd9472bf3fefaa7, 0xc86ab5c39fa63440 },
+    { 0xb14f98f6f0feb951, 0xfa856334878fc150 },
+    { 0x6ed1bf9a569f33d3, 0x9c935e00d4b9d8d2 },
+    { 0x0a862f80ec4700c8, 0xc3b8358109e84f07 },
+    { 0xcd27bb612758c0fa, 0xf4a642e14c6262c8 },
+    { 0x8038d51cb897789c, 0x98e7e9cccfbd7dbd },
+    { 0xe0470a63e6bd56c3, 0xbf21e44003acdd2c },
+    { 0x1858ccfce06cac74, 0xeeea5d5004981478 },
+    { 0x0f37801e0c43ebc8, 0x95527a5202df0ccb },
+    { 0xd30560258f54e6ba, 0xbaa718e68396cffd },
+    { 0x47c6b82ef32a2069, 0xe950df20247c83fd },
+    { 0x4cdc331d57fa5441, 0x91d28b7416cdd27e },
+    { 0xe0133fe4adf8e952, 0xb6472e511c81471d },
+    { 0x58180fddd97723a6, 0xe3d8f9e563a198e5 },
+    { 0x570f09eaa7ea7648, 0x8e679c2f5e44ff8f },
+};
+
+//powers of ten that are exact doubles
+static const double exactPow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/**
+ * Sets res to w * 10^q, rounded to nearest even, returning
+ * false if the result cannot be found with certainty.
+ */
+static bool eiselLemire(uint64_t w, int q, bool negative, double* res) {
+
+    uint64_t bits;
+    if(w == 0 || q < MIN_POW10) {
+        bits = 0;
+    } else if(q > MAX_POW10) {
+        bits = (uint64_t)0x7ff << SIGNIFICAND_BITS;
+    } else {
+        int lz = __builtin_clzll(w);
+        w <<= lz;
+        //floor(log2(10) * q), biased
+        uint64_t exp = (uint64_t)(((217706 * q) >> 16) + 64 + 0x3ff - lz);
+        const uint64_t* pow = pow10Wide[q - MIN_POW10];
+        unsigned __int128 x = (unsigned __int128)w * pow[1];
+        uint64_t hi = x >> 64;
+        uint64_t lo = (uint64_t)x;
+        //the low bits of the power could carry into the result
+        if((hi & 0x1ff) == 0x1ff && lo + w < lo) {
+            unsigned __int128 y = (unsigned __int128)w * pow[0];
+            uint64_t yhi = y >> 64;
+            uint64_t ylo = (uint64_t)y;
+            uint64_t mergedHi = hi;
+            uint64_t mergedLo = lo + yhi;
+            if(mergedLo < lo)
+                mergedHi++;
+            if((mergedHi & 0x1ff) == 0x1ff && mergedLo + 1 == 0 && ylo + w < ylo)
+                return false;
+            hi = mergedHi;
+            lo = mergedLo;
+        }
+        //keep 54 bits, one more than the significand
+        uint64_t msb = hi >> 63;
+        uint64_t mantissa = hi >> (msb + 9);
+        exp -= 1 ^ msb;
+        //possibly exactly halfway between two doubles
+        if(lo == 0 && (hi & 0x1ff) == 0 && (mantissa & 3) == 1)
+            return false;
+        mantissa += mantissa & 1;
+        mantissa >>= 1;
+        if(mantissa >> (SIGNIFICAND_BITS + 1)) {
+            mantissa >>= 1;
+            exp++;
+        }
+        //subnormal, infinite, or out of range
+        if(exp - 1 >= 0x7ff - 1)
+            return false;
+        bits = exp << SIGNIFICAND_BITS | (mantissa & SIGNIFICAND_MASK);
+    }
+    if(negative)
+        bits |= (uint64_t)1 << 63;
+    memcpy(res, &bits, sizeof(bits));
+    return true;
+}
+
+/**
+ * Parses text of the form [+-]digits[.digits][(e|E)[+-]digits] with at
+ * most MAX_DIGITS significant digits, returning false for any other text.
+ */
+static bool parseDecimal(char* str, char* end, double* res) {
+
+    bool negative = false;
+    if(str < end && (*str == '+' || *str == '-')) {
+        negative = *str == '-';
+        str++;
+    }
+    uint64_t w = 0;
+    int digits = 0;     //significant digits in w
+    int q = 0;          //the value is w * 10^q
+    bool any = false;
+    while(str < end && *str == '0') {
+        str++;
+        any = true;
+    }
+    for(; str < end && *str >= '0' && *str <= '9'; str++, any = true) {
+        w = w * 10 + (*str - '0');
+        digits++;
+    }
+    if(str < end && *str == '.') {
+        str++;
+        if(w == 0) {
+            for(; str < end && *str == '0'; str++, any = true)
+                q--;
+        }
+        for(; str < end && *str >= '0' && *str <= '9'; str++, any = true) {
+            w = w * 10 + (*str - '0');
+            digits++;
+            q--;
+        }
+    }
+    if(!any || digits > MAX_DIGITS)
+        return false;
+    if(str < end && (*str == 'e' || *str == 'E')) {
+        str++;
+        bool negExp = false;
+        if(str < end && (*str == '+' || *str == '-')) {
+            negExp = *str == '-';
+            str++;
+        }
+        if(str == end || *str < '0' || *str > '9')
+            return false;
+        int exp = 0;
+        for(; str < end && *str >= '0' && *str <= '9'; str++) {
+            //large enough to be zero or infinite either way
+            if(exp < 100000)
+                exp = exp * 10 + (*str - '0');
+        }
+        q += negExp ? -exp : exp;
+    }
+    if(str != end)
+        return false;
+    //Clinger's fast path
+    if(w <= (uint64_t)1 << (SIGNIFICAND_BITS + 1) && q >= -22 && q <= 22) {
+        double d = (double)w;
+        d = q < 0 ? d / exactPow10[-q] : d * exactPow10[q];
+        *res = negative ? -d : d;
+        return true;
+    }
+    return eiselLemire(w, q, negative, res);
+}
+
+bool lv_num_parseNumber(char* str, size_t len, double* res) {
+
+    if(parseDecimal(str, str + len, res))
+        return true;
+    char* rest;
+    *res = strtod(str, &rest);
+    return rest == str + len;
+}
+
+bool lv_num_parseInteger(char* str, size_t len, uint64_t* res) {
+
+    char* p = str;
+    char* end = str + len;
+    bool negative = false;
+    if(p < end && (*p == '+' || *p == '-')) {
+        negative = *p == '-';
+        p++;
+    }
+    //up to MAX_DIGITS digits cannot overflow
+    if(p < end && end - p <= MAX_DIGITS) {
+        uint64_t value = 0;
+        for(; p < end && *p >= '0' && *p <= '9'; p++)
+            value = value * 10 + (*p - '0');
+        if(p == end) {
+            //unsigned negation is the same as two's complement negation
+            *res = negative ? -value : value;
+            return true;
+        }
+    }
+    char* rest;
+    *res = (uint64_t)strtoumax(str, &rest, 10);
+    return rest == end;
+}
@@ -0,0 +1,44 @@
+#ifndef NUMBER_H
+#define NUMBER_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Conversion between text and Lavender numbers and integers.
+ */
+
+//longest text written by the format functions, with the terminator
+#define LV_NUM_FORMAT_LEN 32
+
+/**
+ * Writes the shortest text that reads back as the same number, or
+ * formats it as printf's %g does with -formatG. Notation switches
+ * between fixed and exponent as with %g, counting all the digits
+ * as the precision, so numbers of up to 6 digits are written as
+ * with %g. Returns the length of the text, which is terminated.
+ */
+size_t lv_num_formatNumber(double value, char* out);
+
+/**
+ * Writes the integer in decimal, returning the length
+ * of the text, which is terminated.
+ */
+size_t lv_num_formatInteger(uint64_t value, char* out);
+
+/**
+ * Parses the text of the given length, which must be followed by a
+ * terminator, as strtod does. Returns false if strtod would not read
+ * all of the text. Decimal text is parsed without strtod.
+ */
+bool lv_num_parseNumber(char* str, size_t len, double* res);
+
+/**
+ * Parses the text of the given length, which must be followed by a
+ * terminator, as strtoumax does in base 10. Returns false if strtoumax
+ * would not read all of the text. Short decimal text is parsed
+ * without strtoumax.
+ */
+bool lv_num_parseInteger(char* str, size_t len, uint64_t* res);
+
+#endif
@@ -1,5 +1,6 @@
 #include "operator.h"
 #include "lavender.h"
+#include "regvm.h"
 #include <string.h>
 #include <assert.h>
 
@@ -80,6 +81,8 @@ Operator* lv_op_getScopedOperator(char* scope, char* name, FuncNamespace ns) {
 bool lv_op_addOperator(Operator* op, FuncNamespace ns) {
 
     assert(op);
+    op->regCode = NULL;
+    op->lazy = NULL;
     if(op->name[strlen(op->name) - 1] == ':') {
         //anonymous function
         op->next = anonFuncs;
@@ -136,8 +139,13 @@ static void resizeTable(OpHashtable* table) {
     for(int i = 0; i < oldCap; i++) {
         Operator* node = oldTable[i];
         while(node) {
+            //relink directly, adding the operator again
+            //would reset its state
             Operator* tmp = node->next;
-            lv_op_addOperator(node, table - funcNamespaces);
+            size_t idx = hash(node->name) & (table->cap - 1);
+            node->next = table->table[idx];
+            table->table[idx] = node;
+            table->size++;
             node = tmp;
         }
     }
@@ -156,6 +164,8 @@ static void freeOp(Operator* op) {
         }
         lv_free(params);
     }
+    lv_reg_free(op->regCode);
+    lv_tb_freeLazyBody(op->lazy);
     lv_free(op);
 }
 
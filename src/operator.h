@@ -32,6 +32,8 @@ struct Operator {
     };
     Operator* next;
     bool varargs;
+    LvRegCode* regCode;     //NULL until first run with -regvm
+    LvLazyBody* lazy;       //body compiled on first use, see lv_tb_deferFunctionBody
 };
 
 /**
@@ -23,6 +23,8 @@ typedef enum FuncNamespace {
 
 typedef struct Param Param;
 typedef struct Operator Operator;
+typedef struct LvRegCode LvRegCode;
+typedef struct LvLazyBody LvLazyBody;
 
 /**
  * Retrieves the operator with the given name.
@@ -0,0 +1,209 @@
+#include "prefetch.h"
+#include "lavender.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+//most worker threads started
+#define MAX_WORKERS 8
+
+typedef enum JobState {
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_TAKEN       //read by the main thread
+} JobState;
+
+typedef struct Job {
+    char* name;
+    JobState state;
+    LvSplitFile* file;  //NULL if the file could not be opened
+} Job;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;   //a job was queued
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER; //a job is done
+static DynBuffer jobs;      //of Job*, in the order they were queued
+static size_t nextJob;      //no job before this one is queued
+static pthread_t workers[MAX_WORKERS];
+static size_t numWorkers;
+static bool started;
+static bool stopping;
+
+static FILE* openModule(char* name) {
+
+    static char ext[] = ".lv";  //lv_filepath/name.lv
+    char* file = lv_alloc(strlen(lv_filepath) + 1 + strlen(name) + sizeof(ext));
+    strcpy(file, lv_filepath);
+    strcat(file, "/");  // '/' works on all major OS (Windows, Mac, Linux)
+    strcat(file, name);
+    strcat(file, ext);
+    //try the current directory first, then the Lavender filepath
+    FILE* res = fopen(file + strlen(lv_filepath) + 1, "r");
+    if(!res)
+        res = fopen(file, "r");
+    lv_free(file);
+    return res;
+}
+
+static LvSplitFile* split(char* name) {
+
+    FILE* in = openModule(name);
+    if(!in)
+        return NULL;
+    LvSplitFile* file = lv_alloc(sizeof(LvSplitFile));
+    lv_buf_init(&file->stmts, sizeof(Token*));
+    lv_buf_init(&file->lines, sizeof(size_t));
+    file->error = 0;
+    lv_tkn_lines = 0;
+    while(!feof(in)) {
+        //statements start on the first line they read
+        size_t line = lv_tkn_lines + 1;
+        Token* head = lv_tkn_split(in);
+        if(LV_TKN_ERROR) {
+            file->error = LV_TKN_ERROR;
+            memcpy(file->errcxt, lv_tkn_errcxt, TKN_ERRCXT_LEN);
+            LV_TKN_ERROR = 0;
+            break;
+        }
+        if(head) {
+            lv_buf_push(&file->stmts, &head);
+            lv_buf_push(&file->lines, &line);
+        }
+    }
+    fclose(in);
+    return file;
+}
+
+static Job* findJob(char* name) {
+
+    for(size_t i = 0; i < jobs.len; i++) {
+        Job* job = *(Job**)lv_buf_get(&jobs, i);
+        if(strcmp(job->name, name) == 0)
+            return job;
+    }
+    return NULL;
+}
+
+static Job* nextQueued(void) {
+
+    while(nextJob < jobs.len) {
+        Job* job = *(Job**)lv_buf_get(&jobs, nextJob);
+        if(job->state == JOB_QUEUED)
+            return job;
+        nextJob++;
+    }
+    return NULL;
+}
+
+static void* work(void* arg) {
+
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    for(;;) {
+        Job* job = NULL;
+        while(!stopping && !(job = nextQueued()))
+            pthread_cond_wait(&queued, &lock);
+        if(stopping)
+            break;
+        job->state = JOB_RUNNING;
+        pthread_mutex_unlock(&lock);
+        LvSplitFile* file = split(job->name);
+        pthread_mutex_lock(&lock);
+        job->file = file;
+        job->state = JOB_DONE;
+        pthread_cond_broadcast(&finished);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+static void startWorkers(void) {
+
+    started = true;
+    lv_buf_init(&jobs, sizeof(Job*));
+    //the main thread splits the files it reaches first,
+    //so it takes one of the cores
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t count = cores <= 1 ? 0 : cores > MAX_WORKERS ? MAX_WORKERS : (size_t)cores - 1;
+    for(size_t i = 0; i < count; i++) {
+        if(pthread_create(&workers[numWorkers], NULL, work, NULL) != 0)
+            break;
+        numWorkers++;
+    }
+}
+
+void lv_pf_prefetch(char* name) {
+
+    pthread_mutex_lock(&lock);
+    if(!started)
+        startWorkers();
+    //without workers, files are split when read
+    if(numWorkers > 0 && !findJob(name)) {
+        Job* job = lv_alloc(sizeof(Job));
+        job->name = lv_alloc(strlen(name) + 1);
+        strcpy(job->name, name);
+        job->state = JOB_QUEUED;
+        job->file = NULL;
+        lv_buf_push(&jobs, &job);
+        pthread_cond_signal(&queued);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+LvSplitFile* lv_pf_read(char* name) {
+
+    pthread_mutex_lock(&lock);
+    Job* job = started ? findJob(name) : NULL;
+    bool splitHere = true;
+    LvSplitFile* res = NULL;
+    if(job) {
+        while(job->state == JOB_RUNNING)
+            pthread_cond_wait(&finished, &lock);
+        if(job->state == JOB_DONE) {
+            res = job->file;
+            job->file = NULL;
+            splitHere = false;
+        }
+        //a queued job is split here rather than waiting for a worker
+        job->state = JOB_TAKEN;
+    }
+    pthread_mutex_unlock(&lock);
+    if(splitHere)
+        res = split(name);
+    return res;
+}
+
+void lv_pf_free(LvSplitFile* file) {
+
+    if(!file)
+        return;
+    Token** stmts = file->stmts.data;
+    for(size_t i = 0; i < file->stmts.len; i++)
+        lv_tkn_free(stmts[i]);
+    lv_free(file->stmts.data);
+    lv_free(file->lines.data);
+    lv_free(file);
+}
+
+void lv_pf_onShutdown(void) {
+
+    if(!started)
+        return;
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&queued);
+    pthread_mutex_unlock(&lock);
+    for(size_t i = 0; i < numWorkers; i++)
+        pthread_join(workers[i], NULL);
+    for(size_t i = 0; i < jobs.len; i++) {
+        Job* job = *(Job**)lv_buf_get(&jobs, i);
+        lv_pf_free(job->file);
+        lv_free(job->name);
+        lv_free(job);
+    }
+    lv_free(jobs.data);
+    numWorkers = nextJob = 0;
+    started = stopping = false;
+}
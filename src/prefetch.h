@@ -0,0 +1,48 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+#include "token.h"
+#include "dynbuffer.h"
+#include <stdbool.h>
+
+/**
+ * Splits imported files into tokens ahead of their import. Once the
+ * declarations of a file are read, the files it imports are opened
+ * and split on a pool of worker threads, while the main thread runs
+ * the earlier commands of the file. Declarations are still read and
+ * commands run on the main thread in import order, so the operators
+ * and the text buffer are the same as when files are split one at
+ * a time.
+ */
+
+/**
+ * The statements of a file. A file that fails to split
+ * holds the statements before the error.
+ */
+typedef struct LvSplitFile {
+    DynBuffer stmts;    //of Token*, empty statements omitted
+    DynBuffer lines;    //of size_t, the line each statement starts on
+    TokenError error;
+    char errcxt[TKN_ERRCXT_LEN];
+} LvSplitFile;
+
+/**
+ * Starts splitting the file with the given module name on a
+ * worker thread, unless it was already started.
+ */
+void lv_pf_prefetch(char* name);
+
+/**
+ * Returns the statements of the file with the given module name,
+ * waiting for the worker splitting it if there is one, or NULL
+ * if the file could not be opened. The caller owns the result.
+ */
+LvSplitFile* lv_pf_read(char* name);
+
+/**
+ * Frees the file and the statements the caller did not take.
+ */
+void lv_pf_free(LvSplitFile* file);
+
+void lv_pf_onShutdown(void);
+
+#endif
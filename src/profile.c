@@ -0,0 +1,171 @@
+#include "profile.h"
+#include "lavender.h"
+#include "operator.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+//longest sequence counted
+#define MAX_GRAM 3
+//number of sequences of each length reported
+#define REPORT_LEN 20
+
+/**
+ * An instruction sequence and the number of times it ran. Instructions
+ * are identified by their type, except function calls, which are
+ * identified by the function. Unused trailing symbols are zero.
+ */
+typedef struct Gram {
+    uintptr_t sym[MAX_GRAM];
+    size_t count;
+} Gram;
+
+static Gram* grams;         //open addressed hash table
+static size_t gramsCap;     //power of two
+static size_t gramsLen;
+static uintptr_t window[MAX_GRAM];
+static size_t windowLen;
+static size_t prevIdx;
+
+static uintptr_t symbolOf(TextBufferObj* inst) {
+
+    if(inst->type == OPT_FUNCTION || inst->type == OPT_BUILTIN1 || inst->type == OPT_BUILTIN2
+        || inst->type == OPT_ARITH)
+        return (uintptr_t)inst->func;
+    return ((uintptr_t)inst->type << 1) | 1;
+}
+
+static size_t hashOf(uintptr_t* sym) {
+
+    uint64_t h = 0;
+    for(int i = 0; i < MAX_GRAM; i++)
+        h = (h ^ sym[i]) * 0x100000001b3;
+    return (size_t)(h ^ (h >> 29));
+}
+
+static Gram* find(Gram* table, size_t cap, uintptr_t* sym) {
+
+    size_t i = hashOf(sym) & (cap - 1);
+    while(table[i].count && memcmp(table[i].sym, sym, sizeof(table[i].sym)) != 0)
+        i = (i + 1) & (cap - 1);
+    return &table[i];
+}
+
+static void grow(void) {
+
+    size_t cap = gramsCap ? gramsCap * 2 : 1024;
+    Gram* table = lv_alloc(cap * sizeof(Gram));
+    memset(table, 0, cap * sizeof(Gram));
+    for(size_t i = 0; i < gramsCap; i++) {
+        if(grams[i].count)
+            *find(table, cap, grams[i].sym) = grams[i];
+    }
+    lv_free(grams);
+    grams = table;
+    gramsCap = cap;
+}
+
+static void count(uintptr_t* sym) {
+
+    if(2 * (gramsLen + 1) > gramsCap)
+        grow();
+    Gram* g = find(grams, gramsCap, sym);
+    if(!g->count) {
+        memcpy(g->sym, sym, sizeof(g->sym));
+        gramsLen++;
+    }
+    g->count++;
+}
+
+void lv_prof_record(size_t idx) {
+
+    //only count sequences that are adjacent in the text buffer,
+    //those are the ones that can be fused
+    if(idx != prevIdx + 1)
+        windowLen = 0;
+    prevIdx = idx;
+    if(windowLen == MAX_GRAM) {
+        memmove(window, window + 1, (MAX_GRAM - 1) * sizeof(uintptr_t));
+        windowLen--;
+    }
+    window[windowLen++] = symbolOf(&TEXT_BUFFER[idx]);
+    for(size_t n = 2; n <= windowLen; n++) {
+        uintptr_t sym[MAX_GRAM] = { 0 };
+        memcpy(sym, window + windowLen - n, n * sizeof(uintptr_t));
+        count(sym);
+    }
+}
+
+static const char* symbolName(uintptr_t sym) {
+
+    static const char* names[] = {
+        [OPT_UNDEFINED] = "undefined",
+        [OPT_NUMBER] = "number",
+        [OPT_INTEGER] = "int",
+        [OPT_PARAM] = "param",
+        [OPT_PUT_PARAM] = "put",
+        [OPT_FUNCTION_VAL] = "fval",
+        [OPT_FUNC_CAP] = "CAP",
+        [OPT_FUNC_CALL] = "CALL",
+        [OPT_FUNC_CALL2] = "CAL2",
+        [OPT_MAKE_VECT] = "VECT",
+        [OPT_RETURN] = "return",
+        [OPT_BEQZ] = "beqz",
+        [OPT_MOVE_PARAM] = "move",
+        [OPT_DISPATCH] = "dispatch",
+        [OPT_PARAM_CALL2] = "param-call2",
+        [OPT_MOVE_CALL2] = "move-call2",
+        [OPT_PARAM_BNE] = "param-bne",
+        [OPT_STRING] = "string",
+        [OPT_VECT] = "vect",
+        [OPT_CAPTURE] = "capture",
+        [OPT_MAP] = "map",
+    };
+    if(!(sym & 1))
+        return ((Operator*)sym)->name;
+    sym >>= 1;
+    if(sym < sizeof(names) / sizeof(names[0]) && names[sym])
+        return names[sym];
+    return "<internal operator>";
+}
+
+static int byCount(const void* a, const void* b) {
+
+    size_t ca = ((Gram*)a)->count;
+    size_t cb = ((Gram*)b)->count;
+    return (ca < cb) - (ca > cb);
+}
+
+void lv_prof_report(void) {
+
+    Gram* sorted = lv_alloc((gramsLen + 1) * sizeof(Gram));
+    size_t len = 0;
+    for(size_t i = 0; i < gramsCap; i++) {
+        if(grams[i].count)
+            sorted[len++] = grams[i];
+    }
+    qsort(sorted, len, sizeof(Gram), byCount);
+    for(int n = 2; n <= MAX_GRAM; n++) {
+        fprintf(stderr, "Most frequent sequences of %d instructions:\n", n);
+        int reported = 0;
+        for(size_t i = 0; i < len && reported < REPORT_LEN; i++) {
+            //sequences of length n have exactly n symbols
+            if(sorted[i].sym[n - 1] == 0 || (n < MAX_GRAM && sorted[i].sym[n] != 0))
+                continue;
+            fprintf(stderr, "%12zu ", sorted[i].count);
+            for(int j = 0; j < n; j++)
+                fprintf(stderr, " %s", symbolName(sorted[i].sym[j]));
+            fputc('\n', stderr);
+            reported++;
+        }
+    }
+    lv_free(sorted);
+}
+
+void lv_prof_onShutdown(void) {
+
+    lv_free(grams);
+    grams = NULL;
+    gramsCap = gramsLen = 0;
+}
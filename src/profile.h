@@ -0,0 +1,20 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+#include "textbuffer.h"
+#include <stddef.h>
+
+/**
+ * Records the execution of the instruction at the given index
+ * in the text buffer. Only called when profiling is enabled.
+ */
+void lv_prof_record(size_t idx);
+
+/**
+ * Prints the most frequently executed instruction sequences
+ * to stderr. These are candidates for superinstructions.
+ */
+void lv_prof_report(void);
+
+void lv_prof_onShutdown(void);
+
+#endif
@@ -0,0 +1,732 @@
+#include "regvm.h"
+#include "lavender.h"
+#include "operator.h"
+#include "builtin.h"
+#include "expression.h"
+#include "dynbuffer.h"
+#include "vect.h"
+#include <string.h>
+#include <assert.h>
+
+//nested register frames run on the C stack, deeper
+//calls run on the stack VM
+#define MAX_DEPTH 256
+//registers shared by all frames
+#define REG_STACK_SIZE (64 * 1024)
+
+//operands are registers or constants. Reading a register
+//with the move bit set hands its reference to the reader,
+//like OPT_MOVE_PARAM.
+#define REG(r) ((r) << 1)
+#define MOVE_REG(r) (((r) << 1) | 1)
+#define CONST(i) (-(i) - 1)
+
+typedef enum RegOp {
+    R_LOAD,         //dst = a
+    R_BUILTIN1,     //dst = func(a)
+    R_BUILTIN2,     //dst = func(a, b)
+    R_CALL,         //dst = func(regs a..)
+    R_TAILCALL,     //restart the function with args regs a..
+    R_CALLV,        //dst = (reg a)(regs a + 1 .. a + b)
+    R_CALLV_LAST,   //dst = (reg a + b)(regs a .. a + b - 1)
+    R_CAPTURE,      //dst = func capturing regs a .. a + b - 1
+    R_VECT,         //dst = { regs a .. a + b - 1 }
+    R_BEQZ,         //jump to dst if a is false
+    R_BNE,          //jump to dst if a != b
+    R_DISPATCH,     //jump by table if reg a is a function value
+    R_JUMP,         //jump to dst
+    R_RETURN,       //return a
+} RegOp;
+
+/**
+ * A register instruction. Operands a and b are encoded with
+ * REG, MOVE_REG, or CONST, except for instructions that take
+ * consecutive registers, where a is the first register and b
+ * is the count.
+ */
+typedef struct RegInst {
+    RegOp op;
+    int dst;
+    int a;
+    int b;
+    union {
+        Operator* func;
+        LvDispatch* table;  //branch addresses are absolute
+    };
+    int arith;              //ArithOp of R_BUILTIN2
+} RegInst;
+
+/**
+ * The register code of a function. The first numFixed registers
+ * hold the params and locals, the rest hold temporaries.
+ */
+struct LvRegCode {
+    int arity;
+    int numFixed;
+    int numRegs;
+    RegInst* code;
+    size_t len;
+    TextBufferObj* consts;
+    size_t numConsts;
+};
+
+//marks functions that cannot be translated
+static LvRegCode unsupported;
+static int depth;
+//Frames are windows into the register stack. A callee's frame
+//starts at its first arg in the caller's frame, so args are passed
+//without copying. Registers above regTop are undefined.
+static TextBufferObj regStack[REG_STACK_SIZE];
+static TextBufferObj* regTop = regStack;
+
+/**
+ * Start of a translated run of stack code.
+ */
+typedef struct Label {
+    size_t idx;
+    size_t pc;
+} Label;
+
+typedef struct Compiler {
+    Operator* func;
+    int numFixed;
+    int maxDepth;
+    DynBuffer code;     //of RegInst
+    DynBuffer consts;   //of TextBufferObj
+    DynBuffer stack;    //of int, the operands the stack code pushed
+    DynBuffer labels;   //of Label
+    DynBuffer work;     //of size_t, branch targets to translate
+} Compiler;
+
+static TextBufferObj* constAt(Compiler* c, int x) {
+
+    return lv_buf_get(&c->consts, -x - 1);
+}
+
+static int addConst(Compiler* c, TextBufferObj* obj) {
+
+    if(obj->type & LV_DYNAMIC)
+        ++*obj->refCount;
+    lv_buf_push(&c->consts, obj);
+    return CONST((int)c->consts.len - 1);
+}
+
+static int tempReg(Compiler* c, size_t depth) {
+
+    return c->numFixed + (int)depth;
+}
+
+static void pushOperand(Compiler* c, int x) {
+
+    lv_buf_push(&c->stack, &x);
+    if((int)c->stack.len > c->maxDepth)
+        c->maxDepth = c->stack.len;
+}
+
+static int popOperand(Compiler* c) {
+
+    int x;
+    lv_buf_pop(&c->stack, &x);
+    return x;
+}
+
+static void emit(Compiler* c, RegInst* inst) {
+
+    lv_buf_push(&c->code, inst);
+}
+
+static long findLabel(Compiler* c, size_t idx) {
+
+    Label* labels = c->labels.data;
+    for(size_t i = 0; i < c->labels.len; i++) {
+        if(labels[i].idx == idx)
+            return labels[i].pc;
+    }
+    return -1;
+}
+
+/**
+ * Loads the operands on the stack that read the given param
+ * into their temporaries, before the param is moved or set.
+ */
+static void flushParam(Compiler* c, int param) {
+
+    int* stack = c->stack.data;
+    for(size_t k = 0; k < c->stack.len; k++) {
+        if(stack[k] >= 0 && (stack[k] >> 1) == param) {
+            RegInst load = { .op = R_LOAD, .dst = tempReg(c, k), .a = stack[k] };
+            emit(c, &load);
+            stack[k] = MOVE_REG(load.dst);
+        }
+    }
+}
+
+/**
+ * Pops the top n operands into consecutive registers and
+ * returns the first one. Temporaries are already in place.
+ */
+static int materialize(Compiler* c, int n) {
+
+    int* stack = c->stack.data;
+    size_t base = c->stack.len - n;
+    for(size_t k = base; k < c->stack.len; k++) {
+        int reg = tempReg(c, k);
+        if(stack[k] != MOVE_REG(reg)) {
+            RegInst load = { .op = R_LOAD, .dst = reg, .a = stack[k] };
+            emit(c, &load);
+        }
+    }
+    c->stack.len = base;
+    return tempReg(c, base);
+}
+
+static bool translateValue(Compiler* c, TextBufferObj* inst) {
+
+    switch(inst->type) {
+        case OPT_PARAM:
+            pushOperand(c, REG(inst->param));
+            return true;
+        case OPT_MOVE_PARAM:
+            flushParam(c, inst->param);
+            pushOperand(c, MOVE_REG(inst->param));
+            return true;
+        case OPT_UNDEFINED:
+        case OPT_NUMBER:
+        case OPT_INTEGER:
+        case OPT_STRING:
+        case OPT_FUNCTION_VAL:
+        case OPT_CAPTURE:
+        case OPT_VECT:
+        case OPT_MAP:
+            pushOperand(c, addConst(c, inst));
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Translates a call of a known function on the operands on top of
+ * the stack. Builtins of arity 1 and 2 read their operands directly,
+ * other functions take their args in consecutive registers.
+ */
+static void translateCall(Compiler* c, Operator* func, int arith) {
+
+    RegInst inst = { .func = func, .arith = arith };
+    if(func->type == FUN_BUILTIN && (func->arity == 1 || func->arity == 2)) {
+        inst.op = func->arity == 1 ? R_BUILTIN1 : R_BUILTIN2;
+        if(func->arity == 2)
+            inst.b = popOperand(c);
+        inst.a = popOperand(c);
+        inst.dst = tempReg(c, c->stack.len);
+    } else {
+        inst.op = R_CALL;
+        inst.a = inst.dst = materialize(c, func->arity);
+    }
+    emit(c, &inst);
+    pushOperand(c, MOVE_REG(inst.dst));
+}
+
+/**
+ * Adds a branch to the stack code at the given index. Branch
+ * targets are translated later with an empty stack.
+ */
+static bool branchTo(Compiler* c, RegInst* inst, size_t target) {
+
+    if(c->stack.len != 0)
+        return false;
+    inst->dst = target;
+    emit(c, inst);
+    lv_buf_push(&c->work, &target);
+    return true;
+}
+
+/**
+ * Translates the stack code starting at the given index up to a
+ * return or already translated code. Branch addresses are left as
+ * stack code indices, see resolveBranches.
+ */
+static bool translateRun(Compiler* c, size_t i) {
+
+    c->stack.len = 0;
+    for(;;) {
+        if(c->stack.len == 0) {
+            if(findLabel(c, i) >= 0) {
+                RegInst jump = { .op = R_JUMP, .dst = i };
+                emit(c, &jump);
+                return true;
+            }
+            Label label = { i, c->code.len };
+            lv_buf_push(&c->labels, &label);
+        }
+        TextBufferObj* inst = &TEXT_BUFFER[i];
+        switch(inst->type) {
+            case OPT_PUT_PARAM: {
+                RegInst put = { .op = R_LOAD, .dst = inst->param, .a = popOperand(c) };
+                flushParam(c, inst->param);
+                emit(c, &put);
+                i++;
+                break;
+            }
+            case OPT_FUNCTION: {
+                if(inst->func == c->func && inst[1].type == OPT_RETURN
+                    && (int)c->stack.len == c->func->arity) {
+                    RegInst tail = { .op = R_TAILCALL, .a = materialize(c, c->func->arity) };
+                    emit(c, &tail);
+                    return true;
+                }
+                translateCall(c, inst->func, 0);
+                i++;
+                break;
+            }
+            case OPT_BUILTIN1:
+            case OPT_BUILTIN2:
+                translateCall(c, inst->func, 0);
+                i++;
+                break;
+            case OPT_ARITH:
+                translateCall(c, inst->func, inst->arith);
+                i++;
+                break;
+            case OPT_PARAM_CALL2:
+            case OPT_MOVE_CALL2: {
+                TextBufferObj param = {
+                    .type = inst->type == OPT_PARAM_CALL2 ? OPT_PARAM : OPT_MOVE_PARAM,
+                    .param = inst->param
+                };
+                if(!translateValue(c, &param) || !translateValue(c, &inst[1]))
+                    return false;
+                translateCall(c, inst[2].func, inst[2].arith);
+                i += 3;
+                break;
+            }
+            case OPT_FUNC_CALL: {
+                //the function is above its args
+                int n = inst->callArity;
+                RegInst call = { .op = R_CALLV_LAST, .b = n };
+                call.a = call.dst = materialize(c, n + 1);
+                emit(c, &call);
+                pushOperand(c, MOVE_REG(call.dst));
+                i++;
+                break;
+            }
+            case OPT_FUNC_CALL2: {
+                //the function is below its args
+                int n = inst->callArity - 1;
+                RegInst call = { .op = R_CALLV, .b = n };
+                call.a = call.dst = materialize(c, n + 1);
+                emit(c, &call);
+                pushOperand(c, MOVE_REG(call.dst));
+                i++;
+                break;
+            }
+            case OPT_FUNC_CAP: {
+                int x = popOperand(c);
+                if(x >= 0 || constAt(c, x)->type != OPT_FUNCTION_VAL)
+                    return false;
+                Operator* func = constAt(c, x)->func;
+                RegInst cap = { .op = R_CAPTURE, .b = func->captureCount, .func = func };
+                cap.a = cap.dst = materialize(c, func->captureCount);
+                emit(c, &cap);
+                pushOperand(c, MOVE_REG(cap.dst));
+                i++;
+                break;
+            }
+            case OPT_MAKE_VECT: {
+                RegInst vect = { .op = R_VECT, .b = inst->callArity };
+                vect.a = vect.dst = materialize(c, inst->callArity);
+                emit(c, &vect);
+                pushOperand(c, MOVE_REG(vect.dst));
+                i++;
+                break;
+            }
+            case OPT_BEQZ: {
+                int x = popOperand(c);
+                size_t target = i + inst->branchAddr;
+                if(x < 0) {
+                    //constant condition, e.g. the jump over the locals
+                    i = lv_blt_toBool(constAt(c, x)) ? i + 1 : target;
+                    break;
+                }
+                RegInst beqz = { .op = R_BEQZ, .a = x };
+                if(!branchTo(c, &beqz, target))
+                    return false;
+                i++;
+                break;
+            }
+            case OPT_PARAM_BNE: {
+                //the literal is not object-like, see runCycle
+                RegInst bne = { .op = R_BNE, .a = REG(inst->param) };
+                bne.b = addConst(c, &inst[1]);
+                if(!branchTo(c, &bne, i + 3 + inst[3].branchAddr))
+                    return false;
+                i += 4;
+                break;
+            }
+            case OPT_DISPATCH: {
+                LvDispatch* table = inst->dispatch;
+                if(c->stack.len != 0)
+                    return false;
+                RegInst dispatch = { .op = R_DISPATCH, .a = table->param, .b = i, .table = table };
+                emit(c, &dispatch);
+                for(size_t s = 0; s <= table->mask; s++) {
+                    if(table->slot[s].func) {
+                        size_t target = i + table->slot[s].branchAddr;
+                        lv_buf_push(&c->work, &target);
+                    }
+                }
+                size_t miss = i + table->missAddr;
+                lv_buf_push(&c->work, &miss);
+                //other values test the conditions in order
+                pushOperand(c, REG(table->param));
+                i++;
+                break;
+            }
+            case OPT_RETURN: {
+                RegInst ret = { .op = R_RETURN, .a = popOperand(c) };
+                emit(c, &ret);
+                return true;
+            }
+            default:
+                if(!translateValue(c, inst))
+                    return false;
+                i++;
+                break;
+        }
+    }
+}
+
+/**
+ * Replaces the stack code indices of branches with the
+ * addresses of their translations.
+ */
+static void resolveBranches(Compiler* c) {
+
+    RegInst* code = c->code.data;
+    for(size_t i = 0; i < c->code.len; i++) {
+        switch(code[i].op) {
+            case R_BEQZ:
+            case R_BNE:
+            case R_JUMP:
+                code[i].dst = findLabel(c, code[i].dst);
+                assert(code[i].dst >= 0);
+                break;
+            case R_DISPATCH: {
+                LvDispatch* table = code[i].table;
+                size_t size = sizeof(LvDispatch) + (table->mask + 1) * sizeof(table->slot[0]);
+                LvDispatch* copy = lv_alloc(size);
+                memcpy(copy, table, size);
+                for(size_t s = 0; s <= copy->mask; s++) {
+                    if(copy->slot[s].func)
+                        copy->slot[s].branchAddr = findLabel(c, code[i].b + copy->slot[s].branchAddr);
+                }
+                copy->missAddr = findLabel(c, code[i].b + copy->missAddr);
+                code[i].table = copy;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
+
+static LvRegCode* compile(Operator* func) {
+
+    Compiler c;
+    c.func = func;
+    c.numFixed = func->arity + func->locals;
+    c.maxDepth = 0;
+    lv_buf_init(&c.code, sizeof(RegInst));
+    lv_buf_init(&c.consts, sizeof(TextBufferObj));
+    lv_buf_init(&c.stack, sizeof(int));
+    lv_buf_init(&c.labels, sizeof(Label));
+    lv_buf_init(&c.work, sizeof(size_t));
+    size_t start = func->textOffset;
+    lv_buf_push(&c.work, &start);
+    bool success = true;
+    while(success && c.work.len > 0) {
+        size_t idx;
+        lv_buf_pop(&c.work, &idx);
+        if(findLabel(&c, idx) < 0)
+            success = translateRun(&c, idx);
+    }
+    lv_free(c.stack.data);
+    lv_free(c.work.data);
+    if(!success) {
+        lv_free(c.labels.data);
+        lv_expr_cleanup(c.consts.data, c.consts.len);
+        lv_free(c.consts.data);
+        lv_free(c.code.data);
+        return &unsupported;
+    }
+    resolveBranches(&c);
+    lv_free(c.labels.data);
+    LvRegCode* res = lv_alloc(sizeof(LvRegCode));
+    res->arity = func->arity;
+    res->numFixed = c.numFixed;
+    //at least one register, so frames are never empty arrays
+    res->numRegs = c.numFixed + c.maxDepth + 1;
+    res->code = c.code.data;
+    res->len = c.code.len;
+    res->consts = c.consts.data;
+    res->numConsts = c.consts.len;
+    return res;
+}
+
+void lv_reg_free(LvRegCode* code) {
+
+    if(!code || code == &unsupported)
+        return;
+    for(size_t i = 0; i < code->len; i++) {
+        if(code->code[i].op == R_DISPATCH)
+            lv_free(code->code[i].table);
+    }
+    lv_expr_cleanup(code->consts, code->numConsts);
+    lv_free(code->consts);
+    lv_free(code->code);
+    lv_free(code);
+}
+
+/**
+ * Returns the register code of the function if it can run in a
+ * frame starting at the given register, translating the function
+ * on its first call. Returns NULL if the function must be run on
+ * the stack VM.
+ */
+static LvRegCode* codeFor(Operator* func, TextBufferObj* frame) {
+
+    if(func->type != FUN_FUNCTION || depth == MAX_DEPTH)
+        return NULL;
+    if(!func->regCode)
+        func->regCode = compile(func);
+    LvRegCode* code = func->regCode;
+    if(code == &unsupported || frame + code->numRegs > regStack + REG_STACK_SIZE)
+        return NULL;
+    return code;
+}
+
+static inline void hold(TextBufferObj* obj) {
+
+    if(obj->type & LV_DYNAMIC)
+        ++*obj->refCount;
+}
+
+/**
+ * Releases a value that is not a register.
+ */
+static inline void drop(TextBufferObj* obj) {
+
+    if(obj->type & LV_DYNAMIC)
+        lv_expr_cleanup(obj, 1);
+}
+
+/**
+ * Returns the value of an operand with a reference held
+ * for the caller.
+ */
+static inline TextBufferObj readOperand(LvRegCode* code, TextBufferObj* regs, int x) {
+
+    TextBufferObj res;
+    if(x < 0) {
+        res = code->consts[-x - 1];
+    } else {
+        res = regs[x >> 1];
+        if(x & 1) {
+            regs[x >> 1].type = OPT_UNDEFINED;
+            return res;
+        }
+    }
+    hold(&res);
+    return res;
+}
+
+static void release(TextBufferObj* regs, int n) {
+
+    for(int i = 0; i < n; i++) {
+        drop(&regs[i]);
+        regs[i].type = OPT_UNDEFINED;
+    }
+}
+
+static TextBufferObj run(LvRegCode* code, TextBufferObj* regs);
+
+/**
+ * Calls a function value or capture on the args in registers,
+ * releasing the args and the function. The registers after the
+ * args must be unused.
+ */
+static TextBufferObj callValue(TextBufferObj* func, TextBufferObj* args, int numArgs) {
+
+    TextBufferObj res;
+    Operator* op = NULL;
+    int caps = 0;
+    if(func->type == OPT_FUNCTION_VAL) {
+        op = func->func;
+    } else if(func->type == OPT_CAPTURE) {
+        op = func->capture->func;
+        caps = op->captureCount;
+    }
+    LvRegCode* callee = op ? codeFor(op, args) : NULL;
+    if(callee && !op->varargs && op->arity == numArgs + caps) {
+        //captured values follow the args
+        for(int i = 0; i < caps; i++) {
+            args[numArgs + i] = func->capture->value[i];
+            hold(&args[numArgs + i]);
+        }
+        res = run(callee, args);
+    } else {
+        lv_callFunction(func, numArgs, args, &res);
+        hold(&res);
+        release(args, numArgs);
+    }
+    drop(func);
+    return res;
+}
+
+/**
+ * Runs the code in the frame starting at regs, which holds the args.
+ * The frame's registers are undefined when this returns.
+ */
+static TextBufferObj run(LvRegCode* code, TextBufferObj* regs) {
+
+    TextBufferObj* oldTop = regTop;
+    regTop = regs + code->numRegs;
+    depth++;
+    RegInst* pc = code->code;
+    for(;;) {
+        RegInst* inst = pc++;
+        switch(inst->op) {
+            case R_LOAD:
+                regs[inst->dst] = readOperand(code, regs, inst->a);
+                break;
+            case R_BUILTIN1: {
+                TextBufferObj arg = readOperand(code, regs, inst->a);
+                TextBufferObj res = inst->func->builtin(&arg);
+                hold(&res);
+                drop(&arg);
+                regs[inst->dst] = res;
+                break;
+            }
+            case R_BUILTIN2: {
+                TextBufferObj args[2];
+                args[0] = readOperand(code, regs, inst->a);
+                args[1] = readOperand(code, regs, inst->b);
+                TextBufferObj res;
+                if(inst->arith && lv_blt_arith(inst->arith, args, &res)) {
+                    regs[inst->dst] = res;
+                    break;
+                }
+                res = inst->func->builtin(args);
+                hold(&res);
+                drop(&args[0]);
+                drop(&args[1]);
+                regs[inst->dst] = res;
+                break;
+            }
+            case R_CALL: {
+                Operator* func = inst->func;
+                TextBufferObj* args = &regs[inst->a];
+                TextBufferObj res;
+                LvRegCode* callee = codeFor(func, args);
+                if(callee) {
+                    res = run(callee, args);
+                } else {
+                    if(func->type == FUN_BUILTIN)
+                        res = func->builtin(args);
+                    else
+                        lv_callOperator(func, args, &res);
+                    hold(&res);
+                    release(args, func->arity);
+                }
+                regs[inst->dst] = res;
+                break;
+            }
+            case R_TAILCALL: {
+                //only the args are left in the temporaries
+                release(regs, code->numFixed);
+                memcpy(regs, &regs[inst->a], code->arity * sizeof(TextBufferObj));
+                for(int i = 0; i < code->arity; i++)
+                    regs[inst->a + i].type = OPT_UNDEFINED;
+                pc = code->code;
+                break;
+            }
+            case R_CALLV: {
+                //the callee's frame starts after the function
+                TextBufferObj func = regs[inst->a];
+                regs[inst->a].type = OPT_UNDEFINED;
+                regs[inst->dst] = callValue(&func, &regs[inst->a + 1], inst->b);
+                break;
+            }
+            case R_CALLV_LAST: {
+                //the callee's frame may use the function's register
+                TextBufferObj func = regs[inst->a + inst->b];
+                regs[inst->a + inst->b].type = OPT_UNDEFINED;
+                regs[inst->dst] = callValue(&func, &regs[inst->a], inst->b);
+                break;
+            }
+            case R_CAPTURE: {
+                TextBufferObj obj;
+                obj.type = OPT_CAPTURE;
+                obj.capture = lv_alloc(sizeof(CaptureObj) + inst->b * sizeof(TextBufferObj));
+                obj.capture->refCount = 1;
+                obj.capture->func = inst->func;
+                //transfer the registers' references to the capture
+                memcpy(obj.capture->value, &regs[inst->a], inst->b * sizeof(TextBufferObj));
+                for(int i = 0; i < inst->b; i++)
+                    regs[inst->a + i].type = OPT_UNDEFINED;
+                regs[inst->dst] = obj;
+                break;
+            }
+            case R_VECT: {
+                TextBufferObj obj;
+                obj.type = OPT_VECT;
+                obj.vect = lv_vect_alloc(inst->b);
+                obj.vect->refCount = 1;
+                memcpy(obj.vect->data, &regs[inst->a], inst->b * sizeof(TextBufferObj));
+                for(int i = 0; i < inst->b; i++)
+                    regs[inst->a + i].type = OPT_UNDEFINED;
+                regs[inst->dst] = obj;
+                break;
+            }
+            case R_BEQZ: {
+                TextBufferObj cond = readOperand(code, regs, inst->a);
+                if(!lv_blt_toBool(&cond))
+                    pc = &code->code[inst->dst];
+                drop(&cond);
+                break;
+            }
+            case R_BNE: {
+                TextBufferObj val = readOperand(code, regs, inst->a);
+                if(!lv_blt_equal(&val, &code->consts[-inst->b - 1]))
+                    pc = &code->code[inst->dst];
+                drop(&val);
+                break;
+            }
+            case R_DISPATCH:
+                if(regs[inst->a].type == OPT_FUNCTION_VAL)
+                    pc = &code->code[lv_tb_dispatch(inst->table, regs[inst->a].func)];
+                break;
+            case R_JUMP:
+                pc = &code->code[inst->dst];
+                break;
+            case R_RETURN: {
+                TextBufferObj res = readOperand(code, regs, inst->a);
+                release(regs, code->numRegs);
+                depth--;
+                regTop = oldTop;
+                return res;
+            }
+        }
+    }
+}
+
+bool lv_reg_call(Operator* func, TextBufferObj* args, TextBufferObj* res) {
+
+    LvRegCode* code = codeFor(func, regTop);
+    if(!code)
+        return false;
+    TextBufferObj* frame = regTop;
+    memcpy(frame, args, func->arity * sizeof(TextBufferObj));
+    *res = run(code, frame);
+    return true;
+}
@@ -0,0 +1,29 @@
+#ifndef REGVM_H
+#define REGVM_H
+#include "textbuffer.h"
+#include <stdbool.h>
+
+/**
+ * The register VM runs functions translated from their stack
+ * code. Params, locals, and the values the stack code would push
+ * live in a frame of registers, and instructions name their
+ * operands directly instead of pushing and popping them. Functions
+ * are translated on their first call when lv_regvm is set. Functions
+ * using instructions the translator does not support stay on the
+ * stack VM.
+ */
+
+/**
+ * Calls the function on the register VM. The args are moved into
+ * the function's frame and the result is stored in res with a
+ * reference held for the caller. Returns false without touching
+ * the args if the function cannot run on the register VM.
+ */
+bool lv_reg_call(Operator* func, TextBufferObj* args, TextBufferObj* res);
+
+/**
+ * Frees the register code of a function.
+ */
+void lv_reg_free(LvRegCode* code);
+
+#endif
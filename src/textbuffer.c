@@ -2,9 +2,12 @@
 #include "lavender.h"
 #include "expression.h"
 #include "operator.h"
+#include "vect.h"
+#include "hashmap.h"
+#include "command.h"
+#include "number.h"
 #include <string.h>
 #include <stdio.h>
-#include <inttypes.h>
 #include <assert.h>
 
 //redeclaration of the global text buffer
@@ -12,6 +15,20 @@ TextBufferObj* TEXT_BUFFER;
 #define INIT_TEXT_BUFFER_LEN 1024
 static size_t textBufferLen;    //one past the end of the buffer
 static size_t textBufferTop;    //one past the top of the buffer
+static size_t keepTop;          //one past the last deferred body defined
+static Operator* deferredDecl;  //the function whose deferred body is parsed
+//deferred bodies of at most this many tokens are defined when
+//first referenced, so that calls of them may be inlined
+#define SHORT_BODY_LEN 24
+
+struct LvLazyBody {
+    Token* tokens;      //the whole definition
+    Token* body;
+    LvNameEnv* env;
+    char* file;         //module defining the function
+    size_t line;        //of the definition in the file
+    bool isShort;
+};
 
 /**
  * Adds the text to the buffer and appends a return object to the end.
@@ -26,6 +43,11 @@ static void pushText(TextBufferObj* text, size_t len) {
         textBufferLen *= 2;
     }
     memcpy(TEXT_BUFFER + textBufferTop, text, len * sizeof(TextBufferObj));
+    for(size_t i = textBufferTop; i < textBufferTop + len; i++) {
+        //call sites get an inline cache when first run
+        if(TEXT_BUFFER[i].type == OPT_FUNC_CALL || TEXT_BUFFER[i].type == OPT_FUNC_CALL2)
+            TEXT_BUFFER[i].callSite = 0;
+    }
     textBufferTop += len;
 }
 
@@ -39,6 +61,33 @@ static size_t length(int number) {
     return len;
 }
 
+//appends "key -> value," to the string
+static bool appendEntry(LvMapEntry* entry, void* data) {
+
+    LvString** res = data;
+    LvString* key = lv_tb_getString(&entry->key);
+    LvString* value = lv_tb_getString(&entry->value);
+    size_t len = (*res)->len + key->len + value->len + 6;
+    *res = lv_realloc(*res, sizeof(LvString) + len + 1);
+    //strings may hold NUL, so copy by length
+    char* out = (*res)->value + (*res)->len;
+    *out++ = ' ';
+    memcpy(out, key->value, key->len);
+    out += key->len;
+    memcpy(out, " -> ", 4);
+    out += 4;
+    memcpy(out, value->value, value->len);
+    out += value->len;
+    *out++ = ',';
+    *out = '\0';
+    (*res)->len = len;
+    if(key->refCount == 0)
+        lv_free(key);
+    if(value->refCount == 0)
+        lv_free(value);
+    return true;
+}
+
 LvString* lv_tb_getString(TextBufferObj* obj) {
 
     LvString* res;
@@ -47,6 +96,7 @@ LvString* lv_tb_getString(TextBufferObj* obj) {
             static char str[] = "<undefined>";
             res = lv_alloc(sizeof(LvString) + sizeof(str));
             res->refCount = 0;
+            res->hash = 0;
             res->len = sizeof(str) - 1;
             strcpy(res->value, str);
             return res;
@@ -55,33 +105,17 @@ LvString* lv_tb_getString(TextBufferObj* obj) {
             res = obj->str;
             return res;
         }
-        case OPT_NUMBER: {
-            //because rather nontrivial to find the length of a
-            //floating-point value before putting it into a string,
-            //we first call snprintf with an empty buffer. Then, we take
-            //the number of characters printed by snprintf and allocate
-            //the buffer to that length (plus 1 for the terminator).
-            int len = snprintf(NULL, 0, "%g", obj->number);
+        case OPT_NUMBER:
+        case OPT_INTEGER: {
+            char buf[LV_NUM_FORMAT_LEN];
+            size_t len = obj->type == OPT_NUMBER
+                ? lv_num_formatNumber(obj->number, buf)
+                : lv_num_formatInteger(obj->integer, buf);
             res = lv_alloc(sizeof(LvString) + len + 1);
-            snprintf(res->value, len + 1, "%g", obj->number);
             res->refCount = 0;
+            res->hash = 0;
             res->len = len;
-            return res;
-        }
-        case OPT_INTEGER: {
-            //get the sign bit
-            bool negative = obj->integer >> 63;
-            //get the magnitude of the value
-            uint64_t value = negative ? (-obj->integer) : obj->integer;
-            //get the length (+1 for minus sign)
-            size_t len = snprintf(NULL, 0, "%"PRIu64, value);
-            res = lv_alloc(sizeof(LvString) + negative + len + 1);
-            res->refCount = 0;
-            res->len = negative + len;
-            if(negative) {
-                res->value[0] = '-';
-            }
-            snprintf(res->value + negative, len + 1, "%"PRIu64, value);
+            memcpy(res->value, buf, len + 1);
             return res;
         }
         case OPT_FUNCTION:
@@ -89,19 +123,21 @@ LvString* lv_tb_getString(TextBufferObj* obj) {
             size_t len = strlen(obj->func->name);
             res = lv_alloc(sizeof(LvString) + len + 1);
             res->refCount = 0;
+            res->hash = 0;
             res->len = len;
             strcpy(res->value, obj->func->name);
             return res;
         }
         case OPT_CAPTURE: {
             //func-name[cap1, cap2, ..., capn]
-            size_t len = strlen(obj->capfunc->name) + 1;
+            size_t len = strlen(obj->capture->func->name) + 1;
             res = lv_alloc(sizeof(LvString) + len + 1);
             res->refCount = 0;
-            strcpy(res->value, obj->capfunc->name);
+            res->hash = 0;
+            strcpy(res->value, obj->capture->func->name);
             res->value[len - 1] = '[';
             res->value[len] = '\0';
-            for(int i = 0; i < obj->capfunc->captureCount; i++) {
+            for(int i = 0; i < obj->capture->func->captureCount; i++) {
                 LvString* tmp = lv_tb_getString(&obj->capture->value[i]);
                 len += tmp->len + 1;
                 res = lv_realloc(res, sizeof(LvString) + len + 1);
@@ -121,34 +157,66 @@ LvString* lv_tb_getString(TextBufferObj* obj) {
                 static char str[] = "{ }";
                 res = lv_alloc(sizeof(LvString) + sizeof(str));
                 res->refCount = 0;
+                res->hash = 0;
                 res->len = sizeof(str) - 1;
                 memcpy(res->value, str, sizeof(str));
                 return res;
             }
             //[ val1, val2, ..., valn ]
             size_t len = 2;
-            res = lv_alloc(sizeof(LvString) + len + 1);
+            size_t cap = 16 * obj->vect->len;
+            res = lv_alloc(sizeof(LvString) + cap + 1);
             res->refCount = 0;
+            res->hash = 0;
             res->value[0] = '{';
             res->value[1] = ' ';
-            res->value[2] = '\0';
-            //concatenate values
+            //concatenate values, formatting numbers in place
             for(size_t i = 0; i < obj->vect->len; i++) {
-                LvString* tmp = lv_tb_getString(&obj->vect->data[i]);
-                len += tmp->len + 2;
-                res = lv_realloc(res, sizeof(LvString) + len + 1);
-                strcat(res->value, tmp->value);
-                res->value[len - 2] = ',';
-                res->value[len - 1] = ' ';
-                res->value[len] = '\0';
-                if(tmp->refCount == 0)
-                    lv_free(tmp);
+                TextBufferObj* el = lv_vect_at(obj->vect, i);
+                LvString* tmp = NULL;
+                size_t elLen = LV_NUM_FORMAT_LEN;
+                if(el->type != OPT_NUMBER && el->type != OPT_INTEGER) {
+                    tmp = lv_tb_getString(el);
+                    elLen = tmp->len;
+                }
+                if(len + elLen + 2 > cap) {
+                    cap = 2 * cap > len + elLen + 2 ? 2 * cap : len + elLen + 2;
+                    res = lv_realloc(res, sizeof(LvString) + cap + 1);
+                }
+                if(el->type == OPT_NUMBER) {
+                    len += lv_num_formatNumber(el->number, res->value + len);
+                } else if(el->type == OPT_INTEGER) {
+                    len += lv_num_formatInteger(el->integer, res->value + len);
+                } else {
+                    memcpy(res->value + len, tmp->value, elLen);
+                    len += elLen;
+                    if(tmp->refCount == 0)
+                        lv_free(tmp);
+                }
+                res->value[len++] = ',';
+                res->value[len++] = ' ';
             }
             res->value[len - 2] = ' ';
             res->value[len - 1] = '}';
+            res->value[len] = '\0';
             res->len = len;
             return res;
         }
+        case OPT_MAP: {
+            //#{ key1 -> val1, ..., keyn -> valn }
+            res = lv_alloc(sizeof(LvString) + 3);
+            res->refCount = 0;
+            res->hash = 0;
+            res->len = 2;
+            strcpy(res->value, "#{");
+            lv_map_forEach(obj->map, appendEntry, &res);
+            res = lv_realloc(res, sizeof(LvString) + res->len + 3);
+            if(obj->map->len != 0)
+                res->len--; //remove trailing comma
+            strcpy(res->value + res->len, " }");
+            res->len += 2;
+            return res;
+        }
         //not called outside of debug mode
         case OPT_PARAM: {
             static char str[] = "param ";
@@ -156,17 +224,53 @@ LvString* lv_tb_getString(TextBufferObj* obj) {
             len += sizeof(str) - 1;
             res = lv_alloc(sizeof(LvString) + len + 1);
             res->refCount = 0;
+            res->hash = 0;
+            res->len = len;
+            strcpy(res->value, str);
+            sprintf(res->value + sizeof(str) - 1, "%d", obj->param);
+            return res;
+        }
+        case OPT_MOVE_PARAM: {
+            static char str[] = "move ";
+            size_t len = length(obj->param);
+            len += sizeof(str) - 1;
+            res = lv_alloc(sizeof(LvString) + len + 1);
+            res->refCount = 0;
+            res->hash = 0;
             res->len = len;
             strcpy(res->value, str);
             sprintf(res->value + sizeof(str) - 1, "%d", obj->param);
             return res;
         }
+        case OPT_BUILTIN1:
+        case OPT_BUILTIN2:
+        case OPT_ARITH:
+            res = lv_alloc(sizeof(LvString) + strlen(obj->func->name) + 1);
+            res->refCount = 0;
+            res->hash = 0;
+            res->len = strlen(obj->func->name);
+            strcpy(res->value, obj->func->name);
+            return res;
+        case OPT_PARAM_CALL2:
+        case OPT_MOVE_CALL2:
+        case OPT_PARAM_BNE: {
+            char* str = obj->type == OPT_PARAM_CALL2 ? "param (fused) "
+                : obj->type == OPT_MOVE_CALL2 ? "move (fused) " : "bne param ";
+            size_t len = length(obj->param) + strlen(str);
+            res = lv_alloc(sizeof(LvString) + len + 1);
+            res->refCount = 0;
+            res->hash = 0;
+            res->len = len;
+            sprintf(res->value, "%s%d", str, obj->param);
+            return res;
+        }
         case OPT_PUT_PARAM: {
             static char str[] = "put ";
             size_t len = length(obj->param);
             len += sizeof(str) - 1;
             res = lv_alloc(sizeof(LvString) + len + 1);
             res->refCount = 0;
+            res->hash = 0;
             res->len = len;
             strcpy(res->value, str);
             sprintf(res->value + sizeof(str) - 1, "%d", obj->param);
@@ -180,6 +284,7 @@ LvString* lv_tb_getString(TextBufferObj* obj) {
             len += LEN - 1;
             res = lv_alloc(sizeof(LvString) + len + LEN);
             res->refCount = 0;
+            res->hash = 0;
             res->len = len;
             sprintf(res->value, "%d", obj->callArity);
             strcat(res->value, obj->type == OPT_MAKE_VECT ? " VECT"
@@ -191,6 +296,7 @@ LvString* lv_tb_getString(TextBufferObj* obj) {
             static char str[] = "CAP";
             res = lv_alloc(sizeof(LvString) + sizeof(str));
             res->refCount = 0;
+            res->hash = 0;
             res->len = sizeof(str) - 1;
             strcpy(res->value, str);
             return res;
@@ -199,15 +305,28 @@ LvString* lv_tb_getString(TextBufferObj* obj) {
             static char str[] = "return";
             res = lv_alloc(sizeof(LvString) + sizeof(str));
             res->refCount = 0;
+            res->hash = 0;
             res->len = sizeof(str) - 1;
             strcpy(res->value, str);
             return res;
         }
+        case OPT_DISPATCH: {
+            static char str[] = "dispatch ";
+            size_t len = length(obj->dispatch->param) + sizeof(str) - 1;
+            res = lv_alloc(sizeof(LvString) + len + 1);
+            res->refCount = 0;
+            res->hash = 0;
+            res->len = len;
+            strcpy(res->value, str);
+            sprintf(res->value + sizeof(str) - 1, "%d", obj->dispatch->param);
+            return res;
+        }
         case OPT_BEQZ: {
             static char str[] = "beqz ";
             size_t len = length(obj->branchAddr) + sizeof(str) - 1;
             res = lv_alloc(sizeof(LvString) + len + sizeof(str));
             res->refCount = 0;
+            res->hash = 0;
             res->len = len;
             strcpy(res->value, str);
             sprintf(res->value + sizeof(str) - 1, "%d", obj->branchAddr);
@@ -217,6 +336,7 @@ LvString* lv_tb_getString(TextBufferObj* obj) {
             static char str[] = "<internal operator>";
             res = lv_alloc(sizeof(LvString) + sizeof(str));
             res->refCount = 0;
+            res->hash = 0;
             res->len = sizeof(str) - 1;
             strcpy(res->value, str);
             return res;
@@ -226,12 +346,19 @@ LvString* lv_tb_getString(TextBufferObj* obj) {
 
 static void rollback(Operator* decl, size_t top) {
 
-    lv_op_removeOperator(decl->name,
-        decl->fixing == FIX_PRE ? FNS_PREFIX : FNS_INFIX);
+    //calls of a deferred function may already be compiled, so it stays
+    if(decl != deferredDecl)
+        lv_op_removeOperator(decl->name,
+            decl->fixing == FIX_PRE ? FNS_PREFIX : FNS_INFIX);
+    //deferred bodies defined while parsing stay
+    if(top < keepTop)
+        top = keepTop;
     //reset the text buffer
     for(size_t i = top; i < textBufferTop; i++) {
         if(TEXT_BUFFER[i].type == OPT_STRING)
             lv_free(TEXT_BUFFER[i].str);
+        else if(TEXT_BUFFER[i].type == OPT_DISPATCH)
+            lv_free(TEXT_BUFFER[i].dispatch);
     }
     textBufferTop = top;
 }
@@ -256,7 +383,208 @@ Token* lv_tb_defineFunction(Token* head, Operator* scope, Operator** res) {
     return head;
 }
 
-static bool parseFunctionLocals(Operator* decl);
+static bool parseFunctionLocals(Operator* decl, size_t* bgn);
+
+/**
+ * Turns the last read of each parameter in a function body into a move.
+ * Nothing reads the parameters after a body returns, so the reference
+ * held by the frame can be given to the consumer of the value. Builtins
+ * may then update uniquely referenced strings and vects in place.
+ */
+static void moveLastUses(TextBufferObj* text, size_t len, Operator* decl) {
+
+    int numParams = decl->arity + decl->locals;
+    bool seen[numParams + 1];
+    memset(seen, 0, sizeof(seen));
+    for(size_t i = len; i > 0; i--) {
+        TextBufferObj* obj = &text[i - 1];
+        if(obj->type == OPT_PARAM && !seen[obj->param]) {
+            seen[obj->param] = true;
+            obj->type = OPT_MOVE_PARAM;
+        }
+    }
+}
+
+//returns the slot holding func, or the empty slot where it belongs
+static size_t findSlot(LvDispatch* table, Operator* func) {
+
+    size_t i = (size_t)(((uintptr_t)func * 0x9e3779b97f4a7c15) >> 32) & table->mask;
+    while(table->slot[i].func && table->slot[i].func != func)
+        i = (i + 1) & table->mask;
+    return i;
+}
+
+int lv_tb_dispatch(LvDispatch* table, Operator* func) {
+
+    size_t i = findSlot(table, func);
+    return table->slot[i].func ? table->slot[i].branchAddr : table->missAddr;
+}
+
+/**
+ * Returns whether the condition starting at the given index
+ * has the form param = \func. Function values are only equal
+ * to themselves, so the conditions in a run of these can be
+ * decided together by looking the param up in a table.
+ */
+static bool isDispatchCond(size_t i) {
+
+    TextBufferObj* cond = &TEXT_BUFFER[i];
+    return cond[0].type == OPT_PARAM
+        && cond[1].type == OPT_FUNCTION_VAL
+        && cond[2].type == OPT_FUNCTION
+        && (strcmp(cond[2].func->name, "global:=") == 0
+            || strcmp(cond[2].func->name, "sys:__eq__") == 0)
+        && cond[3].type == OPT_BEQZ;
+}
+
+//returns the index of the condition checked after the one at i
+static size_t nextCond(size_t i) {
+
+    while(TEXT_BUFFER[i].type != OPT_BEQZ)
+        i++;
+    return i + TEXT_BUFFER[i].branchAddr;
+}
+
+/**
+ * Builds the jump table for the given run of conditions. Conditions
+ * are matched in order, so a function listed twice selects its
+ * first body. Functions not listed jump to miss.
+ */
+static LvDispatch* mkDispatch(size_t* run, int len, size_t miss) {
+
+    size_t size = 4;
+    while(size < 2 * (size_t)len)
+        size <<= 1;
+    LvDispatch* table = lv_alloc(sizeof(LvDispatch) + size * sizeof(table->slot[0]));
+    table->param = TEXT_BUFFER[run[0]].param;
+    table->missAddr = miss - run[0];
+    table->mask = size - 1;
+    for(size_t i = 0; i < size; i++)
+        table->slot[i].func = NULL;
+    for(int i = 0; i < len; i++) {
+        Operator* func = TEXT_BUFFER[run[i] + 1].func;
+        size_t s = findSlot(table, func);
+        if(!table->slot[s].func) {
+            table->slot[s].func = func;
+            //the body follows the branch of the condition
+            table->slot[s].branchAddr = run[i] + 4 - run[0];
+        }
+    }
+    return table;
+}
+
+/**
+ * Replaces runs of conditions of the form param = \func with a jump
+ * table, so that object-like functions select the body for a message
+ * in constant time. The table replaces the param load of the first
+ * condition in the run. If the param does not hold a plain function
+ * value it loads the param instead, and the conditions run as usual.
+ * This assumes that = is not overridden for the function values in
+ * conditions, which holds for the message names objects respond to.
+ */
+static void compileDispatch(size_t cond, int count) {
+
+    while(count > 0) {
+        if(!isDispatchCond(cond)) {
+            cond = nextCond(cond);
+            count--;
+            continue;
+        }
+        size_t run[count];
+        int len = 0;
+        int param = TEXT_BUFFER[cond].param;
+        while(count > 0 && isDispatchCond(cond) && TEXT_BUFFER[cond].param == param) {
+            run[len++] = cond;
+            cond = nextCond(cond);
+            count--;
+        }
+        if(len > 1) {
+            TextBufferObj obj = { .type = OPT_DISPATCH, .dispatch = mkDispatch(run, len, cond) };
+            TEXT_BUFFER[run[0]] = obj;
+        }
+    }
+}
+
+static bool isParam(TextBufferObj* obj) {
+
+    return obj->type == OPT_PARAM || obj->type == OPT_MOVE_PARAM;
+}
+
+//literals which are not object-like
+static bool isLiteral(TextBufferObj* obj) {
+
+    return obj->type == OPT_NUMBER || obj->type == OPT_INTEGER || obj->type == OPT_STRING;
+}
+
+//returns whether obj calls a builtin with the given fixed arity
+static bool isBuiltinCall(TextBufferObj* obj, int arity) {
+
+    return obj->type == OPT_FUNCTION
+        && obj->func->type == FUN_BUILTIN
+        && obj->func->arity == arity
+        && !obj->func->varargs;
+}
+
+static ArithOp arithOf(Operator* func) {
+
+    static const struct { char* name; ArithOp arith; } ops[] = {
+        { "sys:__add__", ARITH_ADD },
+        { "sys:__sub__", ARITH_SUB },
+        { "sys:__mul__", ARITH_MUL },
+        { "sys:__div__", ARITH_DIV },
+        { "sys:__lt__", ARITH_LT },
+        { "sys:__ge__", ARITH_GE },
+    };
+    for(size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if(strcmp(func->name, ops[i].name) == 0)
+            return ops[i].arith;
+    }
+    return ARITH_NONE;
+}
+
+/**
+ * Fuses common instruction sequences in the given range into
+ * superinstructions. Only the type of the first instruction is
+ * changed; the fused instruction reads the rest of the sequence
+ * as operands and skips over it, so branch addresses stay valid.
+ * No sequence spans a branch target, since every target follows
+ * a branch or a return. Run with -profile to find new candidates.
+ * Other calls of arity 1 and 2 builtins are specialized to call
+ * the builtin directly, with typed fast paths for arithmetic.
+ */
+static void fuseInstructions(size_t bgn, size_t end) {
+
+    for(size_t i = bgn; i < end; i++) {
+        TextBufferObj* inst = &TEXT_BUFFER[i];
+        if(isBuiltinCall(inst, 1)) {
+            inst->type = OPT_BUILTIN1;
+            continue;
+        } else if(isBuiltinCall(inst, 2)) {
+            inst->arith = arithOf(inst->func);
+            inst->type = inst->arith ? OPT_ARITH : OPT_BUILTIN2;
+            continue;
+        }
+        if(i + 2 >= end || !isParam(&inst[0]))
+            continue;
+        if((isParam(&inst[1]) || isLiteral(&inst[1]) || inst[1].type == OPT_FUNCTION_VAL)
+            && isBuiltinCall(&inst[2], 2)) {
+            //param, operand, builtin
+            inst[2].arith = arithOf(inst[2].func);
+            inst[0].type = inst[0].type == OPT_PARAM ? OPT_PARAM_CALL2 : OPT_MOVE_CALL2;
+            i += 2;
+        } else if(inst[0].type == OPT_PARAM
+            && i + 3 < end
+            && isLiteral(&inst[1])
+            && inst[2].type == OPT_FUNCTION
+            && (strcmp(inst[2].func->name, "global:=") == 0
+                || strcmp(inst[2].func->name, "sys:__eq__") == 0)
+            && inst[3].type == OPT_BEQZ) {
+            //compare and branch
+            inst[0].type = OPT_PARAM_BNE;
+            i += 3;
+        }
+    }
+}
 
 Token* lv_tb_defineFunctionBody(Token* head, Operator* decl) {
 
@@ -271,6 +599,9 @@ Token* lv_tb_defineFunctionBody(Token* head, Operator* decl) {
     //the value requires modification if there are
     //nested functions within this piecewise function
     size_t prevCondBranch = 0;
+    //the first condition and the number of conditions
+    size_t firstCond = 0;
+    int numConds = 0;
     if(isExprEnd(head)) {
         //no empty bodies allowed
         LV_EXPR_ERROR = XPE_MISSING_BODY;
@@ -278,7 +609,7 @@ Token* lv_tb_defineFunctionBody(Token* head, Operator* decl) {
         return NULL;
     }
     //parse function local initializers (if any)
-    setbgn = parseFunctionLocals(decl);
+    setbgn = parseFunctionLocals(decl, &fbgn);
     if(LV_EXPR_ERROR) {
         rollback(decl, top);
         return NULL;
@@ -337,6 +668,8 @@ Token* lv_tb_defineFunctionBody(Token* head, Operator* decl) {
                     fbgn = textBufferTop;
                     setbgn = true;
                 }
+                if(numConds++ == 0)
+                    firstCond = textBufferTop;
                 pushText(cond + 1, clen - 1);
                 pushText(&end, 1);
                 prevCondBranch = textBufferTop - 1;
@@ -378,6 +711,7 @@ Token* lv_tb_defineFunctionBody(Token* head, Operator* decl) {
             fbgn = textBufferTop;
             setbgn = true;
         }
+        moveLastUses(text + 1, len - 1, decl);
         pushText(text + 1, len - 1);
         end.type = OPT_RETURN;
         pushText(&end, 1);
@@ -388,6 +722,7 @@ Token* lv_tb_defineFunctionBody(Token* head, Operator* decl) {
             //set the last conditional branch
             TEXT_BUFFER[prevCondBranch].branchAddr = textBufferTop - prevCondBranch;
         }
+        compileDispatch(firstCond, numConds);
         //push the default case (return undefined)
         TextBufferObj nan[2];
         nan[0].type = OPT_UNDEFINED;
@@ -398,12 +733,13 @@ Token* lv_tb_defineFunctionBody(Token* head, Operator* decl) {
     for(int i = 0; i < (decl->arity + decl->locals); i++)
         lv_free(decl->params[i].name);
     lv_free(decl->params);
+    fuseInstructions(top, textBufferTop);
     //set out param value
     decl->type = FUN_FUNCTION;
     decl->textOffset = fbgn;
     if(lv_debug) {
         //print function info
-        printf("Function name=%s, arity=%d, capture=%d, locals=%d, fixing=%c, varargs=%s, offset=%u\n",
+        fprintf(lv_out, "Function name=%s, arity=%d, capture=%d, locals=%d, fixing=%c, varargs=%s, offset=%u\n",
             decl->name,
             decl->arity,
             decl->captureCount,
@@ -413,7 +749,7 @@ Token* lv_tb_defineFunctionBody(Token* head, Operator* decl) {
             decl->textOffset);
         for(size_t i = decl->textOffset; i < textBufferTop; i++) {
             LvString* str = lv_tb_getString(&TEXT_BUFFER[i]);
-            printf("%lu: type=%d, value=%s\n",
+            fprintf(lv_out, "%lu: type=%d, value=%s\n",
                 i,
                 TEXT_BUFFER[i].type,
                 str->value);
@@ -428,9 +764,9 @@ Token* lv_tb_defineFunctionBody(Token* head, Operator* decl) {
  * Parses each function local initializer and places the code in sequence
  * before the function proper. The value of the initializer expression
  * is placed into the function local positions using the PUT operation.
- * Returns whether locals were parsed.
+ * Returns whether locals were parsed, and sets bgn to the start of the code.
  */
-static bool parseFunctionLocals(Operator* decl) {
+static bool parseFunctionLocals(Operator* decl, size_t* bgn) {
 
     assert(decl->type == FUN_FWD_DECL);
     if(decl->locals == 0) {
@@ -468,6 +804,7 @@ static bool parseFunctionLocals(Operator* decl) {
         assert(startOfInit->value[0] == ')');
     }
     //push initializer and put operation
+    *bgn = textBufferTop;
     for(size_t i = 0; i < decl->locals; i++) {
         pushText(initializers[i].code + 1, initializers[i].len - 1);
         lv_free(initializers[i].code);
@@ -482,7 +819,82 @@ static bool parseFunctionLocals(Operator* decl) {
     return true;
 }
 
+void lv_tb_deferFunctionBody(Token* tokens, Token* body, Operator* decl, char* file, size_t line) {
+
+    LvLazyBody* lazy = lv_alloc(sizeof(LvLazyBody));
+    lazy->tokens = tokens;
+    lazy->body = body;
+    lazy->env = lv_cmd_saveEnv();
+    lazy->file = file;
+    lazy->line = line;
+    size_t len = 0;
+    for(Token* tok = body; tok && len <= SHORT_BODY_LEN; tok = tok->next)
+        len++;
+    lazy->isShort = len <= SHORT_BODY_LEN;
+    decl->lazy = lazy;
+}
+
+/**
+ * Defines the declared function to return undefined. Used when its
+ * deferred body has an error, since calls of it may already be compiled.
+ */
+static void defineUndefined(Operator* decl) {
+
+    TextBufferObj nan[2];
+    nan[0].type = OPT_UNDEFINED;
+    nan[1].type = OPT_RETURN;
+    for(int i = 0; i < (decl->arity + decl->locals); i++)
+        lv_free(decl->params[i].name);
+    lv_free(decl->params);
+    decl->type = FUN_FUNCTION;
+    decl->textOffset = textBufferTop;
+    pushText(nan, 2);
+}
+
+bool lv_tb_defineDeferred(Operator* decl) {
+
+    LvLazyBody* lazy = decl->lazy;
+    assert(lazy && !LV_EXPR_ERROR);
+    //the body is parsed with the function still declared,
+    //so it is neither inlined nor defined again meanwhile
+    decl->lazy = NULL;
+    Operator* outer = deferredDecl;
+    deferredDecl = decl;
+    lv_cmd_enterEnv(lazy->env);
+    lv_tb_defineFunctionBody(lazy->body, decl);
+    lv_cmd_leaveEnv();
+    deferredDecl = outer;
+    bool res = !LV_EXPR_ERROR;
+    if(!res) {
+        //the error is only found when the function is first used,
+        //so say where it was defined
+        fprintf(lv_out, "Error parsing function body of %s (%s.lv, line %zu): %s\n",
+            decl->name, lazy->file, lazy->line, lv_expr_getError(LV_EXPR_ERROR));
+        LV_EXPR_ERROR = 0;
+        defineUndefined(decl);
+    }
+    lv_tb_freeLazyBody(lazy);
+    keepTop = textBufferTop;
+    return res;
+}
+
+void lv_tb_defineIfShort(Operator* decl) {
+
+    if(decl->lazy && decl->lazy->isShort)
+        lv_tb_defineDeferred(decl);
+}
+
+void lv_tb_freeLazyBody(LvLazyBody* lazy) {
+
+    if(!lazy)
+        return;
+    lv_tkn_free(lazy->tokens);
+    lv_cmd_releaseEnv(lazy->env);
+    lv_free(lazy);
+}
+
 static size_t startOfTmpExpr;
+static size_t endOfTmpExpr;
 
 Token* lv_tb_parseExpr(Token* tokens, Operator* scope, size_t* start, size_t* end) {
 
@@ -497,14 +909,22 @@ Token* lv_tb_parseExpr(Token* tokens, Operator* scope, size_t* start, size_t* en
     pushText(tmp + 1, tlen - 1);
     lv_free(tmp);
     *start = startOfTmpExpr;
-    *end = textBufferTop;
+    *end = endOfTmpExpr = textBufferTop;
     return ret;
 }
 
 void lv_tb_clearExpr(void) {
 
-    lv_expr_cleanup(TEXT_BUFFER + startOfTmpExpr, textBufferTop - startOfTmpExpr);
-    textBufferTop = startOfTmpExpr;
+    if(keepTop > startOfTmpExpr) {
+        //deferred bodies were defined while the expression
+        //ran, so its text is left behind as dead code
+        size_t len = endOfTmpExpr - startOfTmpExpr;
+        lv_expr_cleanup(TEXT_BUFFER + startOfTmpExpr, len);
+        memset(TEXT_BUFFER + startOfTmpExpr, 0, len * sizeof(TextBufferObj));
+    } else {
+        lv_expr_cleanup(TEXT_BUFFER + startOfTmpExpr, textBufferTop - startOfTmpExpr);
+        textBufferTop = startOfTmpExpr;
+    }
     startOfTmpExpr = textBufferTop;
 }
 
@@ -514,6 +934,7 @@ void lv_tb_onStartup(void) {
     memset(TEXT_BUFFER, 0, INIT_TEXT_BUFFER_LEN * sizeof(TextBufferObj));
     textBufferLen = INIT_TEXT_BUFFER_LEN;
     textBufferTop = 0;
+    keepTop = 0;
     startOfTmpExpr = 0;
 }
 
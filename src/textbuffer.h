@@ -4,6 +4,7 @@
 #include "operator_fwd.h"
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 /**
  * Lavender's built in string object.
@@ -11,29 +12,58 @@
 struct LvString {
     size_t refCount;
     size_t len;
+    uint64_t hash;      //0 until computed, see lv_blt_hash
     char value[];
 };
 
+//refCount of a string mapped from a file with no references, see
+//lv_in_mapFile. Counting only changes the low bits, so a mapped
+//string is never freed or updated in place like a unique one.
+#define LV_STR_MAPPED ((size_t)1 << 56)
+
+/**
+ * Builtins with fast paths for two numbers or two ints.
+ * Other operand types call the builtin.
+ */
+typedef enum ArithOp {
+    ARITH_NONE,
+    ARITH_ADD,  //sys:__add__
+    ARITH_SUB,  //sys:__sub__
+    ARITH_MUL,  //sys:__mul__
+    ARITH_DIV,  //sys:__div__
+    ARITH_LT,   //sys:__lt__
+    ARITH_GE,   //sys:__ge__
+} ArithOp;
+
+//combines two operand types into a single tag
+#define TYPE_PAIR(a, b) (((a) << 6) | (b))
+
 /**
  * A struct that stores a Lavender value. This may
  * be a number, string, function, etc. These values
- * are stored in the global text buffer.
+ * are stored in the global text buffer. Every instruction
+ * and stack slot is one of these, so it is kept to 16
+ * bytes: a type byte, an int operand, and the union.
  */
 struct TextBufferObj {
-    OpType type;
+    OpType type : 8;
+    bool borrowed;  //stack slots only, see lv_isBorrowed
+    int arith;      //ArithOp of builtin calls
     union {
         double number;
         uint64_t integer;
         LvString* str;
         LvVect* vect;
+        LvMap* map;
         int param;
         Operator* func;
+        CaptureObj* capture;
         struct {
-            CaptureObj* capture;
-            Operator* capfunc;
+            int callArity;
+            int callSite;   //index of the call's inline cache + 1
         };
-        int callArity;
         int branchAddr;
+        LvDispatch* dispatch;
         size_t addr;
         char literal;
         size_t* refCount; //aliases (dynamic obj)->refCount
@@ -48,16 +78,51 @@ struct TextBufferObj {
  */
 struct CaptureObj {
     size_t refCount;
+    Operator* func;
     TextBufferObj value[];
 };
 
 /**
- * Vector object.
+ * Vector object. Small vects are flat and store their
+ * elements in data. Large vects store their elements in
+ * a persistent tree, except for the last few elements,
+ * which are kept in data (the tail). See vect.h.
  */
 struct LvVect {
     size_t refCount;
     size_t len;
+    uint64_t hash;      //0 until computed, see lv_blt_hash
+    LvVectNode* root;   //NULL for flat vects
+    unsigned shift;     //index bits below the root level
+    unsigned tailLen;   //elements in data (tree vects)
     TextBufferObj data[];
 };
 
+/**
+ * Hash map object. The entries are stored in a
+ * persistent hash trie. See hashmap.h.
+ */
+struct LvMap {
+    size_t refCount;
+    size_t len;
+    LvMapNode* root;    //NULL for the empty map
+};
+
+/**
+ * Jump table for a run of conditions of the form
+ * param = \func in a piecewise function. Slots are
+ * hashed by function and hold the relative address of
+ * the body to run. Functions not in the table jump to
+ * the condition following the run.
+ */
+struct LvDispatch {
+    int param;
+    int missAddr;
+    size_t mask;        //number of slots - 1
+    struct {
+        Operator* func; //NULL for an empty slot
+        int branchAddr;
+    } slot[];
+};
+
 #endif
@@ -21,6 +21,14 @@ typedef enum OpType {
     OPT_MAKE_VECT,      //make vector from args
     OPT_RETURN,         //return from function
     OPT_BEQZ,           //relative branch if zero
+    OPT_MOVE_PARAM,     //move i'th param to the top (last use)
+    OPT_DISPATCH,       //jump table on the function value in a param
+    OPT_PARAM_CALL2,    //param, operand, builtin call (fused)
+    OPT_MOVE_CALL2,     //move, operand, builtin call (fused)
+    OPT_PARAM_BNE,      //param, literal, =, beqz (fused)
+    OPT_BUILTIN1,       //call arity 1 builtin on the top
+    OPT_BUILTIN2,       //call arity 2 builtin on the top two
+    OPT_ARITH,          //typed arithmetic or comparison builtin
     OPT_ADDR,           //internal address (not present in text buffer)
     OPT_LITERAL,        //literal value (not present in final code)
     OPT_EMPTY_ARGS,     //empty args placeholder (not present in final code)
@@ -28,12 +36,17 @@ typedef enum OpType {
         LV_DYNAMIC,     //Lavender string
     OPT_VECT,           //Lavender vector
     OPT_CAPTURE,        //function value with captured params
+    OPT_MAP,            //Lavender hash map
 } OpType;
 
 typedef struct TextBufferObj TextBufferObj;
 typedef struct CaptureObj CaptureObj;
 typedef struct LvString LvString;
 typedef struct LvVect LvVect;
+typedef struct LvVectNode LvVectNode;
+typedef struct LvMap LvMap;
+typedef struct LvMapNode LvMapNode;
+typedef struct LvDispatch LvDispatch;
 
 TextBufferObj* TEXT_BUFFER;
 
@@ -43,6 +56,12 @@ TextBufferObj* TEXT_BUFFER;
  */
 LvString* lv_tb_getString(TextBufferObj* obj);
 
+/**
+ * Returns the relative address of the body selected by
+ * the given function value in the dispatch table.
+ */
+int lv_tb_dispatch(LvDispatch* table, Operator* func);
+
 /**
  * Defines the function described by the given token
  * sequence in the given scope. Returns a pointer to
@@ -59,6 +78,30 @@ Token* lv_tb_defineFunction(Token* tokens, Operator* scope, Operator** res);
  */
 Token* lv_tb_defineFunctionBody(Token* tokens, Operator* decl);
 
+/**
+ * Saves the body of the declared function to be defined when the
+ * function is first used, along with the names visible to it now.
+ * Takes ownership of the tokens of the definition. The module name
+ * and line of the definition are kept to report errors in the body,
+ * so the name must outlive the function.
+ */
+void lv_tb_deferFunctionBody(Token* tokens, Token* body, Operator* decl, char* file, size_t line);
+
+/**
+ * Defines the function with its deferred body. An error in the
+ * body is reported, the function is defined to return undefined,
+ * and false is returned.
+ */
+bool lv_tb_defineDeferred(Operator* decl);
+
+/**
+ * Defines the function with its deferred body if the body is short
+ * enough that the function may be inlined into its callers.
+ */
+void lv_tb_defineIfShort(Operator* decl);
+
+void lv_tb_freeLazyBody(LvLazyBody* lazy);
+
 /**
  * Parses the given expression and adds it to the text buffer temporarily.
  * The start index of the expression is returned through out param startIdx.
@@ -6,6 +6,10 @@
 #include <ctype.h>
 #include <assert.h>
 
+_Thread_local TokenError LV_TKN_ERROR;
+_Thread_local char lv_tkn_errcxt[TKN_ERRCXT_LEN];
+_Thread_local size_t lv_tkn_lines;
+
 static TokenType tryGetFuncSymb(void);
 static TokenType tryGetQualName(void);
 static TokenType tryGetEllipsis(void);
@@ -43,15 +47,16 @@ void lv_tkn_free(Token* head) {
     }
 }
 
-static bool inputEnd = false;
-static size_t BUFFER_LEN;
-static char* buffer;
-static int bgn; //start pos of the current token
-static int idx; //current index in the buffer
-static FILE* input;
-static int bracketNesting; //bracket nesting
-static int parenNesting; //paren nesting
-static int braceNesting; //curly brace nesting
+//state of the split on this thread
+static _Thread_local bool inputEnd = false;
+static _Thread_local size_t BUFFER_LEN;
+static _Thread_local char* buffer;
+static _Thread_local int bgn; //start pos of the current token
+static _Thread_local int idx; //current index in the buffer
+static _Thread_local FILE* input;
+static _Thread_local int bracketNesting; //bracket nesting
+static _Thread_local int parenNesting; //paren nesting
+static _Thread_local int braceNesting; //curly brace nesting
 
 static bool reallocBuffer(void);
 
@@ -119,7 +124,8 @@ static void eatComment(void) {
 
 static void fgetsWrapper(char* buf, int n, FILE* stream) {
 
-    fgets(buf, n, stream);
+    if(fgets(buf, n, stream) && buf[0] && buf[strlen(buf) - 1] == '\n')
+        lv_tkn_lines++;
     //if there was a NUL character in the text stream that got added into
     //the buffer, the lexing code will get confused about the amount of
     //text read. To remedy this, we find NUL characters that are not at
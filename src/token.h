@@ -36,8 +36,14 @@ typedef enum TokenError {
 } TokenError;
 
 #define TKN_ERRCXT_LEN 8
-TokenError LV_TKN_ERROR;
-char lv_tkn_errcxt[TKN_ERRCXT_LEN];
+//thread local, since imported files are split on worker
+//threads (see prefetch.h). Defined in token.c, as thread
+//local variables cannot be common symbols.
+extern _Thread_local TokenError LV_TKN_ERROR;
+extern _Thread_local char lv_tkn_errcxt[TKN_ERRCXT_LEN];
+//lines read by lv_tkn_split on this thread, so callers may
+//find the line each statement starts on. Reset by callers.
+extern _Thread_local size_t lv_tkn_lines;
 
 /**
  * Retrieves an error message for the specified error.
@@ -48,6 +54,7 @@ char* lv_tkn_getError(TokenError err);
  * Splits the input string into tokens.
  * Returns a linked list of tokens.
  * Sets LV_TOK_ERROR and returns NULL if an error occurred.
+ * May be called on several threads at once.
  */
 Token* lv_tkn_split(FILE* input);
 
@@ -0,0 +1,575 @@
+#include "vect.h"
+#include "lavender.h"
+#include "expression.h"
+#include "gc.h"
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+
+static void incRefCount(TextBufferObj* obj) {
+
+    if(obj->type & LV_DYNAMIC)
+        ++*obj->refCount;
+}
+
+/**
+ * Allocates a leaf holding the given elements. The leaf
+ * gets its own reference to each element.
+ */
+static LvVectNode* mkLeaf(TextBufferObj* elems, unsigned count) {
+
+    assert(count <= LV_VECT_WIDTH);
+    LvVectNode* res = lv_alloc(offsetof(LvVectNode, elem) + count * sizeof(TextBufferObj));
+    res->refCount = 1;
+    res->count = count;
+    for(unsigned i = 0; i < count; i++) {
+        res->elem[i] = elems[i];
+        incRefCount(&res->elem[i]);
+    }
+    return res;
+}
+
+/**
+ * Allocates an inner node with no children.
+ */
+static LvVectNode* mkInner(void) {
+
+    LvVectNode* res = lv_alloc(offsetof(LvVectNode, child) + LV_VECT_WIDTH * sizeof(LvVectNode*));
+    res->refCount = 1;
+    res->count = 0;
+    return res;
+}
+
+static LvVectNode* retain(LvVectNode* node) {
+
+    node->refCount++;
+    return node;
+}
+
+/**
+ * Releases a reference to the node at the given level.
+ */
+static void release(LvVectNode* node, unsigned shift) {
+
+    assert(node->refCount);
+    if(--node->refCount == 0) {
+        if(shift == 0) {
+            lv_expr_cleanup(node->elem, node->count);
+        } else {
+            for(unsigned i = 0; i < node->count; i++)
+                release(node->child[i], shift - LV_VECT_BITS);
+        }
+        lv_free(node);
+    }
+}
+
+static size_t nodeSize(LvVectNode* node, unsigned shift) {
+
+    return shift == 0 ? node->count : node->sizes[node->count - 1];
+}
+
+/**
+ * Recomputes the cumulative child sizes of an inner node.
+ */
+static void fixSizes(LvVectNode* node, unsigned shift) {
+
+    size_t total = 0;
+    for(unsigned i = 0; i < node->count; i++) {
+        total += nodeSize(node->child[i], shift - LV_VECT_BITS);
+        node->sizes[i] = total;
+    }
+}
+
+/**
+ * Returns the index of the child of an inner node that contains
+ * the given element index. No child holds more than 2^shift
+ * elements, so the radix index is a lower bound and is exact
+ * for densely packed nodes.
+ */
+static unsigned childIndex(LvVectNode* node, unsigned shift, size_t idx) {
+
+    unsigned i = idx >> shift;
+    while(node->sizes[i] <= idx)
+        i++;
+    assert(i < node->count);
+    return i;
+}
+
+static LvVectNode* copyInner(LvVectNode* node) {
+
+    LvVectNode* res = mkInner();
+    res->count = node->count;
+    for(unsigned i = 0; i < node->count; i++) {
+        res->child[i] = retain(node->child[i]);
+        res->sizes[i] = node->sizes[i];
+    }
+    return res;
+}
+
+/**
+ * Wraps the node in single child parents until it is at the
+ * level given by to. Takes the reference to the node.
+ */
+static LvVectNode* wrap(LvVectNode* node, unsigned from, unsigned to) {
+
+    while(from < to) {
+        LvVectNode* parent = mkInner();
+        parent->count = 1;
+        parent->child[0] = node;
+        parent->sizes[0] = nodeSize(node, from);
+        node = parent;
+        from += LV_VECT_BITS;
+    }
+    return node;
+}
+
+/**
+ * Builds a densely packed tree of the given elements.
+ */
+static LvVectNode* build(TextBufferObj* elems, size_t len, unsigned* shift) {
+
+    assert(len > 0);
+    size_t count = (len + LV_VECT_WIDTH - 1) / LV_VECT_WIDTH;
+    LvVectNode** level = lv_alloc(count * sizeof(LvVectNode*));
+    for(size_t i = 0; i < count; i++) {
+        size_t n = len - i * LV_VECT_WIDTH;
+        level[i] = mkLeaf(elems + i * LV_VECT_WIDTH, n < LV_VECT_WIDTH ? n : LV_VECT_WIDTH);
+    }
+    unsigned sh = 0;
+    while(count > 1) {
+        sh += LV_VECT_BITS;
+        size_t parents = (count + LV_VECT_WIDTH - 1) / LV_VECT_WIDTH;
+        //parent p only reads nodes at or after p, so build in place
+        for(size_t p = 0; p < parents; p++) {
+            LvVectNode* node = mkInner();
+            size_t n = count - p * LV_VECT_WIDTH;
+            node->count = n < LV_VECT_WIDTH ? n : LV_VECT_WIDTH;
+            memcpy(node->child, level + p * LV_VECT_WIDTH, node->count * sizeof(LvVectNode*));
+            fixSizes(node, sh);
+            level[p] = node;
+        }
+        count = parents;
+    }
+    LvVectNode* res = level[0];
+    lv_free(level);
+    *shift = sh;
+    return res;
+}
+
+/**
+ * Returns a copy of the node with the leaf added after its last
+ * element, or NULL if there is no room. Takes the reference to the
+ * leaf only on success.
+ */
+static LvVectNode* pushLeaf(LvVectNode* node, unsigned shift, LvVectNode* leaf) {
+
+    LvVectNode* last = NULL;
+    if(shift > LV_VECT_BITS)
+        last = pushLeaf(node->child[node->count - 1], shift - LV_VECT_BITS, leaf);
+    if(!last && node->count == LV_VECT_WIDTH)
+        return NULL;
+    LvVectNode* res = copyInner(node);
+    if(last) {
+        release(res->child[res->count - 1], shift - LV_VECT_BITS);
+        res->child[res->count - 1] = last;
+    } else {
+        res->child[res->count++] = wrap(leaf, 0, shift - LV_VECT_BITS);
+    }
+    fixSizes(res, shift);
+    return res;
+}
+
+/**
+ * Returns a new root with the leaf added after the last element
+ * of the given root, updating shift if the tree grows.
+ */
+static LvVectNode* pushTail(LvVectNode* root, unsigned* shift, LvVectNode* leaf) {
+
+    LvVectNode* res = *shift ? pushLeaf(root, *shift, leaf) : NULL;
+    if(!res) {
+        res = mkInner();
+        res->count = 2;
+        res->child[0] = retain(root);
+        res->child[1] = wrap(leaf, 0, *shift);
+        *shift += LV_VECT_BITS;
+        fixSizes(res, *shift);
+    }
+    return res;
+}
+
+/**
+ * Concatenates two nodes at the same level by merging the right
+ * edge of l with the left edge of r. Returns a node one level up
+ * with one or two children.
+ */
+static LvVectNode* concatSub(LvVectNode* l, LvVectNode* r, unsigned shift) {
+
+    LvVectNode* res = mkInner();
+    if(shift == 0) {
+        unsigned total = l->count + r->count;
+        if(l->count == LV_VECT_WIDTH) {
+            //already dense
+            res->count = 2;
+            res->child[0] = retain(l);
+            res->child[1] = retain(r);
+        } else {
+            //pack the elements to the left
+            TextBufferObj tmp[2 * LV_VECT_WIDTH];
+            memcpy(tmp, l->elem, l->count * sizeof(TextBufferObj));
+            memcpy(tmp + l->count, r->elem, r->count * sizeof(TextBufferObj));
+            if(total <= LV_VECT_WIDTH) {
+                res->count = 1;
+                res->child[0] = mkLeaf(tmp, total);
+            } else {
+                res->count = 2;
+                res->child[0] = mkLeaf(tmp, LV_VECT_WIDTH);
+                res->child[1] = mkLeaf(tmp + LV_VECT_WIDTH, total - LV_VECT_WIDTH);
+            }
+        }
+    } else {
+        LvVectNode* mid = concatSub(l->child[l->count - 1], r->child[0], shift - LV_VECT_BITS);
+        LvVectNode* all[2 * LV_VECT_WIDTH];
+        unsigned n = 0;
+        for(unsigned i = 0; i < l->count - 1; i++)
+            all[n++] = retain(l->child[i]);
+        for(unsigned i = 0; i < mid->count; i++)
+            all[n++] = retain(mid->child[i]);
+        for(unsigned i = 1; i < r->count; i++)
+            all[n++] = retain(r->child[i]);
+        release(mid, shift);
+        //split the children evenly if they do not fit in one node
+        unsigned split = n <= LV_VECT_WIDTH ? n : (n + 1) / 2;
+        for(unsigned start = 0; start < n; start += split) {
+            LvVectNode* node = mkInner();
+            node->count = n - start < split ? n - start : split;
+            memcpy(node->child, all + start, node->count * sizeof(LvVectNode*));
+            fixSizes(node, shift);
+            res->child[res->count++] = node;
+        }
+    }
+    fixSizes(res, shift + LV_VECT_BITS);
+    return res;
+}
+
+/**
+ * Concatenates two trees, setting shift to the level of the result.
+ */
+static LvVectNode* concatTrees(LvVectNode* l, unsigned ls, LvVectNode* r, unsigned rs, unsigned* shift) {
+
+    unsigned sh = ls > rs ? ls : rs;
+    LvVectNode* wl = wrap(retain(l), ls, sh);
+    LvVectNode* wr = wrap(retain(r), rs, sh);
+    LvVectNode* res = concatSub(wl, wr, sh);
+    release(wl, sh);
+    release(wr, sh);
+    if(res->count == 1) {
+        LvVectNode* child = retain(res->child[0]);
+        release(res, sh + LV_VECT_BITS);
+        *shift = sh;
+        return child;
+    }
+    *shift = sh + LV_VECT_BITS;
+    return res;
+}
+
+/**
+ * Returns a node holding the elements of node in [from, to).
+ * Children entirely within the range are shared.
+ */
+static LvVectNode* sliceNode(LvVectNode* node, unsigned shift, size_t from, size_t to) {
+
+    if(from == 0 && to == nodeSize(node, shift))
+        return retain(node);
+    if(shift == 0)
+        return mkLeaf(node->elem + from, to - from);
+    unsigned lo = childIndex(node, shift, from);
+    unsigned hi = childIndex(node, shift, to - 1);
+    LvVectNode* res = mkInner();
+    res->count = hi - lo + 1;
+    for(unsigned i = lo; i <= hi; i++) {
+        size_t base = i ? node->sizes[i - 1] : 0;
+        size_t end = to < node->sizes[i] ? to : node->sizes[i];
+        size_t start = from > base ? from : base;
+        res->child[i - lo] = sliceNode(node->child[i], shift - LV_VECT_BITS, start - base, end - base);
+    }
+    fixSizes(res, shift);
+    return res;
+}
+
+/**
+ * Returns a copy of the path to the element at idx with the
+ * element replaced by the given object.
+ */
+static LvVectNode* updateNode(LvVectNode* node, unsigned shift, size_t idx, TextBufferObj* obj) {
+
+    if(shift == 0) {
+        LvVectNode* res = mkLeaf(node->elem, node->count);
+        lv_expr_cleanup(&res->elem[idx], 1);
+        res->elem[idx] = *obj;
+        incRefCount(obj);
+        return res;
+    }
+    unsigned i = childIndex(node, shift, idx);
+    LvVectNode* res = copyInner(node);
+    release(res->child[i], shift - LV_VECT_BITS);
+    res->child[i] = updateNode(node->child[i], shift - LV_VECT_BITS, idx - (i ? node->sizes[i - 1] : 0), obj);
+    return res;
+}
+
+/**
+ * Allocates a tree vect with the given root and a copy of the
+ * given tail. Takes the reference to the root.
+ */
+static LvVect* mkTree(LvVectNode* root, unsigned shift, TextBufferObj* tail, unsigned tailLen) {
+
+    assert(tailLen <= LV_VECT_WIDTH);
+    LvVect* res = lv_alloc(sizeof(LvVect) + LV_VECT_WIDTH * sizeof(TextBufferObj));
+    res->refCount = 0;
+    res->hash = 0;
+    res->root = root;
+    res->shift = shift;
+    res->tailLen = tailLen;
+    res->len = nodeSize(root, shift) + tailLen;
+    for(unsigned i = 0; i < tailLen; i++) {
+        res->data[i] = tail[i];
+        incRefCount(&res->data[i]);
+    }
+    return res;
+}
+
+/**
+ * Returns a tree holding all elements of the vect.
+ */
+static LvVectNode* treeOf(LvVect* vect, unsigned* shift) {
+
+    if(!vect->root)
+        return build(vect->data, vect->len, shift);
+    *shift = vect->shift;
+    if(vect->tailLen == 0)
+        return retain(vect->root);
+    return pushTail(vect->root, shift, mkLeaf(vect->data, vect->tailLen));
+}
+
+/**
+ * Splits the vect into a tree and a tail of at most
+ * LV_VECT_WIDTH elements. Returns the tree, or NULL if
+ * all elements fit in the tail.
+ */
+static LvVectNode* splitTail(LvVect* vect, unsigned* shift, TextBufferObj** tail, unsigned* tailLen) {
+
+    if(vect->root) {
+        *tail = vect->data;
+        *tailLen = vect->tailLen;
+        *shift = vect->shift;
+        return retain(vect->root);
+    }
+    *tailLen = (vect->len - 1) % LV_VECT_WIDTH + 1;
+    *tail = vect->data + vect->len - *tailLen;
+    if(vect->len == *tailLen)
+        return NULL;
+    return build(vect->data, vect->len - *tailLen, shift);
+}
+
+/**
+ * Allocates a flat copy of the elements of the vect in [start, end).
+ */
+static LvVect* flatCopy(LvVect* vect, size_t start, size_t end) {
+
+    LvVect* res = lv_vect_alloc(end - start);
+    for(size_t i = start; i < end; i++) {
+        res->data[i - start] = *lv_vect_at(vect, i);
+        incRefCount(&res->data[i - start]);
+    }
+    return res;
+}
+
+LvVect* lv_vect_alloc(size_t len) {
+
+    LvVect* res = lv_alloc(sizeof(LvVect) + len * sizeof(TextBufferObj));
+    res->refCount = 0;
+    res->len = len;
+    res->hash = 0;
+    res->root = NULL;
+    res->shift = 0;
+    res->tailLen = 0;
+    return res;
+}
+
+void lv_vect_releaseElems(LvVect* self) {
+
+    if(self->root) {
+        release(self->root, self->shift);
+        lv_expr_cleanup(self->data, self->tailLen);
+    } else {
+        lv_expr_cleanup(self->data, self->len);
+    }
+}
+
+void lv_vect_free(LvVect* self) {
+
+    lv_vect_releaseElems(self);
+    lv_free(self);
+}
+
+static void markNode(LvVectNode* node, unsigned shift) {
+
+    if(!lv_gc_markNode(&node->refCount))
+        return;
+    if(shift == 0) {
+        for(unsigned i = 0; i < node->count; i++)
+            lv_gc_mark(&node->elem[i]);
+    } else {
+        for(unsigned i = 0; i < node->count; i++)
+            markNode(node->child[i], shift - LV_VECT_BITS);
+    }
+}
+
+void lv_vect_mark(LvVect* self) {
+
+    size_t len = self->len;
+    if(self->root) {
+        markNode(self->root, self->shift);
+        len = self->tailLen;
+    }
+    for(size_t i = 0; i < len; i++)
+        lv_gc_mark(&self->data[i]);
+}
+
+TextBufferObj* lv_vect_treeAt(LvVect* self, size_t idx) {
+
+    assert(idx < self->len);
+    size_t treeLen = self->len - self->tailLen;
+    if(idx >= treeLen)
+        return &self->data[idx - treeLen];
+    LvVectNode* node = self->root;
+    unsigned shift = self->shift;
+    while(shift > 0) {
+        unsigned i = childIndex(node, shift, idx);
+        if(i)
+            idx -= node->sizes[i - 1];
+        node = node->child[i];
+        shift -= LV_VECT_BITS;
+    }
+    return &node->elem[idx];
+}
+
+LvVect* lv_vect_append(LvVect* self, TextBufferObj* obj) {
+
+    LvVect* res;
+    if(!self->root && self->len < LV_VECT_FLAT_MAX) {
+        res = flatCopy(self, 0, self->len);
+        res = lv_realloc(res, sizeof(LvVect) + (self->len + 1) * sizeof(TextBufferObj));
+        res->data[res->len++] = *obj;
+        incRefCount(obj);
+    } else if(!self->root) {
+        //move every element into the tree
+        unsigned shift;
+        LvVectNode* root = build(self->data, self->len, &shift);
+        res = mkTree(root, shift, obj, 1);
+    } else if(self->tailLen < LV_VECT_WIDTH) {
+        res = mkTree(retain(self->root), self->shift, self->data, self->tailLen);
+        res->data[res->tailLen++] = *obj;
+        res->len++;
+        incRefCount(obj);
+    } else {
+        //push the full tail into the tree
+        unsigned shift = self->shift;
+        LvVectNode* root = pushTail(self->root, &shift, mkLeaf(self->data, self->tailLen));
+        res = mkTree(root, shift, obj, 1);
+    }
+    return res;
+}
+
+LvVect* lv_vect_cat(LvVect* a, LvVect* b) {
+
+    if(b->len == 0)
+        return a;
+    if(a->len == 0)
+        return b;
+    size_t len = a->len + b->len;
+    if(len <= LV_VECT_FLAT_MAX) {
+        LvVect* res = flatCopy(a, 0, a->len);
+        res = lv_realloc(res, sizeof(LvVect) + len * sizeof(TextBufferObj));
+        res->len = len;
+        for(size_t i = 0; i < b->len; i++) {
+            res->data[a->len + i] = *lv_vect_at(b, i);
+            incRefCount(&res->data[a->len + i]);
+        }
+        return res;
+    }
+    if(a->root && b->len <= LV_VECT_WIDTH - a->tailLen) {
+        //b fits in the tail of a
+        LvVect* res = mkTree(retain(a->root), a->shift, a->data, a->tailLen);
+        for(size_t i = 0; i < b->len; i++) {
+            res->data[res->tailLen] = *lv_vect_at(b, i);
+            incRefCount(&res->data[res->tailLen++]);
+        }
+        res->len = len;
+        return res;
+    }
+    unsigned ls, rs, tailLen;
+    TextBufferObj* tail;
+    LvVectNode* l = treeOf(a, &ls);
+    LvVectNode* r = splitTail(b, &rs, &tail, &tailLen);
+    LvVectNode* root = l;
+    unsigned shift = ls;
+    if(r) {
+        root = concatTrees(l, ls, r, rs, &shift);
+        release(l, ls);
+        release(r, rs);
+    }
+    return mkTree(root, shift, tail, tailLen);
+}
+
+LvVect* lv_vect_slice(LvVect* self, size_t start, size_t end) {
+
+    assert(start <= end && end <= self->len);
+    if(start == 0 && end == self->len)
+        return self;
+    if(!self->root || end - start <= LV_VECT_FLAT_MAX)
+        return flatCopy(self, start, end);
+    size_t treeLen = self->len - self->tailLen;
+    //the tail is too short to hold the whole slice
+    assert(start < treeLen);
+    unsigned shift = self->shift;
+    LvVectNode* root = sliceNode(self->root, shift, start, end < treeLen ? end : treeLen);
+    while(shift > 0 && root->count == 1) {
+        LvVectNode* child = retain(root->child[0]);
+        release(root, shift);
+        root = child;
+        shift -= LV_VECT_BITS;
+    }
+    size_t tailStart = start > treeLen ? start - treeLen : 0;
+    size_t tailEnd = end > treeLen ? end - treeLen : 0;
+    return mkTree(root, shift, self->data + tailStart, tailEnd - tailStart);
+}
+
+LvVect* lv_vect_update(LvVect* self, size_t idx, TextBufferObj* obj) {
+
+    assert(idx < self->len);
+    LvVect* res;
+    if(!self->root && self->len <= LV_VECT_FLAT_MAX) {
+        res = flatCopy(self, 0, self->len);
+        lv_expr_cleanup(&res->data[idx], 1);
+        res->data[idx] = *obj;
+        incRefCount(obj);
+    } else if(!self->root) {
+        //convert to a tree first so later updates are cheap
+        unsigned shift, tailLen;
+        TextBufferObj* tail;
+        LvVectNode* root = splitTail(self, &shift, &tail, &tailLen);
+        LvVect* tmp = mkTree(root, shift, tail, tailLen);
+        res = lv_vect_update(tmp, idx, obj);
+        lv_vect_free(tmp);
+    } else if(idx >= self->len - self->tailLen) {
+        res = mkTree(retain(self->root), self->shift, self->data, self->tailLen);
+        TextBufferObj* elem = &res->data[idx - (self->len - self->tailLen)];
+        lv_expr_cleanup(elem, 1);
+        *elem = *obj;
+        incRefCount(obj);
+    } else {
+        LvVectNode* root = updateNode(self->root, self->shift, idx, obj);
+        res = mkTree(root, self->shift, self->data, self->tailLen);
+    }
+    return res;
+}
@@ -0,0 +1,91 @@
+#ifndef VECT_H
+#define VECT_H
+#include "textbuffer.h"
+#include <stdbool.h>
+
+#define LV_VECT_BITS 5
+#define LV_VECT_WIDTH (1 << LV_VECT_BITS)
+//longest vect that is kept flat by the persistent operations
+#define LV_VECT_FLAT_MAX (2 * LV_VECT_WIDTH)
+
+/**
+ * A node in the tree of a large vect. Leaves store up to
+ * LV_VECT_WIDTH elements, inner nodes store up to LV_VECT_WIDTH
+ * children along with the cumulative number of elements under
+ * each child. Children may be partially filled (relaxed), so
+ * that vects can be sliced and concatenated without copying.
+ * Nodes are shared between vects and are never modified once
+ * they are reachable from a vect.
+ */
+struct LvVectNode {
+    size_t refCount;
+    unsigned count;
+    union {
+        TextBufferObj elem[LV_VECT_WIDTH];
+        struct {
+            size_t sizes[LV_VECT_WIDTH];
+            LvVectNode* child[LV_VECT_WIDTH];
+        };
+    };
+};
+
+/**
+ * Allocates a flat vect of the given length. The elements
+ * are uninitialized and the refCount is zero.
+ */
+LvVect* lv_vect_alloc(size_t len);
+
+/**
+ * Frees the vect and releases its elements. Called when the
+ * vect's refCount reaches zero.
+ */
+void lv_vect_free(LvVect* self);
+
+/**
+ * Releases the elements of the vect without freeing it.
+ */
+void lv_vect_releaseElems(LvVect* self);
+
+/**
+ * Marks the nodes and elements of the vect for the collector.
+ */
+void lv_vect_mark(LvVect* self);
+
+TextBufferObj* lv_vect_treeAt(LvVect* self, size_t idx);
+
+/**
+ * Returns the element at the given index, which must be in bounds.
+ * Flat vects are indexed directly, tree vects in O(log32 n) time.
+ */
+static inline TextBufferObj* lv_vect_at(LvVect* self, size_t idx) {
+
+    return self->root ? lv_vect_treeAt(self, idx) : &self->data[idx];
+}
+
+/**
+ * Returns a vect with the given object appended. The vect
+ * itself is not modified. The result has its own reference to
+ * the object and may be the vect itself if nothing changed.
+ */
+LvVect* lv_vect_append(LvVect* self, TextBufferObj* obj);
+
+/**
+ * Returns the concatenation of the two vects. Large results
+ * share the structure of both vects.
+ */
+LvVect* lv_vect_cat(LvVect* a, LvVect* b);
+
+/**
+ * Returns the elements of the vect in [start, end). Slices of
+ * tree vects share all but the boundary nodes with the vect.
+ */
+LvVect* lv_vect_slice(LvVect* self, size_t start, size_t end);
+
+/**
+ * Returns a vect with the element at the given index replaced
+ * by the given object. Large vects copy only the path to the
+ * element.
+ */
+LvVect* lv_vect_update(LvVect* self, size_t idx, TextBufferObj* obj);
+
+#endif